@@ -102,6 +102,10 @@ void ram_bootstrap(void);
 paddr_t ram_stealmem(unsigned long npages);
 void ram_getsize(paddr_t *lo, paddr_t *hi);
 
+struct addrspace;
+struct vnode;
+struct spinlock;
+
 typedef enum {
 	PG_TLB = 0,
 	PG_MEM,
@@ -115,27 +119,141 @@ struct pg_table_entry {
 	paddr_t ppage;
 	vaddr_t vpage;
 	page_status_t state;
+	bool cow;		/* page shared copy-on-write; map read-only */
+	bool swp_slot;	/* swp_offset holds a copy of the page */
 	off_t swp_offset;
+	/* reverse map of a shared frame (vm.c), while on its cm_rmap chain */
+	struct pg_table_entry *rmap_next;
+	struct addrspace *rmap_as;
 };
 
+/*
+ * Two-level page table, laid out the way the MIPS would walk it: the
+ * top bits of a user address index the page directory, the next ten
+ * bits index a second-level table of PTE pointers. Second-level tables
+ * are only allocated once something is mapped in their 4M slice, and
+ * PTEs are only allocated for pages that have been defined.
+ *
+ * pt_used[] counts the populated slots of each second-level table so
+ * that empty tables can be released and walks can skip them.
+ */
+#define PT_L1_SHIFT     22
+#define PT_L2_SHIFT     12
+#define PT_L1_ENTRIES   (USERSPACETOP >> PT_L1_SHIFT)
+#define PT_L2_ENTRIES   1024
+
+#define PT_L1_INDEX(va) ((va) >> PT_L1_SHIFT)
+#define PT_L2_INDEX(va) (((va) >> PT_L2_SHIFT) & (PT_L2_ENTRIES - 1))
+#define PT_VADDR(l1, l2) (((vaddr_t)(l1) << PT_L1_SHIFT) | \
+			  ((vaddr_t)(l2) << PT_L2_SHIFT))
+
 struct pagetable {
-	struct pg_table_entry entry;
-	struct pagetable *next;
-	struct pagetable *prev;
+	struct pg_table_entry **pt_dir[PT_L1_ENTRIES];
+	uint16_t pt_used[PT_L1_ENTRIES];
+	unsigned pt_npages;	/* total populated entries */
 };
 
+void pt_bootstrap(void);
+struct pagetable *pt_create(void);
+void pt_destroy(struct pagetable *pt);
+struct pg_table_entry *pt_lookup(struct pagetable *pt, vaddr_t vaddr);
+struct pg_table_entry *pt_insert(struct pagetable *pt, vaddr_t vaddr);
+void pt_remove(struct pagetable *pt, vaddr_t vaddr);
+void pt_remove_range(struct pagetable *pt, vaddr_t start, vaddr_t end,
+		     void (*func)(struct pg_table_entry *pte, void *data),
+		     void *data);
+int pt_walk(struct pagetable *pt,
+	    int (*func)(struct pg_table_entry *pte, void *data), void *data);
+
+/*
+ * Largest block the physical page allocator hands out: 2^CM_MAX_ORDER
+ * contiguous pages.
+ */
+#define CM_MAX_ORDER 12
+
 struct coremap_t {
 	paddr_t ppage; 				/* physical address of this page */
 	struct pg_table_entry *pte; /* page table entry that is pointing to this addr */
+	struct addrspace *as;		/* address space owning pte; NULL if shared */
 	/* to be used in swapping */
-	bool lru_bit;
-	/* unused for now, leak memory */
-	bool nxt_pg;
-	bool status;
+	bool lru_bit;				/* referenced since the clock hand passed */
+	bool dirty;					/* differs from its swap copy, if any */
+	bool busy;					/* being set up or written out; don't evict */
+	bool status;				/* allocated */
+	int refcount;				/* PTEs sharing this page (COW) */
+	struct pg_table_entry *cm_rmap;	/* PTEs sharing it, if no owner */
+	/* buddy allocator: block order and free list links (indices) */
+	uint8_t cm_order;
+	int cm_next;
+	int cm_prev;
+	/* text cache (textcache.c): whose text this is, if anyone's */
+	struct vnode *cm_vnode;
+	vaddr_t cm_vpage;
+	int cm_tcnext;
+	/* page merging (ksm.c) */
+	bool cm_mergeable;			/* private page of its owner */
+	bool cm_merged;				/* shared copy in the merge table */
+	uint32_t cm_hash;			/* of the contents, if merged */
+	int cm_ksmnext;
 };
 
+extern struct coremap_t *coremap;
+extern int ppages;
+extern struct spinlock phymem_lock;
+
 paddr_t getppages(unsigned long npages);
+unsigned vm_freepages(void);
 void free_coremap(paddr_t addr);
+void vm_tlbinvalidate(struct addrspace *as, vaddr_t vaddr);
+void vm_tlbflush_as(struct addrspace *as);
+void vm_asid_activate(struct addrspace *as);
+
+/* User pages, swap-aware (see vm.c) */
+paddr_t alloc_upage(struct addrspace *as, struct pg_table_entry *pte);
+void coremap_unbusy(paddr_t addr);
+void pte_wait_busy(struct pg_table_entry *pte);
+void pte_wakeup(void);
+int vm_share_page(struct addrspace *old_as, struct pg_table_entry *old_pte,
+		  struct addrspace *new_as, struct pg_table_entry *new_pte,
+		  bool cow);
+int vm_writeback_page(struct addrspace *as, struct pg_table_entry *pte,
+		      struct vnode *vn, off_t offset, size_t len);
+void vm_free_pte_page(struct addrspace *as, struct pg_table_entry *pte);
+void vm_rss_adjust(struct addrspace *as, int delta, bool zero);
+void vm_printstats(void);
+
+/* Text pages shared between processes running one file (textcache.c) */
+void textcache_bootstrap(void);
+int textcache_lookup(struct vnode *v, vaddr_t vpage);
+void textcache_enter(int index, struct vnode *v, vaddr_t vpage);
+void textcache_forget(int index);
+void textcache_purge(struct vnode *v);
+void textcache_printstats(void);
+
+/* Merging of identical private pages (ksm.c, vm.c) */
+void ksm_bootstrap(void);
+void ksm_enter(int index, uint32_t hash);
+void ksm_forget(int index);
+int ksm_setenabled(bool on, unsigned rate);
+void ksm_printstats(void);
+bool vm_merge_grab(int index);
+void vm_merge_release(int index);
+void vm_merge(int index, int target, uint32_t hash);
+void vm_merge_zero(int index);
+
+/* Large kernel allocations mapped in kseg2 (kvm.c, vm.c) */
+void kvm_bootstrap(void);
+int kvm_fault(int faulttype, vaddr_t vaddr);
+void vm_tlbload_kernel(vaddr_t vaddr, paddr_t paddr);
+void vm_tlbflush_kernel(void);
+bool vm_can_sleep(void);
+
+/* Fault-around tuning (see vm.c) */
+void vm_fa_account(struct addrspace *as);
+void vm_fa_setwindow(unsigned maxwindow);
+void vm_fa_setreport(bool report);
+void vm_fa_printstats(void);
+
 /*
  * TLB shootdown bits.
  *
@@ -144,13 +262,33 @@ void free_coremap(paddr_t addr);
 
 struct tlbshootdown {
 	/*
-	 * Change this to what you need for your VM design.
+	 * A page and the ASID (with its generation) it was mapped
+	 * under on the target CPU. The address space itself may be
+	 * gone by the time the target gets to it.
 	 */
-	struct addrspace *ts_addrspace;
 	vaddr_t ts_vaddr;
+	uint32_t ts_asid;
 };
 
 #define TLBSHOOTDOWN_MAX 16
 
+/* ts_asid meaning every global (kseg2) entry rather than one page */
+#define TLBSHOOTDOWN_KERNEL 0xffffffff
+
+/*
+ * Shootdowns collected by the VM system before sending them off; see
+ * vm_tlbbatch_add() in vm.c.
+ */
+struct tlbbatch {
+	bool tb_wait;			/* flush waits for the targets */
+	unsigned tb_count;
+	struct cpu *tb_cpu[TLBSHOOTDOWN_MAX];
+	struct tlbshootdown tb_ts[TLBSHOOTDOWN_MAX];
+};
+
+void vm_tlbbatch_init(struct tlbbatch *tb, bool wait);
+void vm_tlbbatch_add(struct tlbbatch *tb, struct addrspace *as, vaddr_t vaddr);
+void vm_tlbbatch_flush(struct tlbbatch *tb);
+
 
 #endif /* _MIPS_VM_H_ */
@@ -187,6 +187,39 @@ syscall(struct trapframe *tf)
 	case SYS_sbrk:
 		err = sys_sbrk((intptr_t)tf->tf_a0, &retval);
 		break;
+
+	case SYS_mmap:
+		err = sys_mmap(tf->tf_a0, tf->tf_a1, tf->tf_a2, tf->tf_a3,
+			       (userptr_t)(tf->tf_sp + 16), &retval);
+		break;
+
+	case SYS_munmap:
+		err = sys_munmap(tf->tf_a0, tf->tf_a1);
+		break;
+
+	case SYS_msync:
+		err = sys_msync(tf->tf_a0, tf->tf_a1, tf->tf_a2);
+		break;
+
+	case SYS_fsync:
+		err = sys_fsync(tf->tf_a0);
+		break;
+
+	case SYS_shmget:
+		err = sys_shmget(tf->tf_a0, tf->tf_a1, tf->tf_a2, &retval);
+		break;
+
+	case SYS_shmat:
+		err = sys_shmat(tf->tf_a0, tf->tf_a1, tf->tf_a2, &retval);
+		break;
+
+	case SYS_shmdt:
+		err = sys_shmdt(tf->tf_a0);
+		break;
+
+	case SYS_shmctl:
+		err = sys_shmctl(tf->tf_a0, tf->tf_a1, (userptr_t)tf->tf_a2);
+		break;
 	
 	default:
 		kprintf("Unknown syscall %d\n", callno);
@@ -106,6 +106,37 @@ vm_tlbshootdown(const struct tlbshootdown *ts)
 	panic("dumbvm tried to do tlb shootdown?!\n");
 }
 
+bool
+vm_idle_zero(void)
+{
+	return false;
+}
+
+void
+textcache_purge(struct vnode *v)
+{
+	(void)v;
+}
+
+vaddr_t
+kvm_alloc(unsigned npages)
+{
+	(void)npages;
+	return 0;
+}
+
+bool
+kvm_free(vaddr_t addr)
+{
+	(void)addr;
+	return false;
+}
+
+void
+kvm_printstats(void)
+{
+}
+
 int
 vm_fault(int faulttype, vaddr_t faultaddress)
 {
@@ -5,132 +5,1774 @@
 #include <spinlock.h>
 #include <thread.h>
 #include <current.h>
+#include <wchan.h>
+#include <cpu.h>
 #include <mips/tlb.h>
+#include <platform/maxcpus.h>
+#include <uio.h>
+#include <vnode.h>
 #include <addrspace.h>
 #include <vm.h>
 #include <mips/vm.h>
+#include <swap.h>
+#include <shm.h>
+#include <kmem.h>
 
 
-static struct spinlock phymem_lock = SPINLOCK_INITIALIZER;
+struct spinlock phymem_lock = SPINLOCK_INITIALIZER;
 static struct spinlock tlb_lock = SPINLOCK_INITIALIZER;
 static bool vm_initialized = false;
 struct coremap_t *coremap = NULL;
-static int ppages = 0;
+int ppages = 0;
 int kpages_in_use = 0;
+static unsigned rmap_owned = 0;		/* shared frames back to one owner */
+
+/* Threads waiting for a PG_BUSY page to finish its trip to/from swap */
+static struct wchan *vm_busy_wchan;
+
+/*
+ * Buddy allocator over the coremap. A free block of 2^k pages is
+ * linked into freelist[k] through the cm_next/cm_prev indices of its
+ * first coremap entry, which also records k in cm_order. Allocated
+ * blocks keep their order in the first entry so they can be freed
+ * from the address alone.
+ */
+static int freelist[CM_MAX_ORDER + 1];
+static paddr_t cm_base;		/* physical address of coremap[0].ppage */
+static int free_pages = 0;
 
 static void coremap_init(paddr_t lo_ram);
+static int zpool_take(void);
+static void zpool_drain(void);
 static void as_zero_region(paddr_t paddr, unsigned npages);
+static void buddy_free(int index);
+
+#define CM_INDEX(paddr) ((int)(((paddr) - cm_base) / PAGE_SIZE))
+
+/*
+ * Pool of frames zeroed ahead of time by idle CPUs (vm_idle_zero), so
+ * most single-page allocations neither zero anything themselves nor
+ * hold phymem_lock while somebody else does. Pool frames are allocated
+ * as far as the buddy lists are concerned and are chained through
+ * cm_next. The pool is emptied back into the buddy lists whenever a
+ * bigger block can't be found otherwise.
+ */
+#define ZPOOL_MAX		64
+#define ZPOOL_RAMFRACTION	32	/* at most 1/32 of RAM */
+
+static int zpool_head = -1;
+static unsigned zpool_count = 0;
+static unsigned zpool_target = 0;
+static unsigned zpool_hits = 0;		/* allocations served from it */
+static unsigned zpool_misses = 0;	/* ...that had to zero themselves */
+static unsigned zpool_filled = 0;	/* frames zeroed while idle */
+
+/*
+ * One frame of zeros shared read-only by every never-written anonymous
+ * page that has only been read. It holds a reference of its own, so it
+ * is never freed and looks permanently shared to cow_break and swap.
+ */
+static paddr_t zero_ppage;
+static unsigned zero_faults = 0;	/* pages mapped to it */
+static unsigned zero_copies = 0;	/* ...later written */
+static unsigned rss_total = 0;		/* resident user PTEs, all processes */
+
+void
+vm_bootstrap(void)
+{
+	paddr_t lo_ram, hi_ram;
+	int coremap_pages;
+	
+	ram_getsize(&lo_ram, &hi_ram);
+	ppages = (hi_ram - lo_ram)/PAGE_SIZE;
+	coremap = (struct coremap_t *)PADDR_TO_KVADDR(lo_ram);
+	coremap_pages = (sizeof(struct coremap_t) * ppages + PAGE_SIZE - 1)
+		/ PAGE_SIZE;
+	lo_ram += (coremap_pages * PAGE_SIZE);
+	ppages -= coremap_pages;
+	coremap_init(lo_ram);
+	vm_initialized = true;
+
+	zero_ppage = getppages(1);
+	if (zero_ppage == 0) {
+		panic("vm_bootstrap: no memory for the zero page\n");
+	}
+
+	zpool_target = ppages / ZPOOL_RAMFRACTION;
+	if (zpool_target > ZPOOL_MAX) {
+		zpool_target = ZPOOL_MAX;
+	}
+
+	vm_busy_wchan = wchan_create("vm_busy");
+	if (vm_busy_wchan == NULL) {
+		panic("vm_bootstrap: could not create wait channel\n");
+	}
+	textcache_bootstrap();
+	kvm_bootstrap();
+	pt_bootstrap();
+}
+
+static void
+freelist_push(int index, int order)
+{
+	coremap[index].cm_order = order;
+	coremap[index].cm_prev = -1;
+	coremap[index].cm_next = freelist[order];
+	if (freelist[order] >= 0) {
+		coremap[freelist[order]].cm_prev = index;
+	}
+	freelist[order] = index;
+}
+
+static void
+freelist_remove(int index)
+{
+	int order = coremap[index].cm_order;
+
+	if (coremap[index].cm_prev >= 0) {
+		coremap[coremap[index].cm_prev].cm_next = coremap[index].cm_next;
+	} else {
+		KASSERT(freelist[order] == index);
+		freelist[order] = coremap[index].cm_next;
+	}
+	if (coremap[index].cm_next >= 0) {
+		coremap[coremap[index].cm_next].cm_prev = coremap[index].cm_prev;
+	}
+	coremap[index].cm_next = coremap[index].cm_prev = -1;
+}
+
+/*
+ * Take a block of 2^ORDER pages off the free lists, splitting a
+ * bigger block if need be. Returns the coremap index, or -1.
+ */
+static int
+buddy_alloc(int order)
+{
+	int k, index, i;
+
+	KASSERT(spinlock_do_i_hold(&phymem_lock));
+
+	for (k = order; k <= CM_MAX_ORDER && freelist[k] < 0; k++);
+	if (k > CM_MAX_ORDER) {
+		return -1;
+	}
+	index = freelist[k];
+	freelist_remove(index);
+
+	/* Give back the upper halves we don't need */
+	while (k > order) {
+		k--;
+		freelist_push(index + (1 << k), k);
+	}
+
+	for (i = 0; i < (1 << order); i++) {
+		coremap[index + i].status = true;
+	}
+	coremap[index].cm_order = order;
+	coremap[index].refcount = 1;
+	free_pages -= (1 << order);
+	return index;
+}
+
+/*
+ * Return the block starting at INDEX and merge it with its buddies
+ * for as long as they are free.
+ */
+static void
+buddy_free(int index)
+{
+	int order, buddy, i;
+
+	KASSERT(spinlock_do_i_hold(&phymem_lock));
+	KASSERT(index >= 0 && index < ppages);
+	KASSERT(coremap[index].status == true);
+
+	order = coremap[index].cm_order;
+	coremap[index].refcount = 0;
+	coremap[index].cm_rmap = NULL;
+	for (i = 0; i < (1 << order); i++) {
+		coremap[index + i].status = false;
+		coremap[index + i].pte = NULL;
+		coremap[index + i].as = NULL;
+		coremap[index + i].busy = false;
+		coremap[index + i].lru_bit = false;
+		coremap[index + i].dirty = false;
+		coremap[index + i].cm_mergeable = false;
+	}
+	free_pages += (1 << order);
+
+	while (order < CM_MAX_ORDER) {
+		buddy = index ^ (1 << order);
+		if (buddy + (1 << order) > ppages ||
+		    coremap[buddy].status == true ||
+		    coremap[buddy].cm_order != order ||
+		    (coremap[buddy].cm_prev < 0 && freelist[order] != buddy)) {
+			break;
+		}
+		freelist_remove(buddy);
+		if (buddy < index) {
+			index = buddy;
+		}
+		order++;
+	}
+	freelist_push(index, order);
+}
+
+static int
+pages_to_order(unsigned long npages)
+{
+	int order = 0;
+
+	while ((1UL << order) < npages) {
+		order++;
+	}
+	return order;
+}
+
+paddr_t
+getppages(unsigned long npages)
+{
+	paddr_t addr = 0;
+	unsigned freenow;
+	int order, index;
+	
+	if (!vm_initialized) {
+		spinlock_acquire(&phymem_lock);
+		addr = ram_stealmem(npages);
+		spinlock_release(&phymem_lock);
+		return addr;
+	}
+
+	order = pages_to_order(npages);
+	if (order > CM_MAX_ORDER) {
+		return 0;
+	}
+
+	spinlock_acquire(&phymem_lock);
+	if (order == 0 && zpool_head >= 0) {
+		index = zpool_take();
+		zpool_hits++;
+		freenow = free_pages + zpool_count;
+		spinlock_release(&phymem_lock);
+		pageout_check(freenow);
+		return coremap[index].ppage;
+	}
+
+	index = buddy_alloc(order);
+	if (index < 0 && zpool_count > 0) {
+		zpool_drain();
+		index = buddy_alloc(order);
+	}
+	if (index >= 0) {
+		addr = coremap[index].ppage;
+	}
+	if (order == 0) {
+		zpool_misses++;
+	}
+	freenow = free_pages + zpool_count;
+	spinlock_release(&phymem_lock);
+	pageout_check(freenow);
+
+	/* Nobody else can get at the block now; zero it unlocked */
+	if (addr != 0) {
+		as_zero_region(addr, 1 << order);
+	}
+	return addr;
+}
+
+/*
+ * Frames that could be handed out without evicting anything. Not
+ * locked; for the pageout daemon's watermark checks.
+ */
+unsigned
+vm_freepages(void)
+{
+	return free_pages + zpool_count;
+}
+
+/* Pop a zeroed frame off the pool, or -1. Called with phymem_lock held. */
+static int
+zpool_take(void)
+{
+	int index = zpool_head;
+
+	KASSERT(spinlock_do_i_hold(&phymem_lock));
+	if (index >= 0) {
+		zpool_head = coremap[index].cm_next;
+		coremap[index].cm_next = -1;
+		zpool_count--;
+	}
+	return index;
+}
+
+static void
+zpool_drain(void)
+{
+	int index;
+
+	KASSERT(spinlock_do_i_hold(&phymem_lock));
+	while ((index = zpool_take()) >= 0) {
+		buddy_free(index);
+	}
+}
+
+/*
+ * Called by the scheduler on a CPU with nothing to run. Zero one frame
+ * for the pool, if it needs topping up and memory isn't short. Returns
+ * true if it did some work, so the caller checks for threads again
+ * before halting.
+ */
+bool
+vm_idle_zero(void)
+{
+	int index;
+
+	if (!vm_initialized) {
+		return false;
+	}
+
+	spinlock_acquire(&phymem_lock);
+	if (zpool_count >= zpool_target ||
+	    free_pages <= (int)zpool_target) {
+		spinlock_release(&phymem_lock);
+		return false;
+	}
+	index = buddy_alloc(0);
+	spinlock_release(&phymem_lock);
+	if (index < 0) {
+		return false;
+	}
+
+	as_zero_region(coremap[index].ppage, 1);
+
+	spinlock_acquire(&phymem_lock);
+	coremap[index].cm_next = zpool_head;
+	zpool_head = index;
+	zpool_count++;
+	zpool_filled++;
+	spinlock_release(&phymem_lock);
+	return true;
+}
+
+/*
+ * Whether the current thread may block for disk I/O to free memory:
+ * not in an interrupt handler and not holding any spinlocks.
+ */
+bool
+vm_can_sleep(void)
+{
+	return vm_initialized && curthread != NULL &&
+		!curthread->t_in_interrupt && curthread->t_curspl == 0;
+}
+
+/* Allocate/free some kernel-space virtual pages */
+vaddr_t 
+alloc_kpages(int npages)
+{
+	paddr_t pa;
+	
+	pa = getppages(npages);
+	if (pa == 0 && kmem_cache_reap()) {
+		/* The object caches were holding some */
+		pa = getppages(npages);
+	}
+	if (pa == 0 && npages == 1 && vm_can_sleep()) {
+		/* Push a user page out to make room */
+		pa = swap_out();
+		if (pa != 0) {
+			as_zero_region(pa, 1);
+		}
+	}
+	if (pa == 0) {
+		return 0;
+	}
+	if (vm_initialized) {
+		spinlock_acquire(&phymem_lock);
+		kpages_in_use += 1 << coremap[CM_INDEX(pa)].cm_order;
+		spinlock_release(&phymem_lock);
+	}
+	return PADDR_TO_KVADDR(pa);
+}
+
+void 
+free_kpages(vaddr_t addr)
+{
+	paddr_t pa;
+	int index;
+
+	pa = addr - MIPS_KSEG0;
+	if (!vm_initialized || pa < cm_base) {
+		/* stolen before the coremap existed; leak it */
+		return;
+	}
+	index = CM_INDEX(pa);
+	KASSERT(index < ppages);
+
+	spinlock_acquire(&phymem_lock);
+	kpages_in_use -= 1 << coremap[index].cm_order;
+	buddy_free(index);
+	spinlock_release(&phymem_lock);
+}
+
+/*
+ * Reverse map. A frame mapped by one user page has that PTE and its
+ * address space in the coremap entry, which is what swap needs to
+ * evict it. A shared frame has no owner; the PTEs sharing it through
+ * fork, the text cache or page merging are chained from cm_rmap
+ * instead, so that when all but one of them are gone the last one
+ * owns the frame again (coremap_decref) and it can be evicted. Shared
+ * memory attachments and the zero page aren't chained; their frames
+ * never get an owner back. All under phymem_lock.
+ */
+static void
+rmap_add(int index, struct addrspace *as, struct pg_table_entry *pte)
+{
+	KASSERT(spinlock_do_i_hold(&phymem_lock));
+	KASSERT(coremap[index].pte == NULL);
+	pte->rmap_as = as;
+	pte->rmap_next = coremap[index].cm_rmap;
+	coremap[index].cm_rmap = pte;
+}
+
+/* The frame at INDEX is about to be shared: chain its owner, if any */
+static void
+rmap_share(int index)
+{
+	struct coremap_t *cm = &coremap[index];
+	struct pg_table_entry *pte = cm->pte;
+	struct addrspace *as = cm->as;
+
+	KASSERT(spinlock_do_i_hold(&phymem_lock));
+	if (pte != NULL) {
+		cm->pte = NULL;
+		cm->as = NULL;
+		rmap_add(index, as, pte);
+	}
+}
+
+/* PTE no longer maps the frame at INDEX */
+static void
+rmap_remove(int index, struct pg_table_entry *pte)
+{
+	struct pg_table_entry **pp;
+
+	KASSERT(spinlock_do_i_hold(&phymem_lock));
+	if (coremap[index].pte == pte) {
+		coremap[index].pte = NULL;
+		coremap[index].as = NULL;
+		return;
+	}
+	for (pp = &coremap[index].cm_rmap; *pp != NULL;
+	     pp = &(*pp)->rmap_next) {
+		if (*pp == pte) {
+			*pp = pte->rmap_next;
+			pte->rmap_next = NULL;
+			return;
+		}
+	}
+}
+
+/*
+ * Drop a reference to the frame at INDEX. Every chained PTE holds one,
+ * so a frame left with a single reference and a non-empty chain is
+ * down to that one PTE, which becomes its owner.
+ */
+static void
+coremap_decref(int index)
+{
+	struct coremap_t *cm = &coremap[index];
+
+	KASSERT(spinlock_do_i_hold(&phymem_lock));
+	KASSERT(cm->refcount > 0);
+	if (--cm->refcount == 0) {
+		KASSERT(cm->cm_rmap == NULL);
+		textcache_forget(index);
+		ksm_forget(index);
+		buddy_free(index);
+	}
+	else if (cm->refcount == 1 && cm->cm_rmap != NULL) {
+		KASSERT(cm->cm_rmap->rmap_next == NULL);
+		cm->pte = cm->cm_rmap;
+		cm->as = cm->pte->rmap_as;
+		cm->cm_rmap = NULL;
+		/* A merged copy that can be evicted can't stay in the table */
+		ksm_forget(index);
+		rmap_owned++;
+	}
+}
+
+/*
+ * Drop a reference to a user page, freeing it with the last one.
+ */
+void 
+free_coremap(paddr_t addr)
+{
+	spinlock_acquire(&phymem_lock);
+	coremap_decref(CM_INDEX(addr));
+	spinlock_release(&phymem_lock);
+}
+
+/*
+ * Get a zeroed frame for user page PTE in address space AS, evicting
+ * somebody else's page if RAM is full. The frame comes back marked
+ * busy so it can't be picked as a victim before the caller has
+ * finished setting it up and calls coremap_unbusy().
+ */
+static paddr_t
+upage_claim(paddr_t pa, struct addrspace *as, struct pg_table_entry *pte)
+{
+	int index;
+
+	index = CM_INDEX(pa);
+	spinlock_acquire(&phymem_lock);
+	coremap[index].as = as;
+	coremap[index].pte = pte;
+	coremap[index].busy = true;
+	coremap[index].lru_bit = true;
+	coremap[index].dirty = true;
+	coremap[index].cm_mergeable = false;
+	spinlock_release(&phymem_lock);
+	return pa;
+}
+
+paddr_t
+alloc_upage(struct addrspace *as, struct pg_table_entry *pte)
+{
+	paddr_t pa;
+
+	pa = getppages(1);
+	if (pa == 0) {
+		if (!vm_can_sleep()) {
+			return 0;
+		}
+		pa = swap_out();
+		if (pa == 0) {
+			return 0;
+		}
+		as_zero_region(pa, 1);
+	}
+	return upage_claim(pa, as, pte);
+}
+
+/*
+ * Like alloc_upage, but only from free memory: for pages nobody has
+ * asked for yet, which aren't worth evicting anything for.
+ */
+static paddr_t
+alloc_upage_nowait(struct addrspace *as, struct pg_table_entry *pte)
+{
+	paddr_t pa;
+
+	pa = getppages(1);
+	if (pa == 0) {
+		return 0;
+	}
+	return upage_claim(pa, as, pte);
+}
+
+void
+coremap_unbusy(paddr_t addr)
+{
+	KASSERT(spinlock_do_i_hold(&phymem_lock));
+	coremap[CM_INDEX(addr)].busy = false;
+}
+
+/*
+ * Wait until PTE is no longer in flight to or from swap. Called and
+ * returns with phymem_lock held.
+ */
+void
+pte_wait_busy(struct pg_table_entry *pte)
+{
+	KASSERT(spinlock_do_i_hold(&phymem_lock));
+	while (pte->state == PG_BUSY) {
+		wchan_lock(vm_busy_wchan);
+		spinlock_release(&phymem_lock);
+		wchan_sleep(vm_busy_wchan);
+		spinlock_acquire(&phymem_lock);
+	}
+}
+
+void
+pte_wakeup(void)
+{
+	wchan_wakeall(vm_busy_wchan);
+}
+
+/*
+ * PTE's page is about to be written: its swap copy, if it has one, is
+ * now stale. Called with phymem_lock held.
+ */
+static void
+page_dirty(struct pg_table_entry *pte)
+{
+	KASSERT(spinlock_do_i_hold(&phymem_lock));
+	coremap[CM_INDEX(pte->ppage)].dirty = true;
+	if (pte->swp_slot) {
+		swap_free(pte->swp_offset);
+		pte->swp_slot = false;
+	}
+}
+
+/*
+ * Map the cached text frame at INDEX into PTE copy-on-write, taking it
+ * away from its owner if it had one (it can't be evicted until it is
+ * down to one user again). Called with phymem_lock held.
+ */
+static void
+text_share(struct addrspace *as, struct pg_table_entry *pte, int index)
+{
+	KASSERT(spinlock_do_i_hold(&phymem_lock));
+	if (coremap[index].as != NULL) {
+		coremap[index].pte->cow = true;
+	}
+	rmap_share(index);
+	rmap_add(index, as, pte);
+	coremap[index].refcount++;
+	coremap[index].lru_bit = true;
+	pte->ppage = coremap[index].ppage;
+	pte->cow = true;
+	pte->state = PG_MEM;
+	vm_rss_adjust(as, 1, false);
+}
+
+/*
+ * Map page PAGENO of shared memory segment SEG into PTE. The frame is
+ * the segment's, shared with every other attacher, so there is no
+ * copy-on-write and no owner. Called with phymem_lock held; drops it
+ * (with the PTE busy) while the segment finds or allocates the frame.
+ */
+static int
+shm_map(struct addrspace *as, struct pg_table_entry *pte,
+	struct shm_segment *seg, unsigned pageno)
+{
+	paddr_t pa;
+	int result;
+
+	KASSERT(spinlock_do_i_hold(&phymem_lock));
+	pte->state = PG_BUSY;
+	spinlock_release(&phymem_lock);
+
+	result = shm_getpage(seg, pageno, &pa);
+
+	spinlock_acquire(&phymem_lock);
+	if (result) {
+		pte->state = PG_UNALOC;
+	}
+	else {
+		coremap[CM_INDEX(pa)].refcount++;
+		pte->ppage = pa;
+		pte->cow = false;
+		pte->state = PG_MEM;
+		vm_rss_adjust(as, 1, false);
+	}
+	pte_wakeup();
+	return result;
+}
+
+/*
+ * Collect in RA the PTE of a page out on swap followed by those of the
+ * pages after it in the same region whose slots follow its slot, up to
+ * swap_readahead in all, and mark them busy: one read brings them all
+ * back. Called with phymem_lock held.
+ */
+static unsigned
+swap_gather(struct addrspace *as, struct pg_table_entry *pte,
+	    struct pg_table_entry **ra)
+{
+	struct pg_table_entry *next;
+	struct as_region *rg;
+	vaddr_t va;
+	unsigned n;
+
+	KASSERT(spinlock_do_i_hold(&phymem_lock));
+	KASSERT(pte->state == PG_SWP);
+
+	pte->state = PG_BUSY;
+	ra[0] = pte;
+	rg = as_find_region(as, pte->vpage);
+	for (n = 1; rg != NULL && n < swap_readahead; n++) {
+		va = pte->vpage + n * PAGE_SIZE;
+		if (va >= rg->rg_end) {
+			break;
+		}
+		next = pt_lookup(as->page_table, va);
+		if (next == NULL || next->state != PG_SWP ||
+		    next->swp_offset != pte->swp_offset + n * PAGE_SIZE) {
+			break;
+		}
+		next->state = PG_BUSY;
+		ra[n] = next;
+	}
+	return n;
+}
+
+/*
+ * Bring PTE's page back from swap, along with the neighbours that
+ * swap_gather finds next to it, as far as there are free frames for
+ * them. The neighbours come in unreferenced, so the clock takes them
+ * back first if they turn out not to be wanted. Called like page_in.
+ */
+static int
+swap_page_in(struct addrspace *as, struct pg_table_entry *pte)
+{
+	struct pg_table_entry *ra[SWAP_CLUSTER_MAX];
+	paddr_t frames[SWAP_CLUSTER_MAX];
+	off_t offset = pte->swp_offset;
+	unsigned i, n, got = 0;
+	int index, result = 0;
+
+	n = swap_gather(as, pte, ra);
+	spinlock_release(&phymem_lock);
+
+	frames[0] = alloc_upage(as, pte);
+	if (frames[0] == 0) {
+		result = ENOMEM;
+	}
+	else {
+		for (got = 1; got < n; got++) {
+			frames[got] = alloc_upage_nowait(as, ra[got]);
+			if (frames[got] == 0) {
+				break;
+			}
+		}
+		result = swap_in(frames, got, offset);
+		if (result) {
+			for (i = 0; i < got; i++) {
+				free_coremap(frames[i]);
+			}
+			got = 0;
+		}
+	}
+
+	spinlock_acquire(&phymem_lock);
+	for (i = 0; i < n; i++) {
+		if (i >= got) {
+			ra[i]->state = PG_SWP;
+			continue;
+		}
+		index = CM_INDEX(frames[i]);
+		ra[i]->ppage = frames[i];
+		ra[i]->state = PG_MEM;
+		coremap[index].dirty = false;
+		coremap[index].lru_bit = (i == 0);
+		coremap_unbusy(frames[i]);
+		vm_rss_adjust(as, 1, false);
+	}
+	pte_wakeup();
+	return result;
+}
+
+/*
+ * Make a non-resident page (never touched, or out on swap) resident.
+ * A page that was never touched is zero filled, or read in from the
+ * executable if it is part of one; read-only text comes from the text
+ * cache if another process running the same file has it already. It
+ * starts out clean either way: it can be dropped and filled again, and
+ * a swapped-in one keeps its slot until written.
+ * Called with phymem_lock held; drops it while allocating and doing
+ * I/O and marks the PTE busy meanwhile so nobody else touches it.
+ */
+static int
+page_in(struct addrspace *as, struct pg_table_entry *pte)
+{
+	page_status_t oldstate = pte->state;
+	struct vnode *text = NULL;
+	struct as_region *rg;
+	paddr_t pa;
+	int index, result = 0;
+
+	KASSERT(spinlock_do_i_hold(&phymem_lock));
+	KASSERT(oldstate == PG_UNALOC || oldstate == PG_SWP);
+
+	if (oldstate == PG_UNALOC) {
+		rg = as_find_region(as, pte->vpage);
+		if (rg != NULL && rg->rg_backing == RB_SHM) {
+			return shm_map(as, pte, rg->rg_shm,
+				       (pte->vpage - rg->rg_start) / PAGE_SIZE);
+		}
+		text = as_text_vnode(as, pte->vpage);
+	}
+	if (text != NULL) {
+		/* A frame on its way out can't be shared; read our own */
+		index = textcache_lookup(text, pte->vpage);
+		if (index >= 0 && !coremap[index].busy) {
+			text_share(as, pte, index);
+			return 0;
+		}
+	}
+	if (oldstate == PG_SWP) {
+		return swap_page_in(as, pte);
+	}
+
+	pte->state = PG_BUSY;
+	spinlock_release(&phymem_lock);
+
+	pa = alloc_upage(as, pte);
+	if (pa == 0) {
+		result = ENOMEM;
+	}
+	else {
+		result = as_fill_page(as, pte->vpage, pa);
+		if (result) {
+			free_coremap(pa);
+		}
+	}
+
+	spinlock_acquire(&phymem_lock);
+	if (result) {
+		pte->state = oldstate;
+	}
+	else {
+		pte->ppage = pa;
+		pte->state = PG_MEM;
+		coremap[CM_INDEX(pa)].dirty = false;
+		coremap_unbusy(pa);
+		vm_rss_adjust(as, 1, false);
+		if (text != NULL) {
+			textcache_enter(CM_INDEX(pa), text, pte->vpage);
+		}
+	}
+	pte_wakeup();
+	return result;
+}
+
+/*
+ * Share OLD_PTE's page with NEW_PTE (for fork), copy-on-write if COW
+ * is set and truly shared otherwise (MAP_SHARED mappings). A private
+ * page that is out on swap stays there, and both PTEs use its slot;
+ * each reads its own copy back when it needs it. A MAP_SHARED one is
+ * brought back in first so both can share the frame. Shared frames
+ * are left alone by swap until they are down to one user again.
+ */
+int
+vm_share_page(struct addrspace *old_as, struct pg_table_entry *old_pte,
+	      struct addrspace *new_as, struct pg_table_entry *new_pte,
+	      bool cow)
+{
+	int result = 0;
+	int index;
+
+	spinlock_acquire(&phymem_lock);
+	pte_wait_busy(old_pte);
+	if (old_pte->state == PG_SWP && cow) {
+		KASSERT(old_pte->swp_slot);
+		swap_dup(old_pte->swp_offset);
+		new_pte->swp_offset = old_pte->swp_offset;
+		new_pte->swp_slot = true;
+		new_pte->cow = old_pte->cow;
+		new_pte->state = PG_SWP;
+		spinlock_release(&phymem_lock);
+		return 0;
+	}
+	if (old_pte->state == PG_SWP) {
+		result = page_in(old_as, old_pte);
+	}
+	if (result == 0 && old_pte->state != PG_UNALOC) {
+		/*
+		 * The frame may end up with either PTE, and only this one
+		 * has the slot; whoever keeps it writes it out afresh. A
+		 * clean page without one (e.g. text) can stay clean: it
+		 * can still be read back from where it came from.
+		 */
+		if (old_pte->swp_slot) {
+			page_dirty(old_pte);
+		}
+		index = CM_INDEX(old_pte->ppage);
+		coremap[index].refcount++;
+		/* Frames that never have an owner (shm, zero) stay that way */
+		if (coremap[index].pte != NULL ||
+		    coremap[index].cm_rmap != NULL) {
+			rmap_share(index);
+			rmap_add(index, new_as, new_pte);
+		}
+		if (cow) {
+			old_pte->cow = true;
+		}
+		new_pte->cow = old_pte->cow;
+		new_pte->ppage = old_pte->ppage;
+		new_pte->state = PG_MEM;
+		vm_rss_adjust(new_as, 1, new_pte->ppage == zero_ppage);
+	}
+	spinlock_release(&phymem_lock);
+	return result;
+}
+
+/*
+ * Give up whatever backs PTE: its frame (or its share of one), or its
+ * swap slot. Waits for any page-out in progress to finish first.
+ */
+void
+vm_free_pte_page(struct addrspace *as, struct pg_table_entry *pte)
+{
+	spinlock_acquire(&phymem_lock);
+	pte_wait_busy(pte);
+	switch (pte->state) {
+	    case PG_MEM:
+	    case PG_TLB:
+		vm_rss_adjust(as, -1, pte->ppage == zero_ppage);
+		rmap_remove(CM_INDEX(pte->ppage), pte);
+		coremap_decref(CM_INDEX(pte->ppage));
+		break;
+	    default:
+		break;
+	}
+	if (pte->swp_slot) {
+		swap_free(pte->swp_offset);
+		pte->swp_slot = false;
+	}
+	pte->state = PG_UNALOC;
+	pte->ppage = 0;
+	spinlock_release(&phymem_lock);
+}
+
+/*
+ * Write PTE's page (at most LEN bytes of it) to VN at OFFSET if it
+ * holds changes the file doesn't have: it is dirty, or has a swap
+ * slot. For MAP_SHARED mappings; AS must be the current address
+ * space. Afterwards the page is clean with no slot, so it can be
+ * dropped and read back from the file. A frame other processes map
+ * too stays dirty, since they may still be writing to it.
+ */
+int
+vm_writeback_page(struct addrspace *as, struct pg_table_entry *pte,
+		  struct vnode *vn, off_t offset, size_t len)
+{
+	page_status_t oldstate;
+	struct iovec iov;
+	struct uio ku;
+	bool shared;
+	int index, result = 0;
+
+	spinlock_acquire(&phymem_lock);
+	pte_wait_busy(pte);
+	if (pte->state == PG_SWP) {
+		result = page_in(as, pte);
+		if (result) {
+			spinlock_release(&phymem_lock);
+			return result;
+		}
+	}
+	if (pte->state == PG_UNALOC) {
+		spinlock_release(&phymem_lock);
+		return 0;
+	}
+	index = CM_INDEX(pte->ppage);
+	if (!coremap[index].dirty && !pte->swp_slot) {
+		spinlock_release(&phymem_lock);
+		return 0;
+	}
+
+	/* Keep the frame where it is while we write from it */
+	oldstate = pte->state;
+	pte->state = PG_BUSY;
+	coremap[index].busy = true;
+	shared = coremap[index].refcount > 1;
+	spinlock_release(&phymem_lock);
+
+	uio_kinit(&iov, &ku, (void *)PADDR_TO_KVADDR(pte->ppage), len,
+		  offset, UIO_WRITE);
+	result = VOP_WRITE(vn, &ku);
+
+	spinlock_acquire(&phymem_lock);
+	coremap[index].busy = false;
+	pte->state = oldstate;
+	if (result == 0 && !shared) {
+		/* Map it read-only again so the next write is noticed */
+		coremap[index].dirty = false;
+		if (pte->swp_slot) {
+			swap_free(pte->swp_offset);
+			pte->swp_slot = false;
+		}
+		if (oldstate == PG_TLB) {
+			pte->state = PG_MEM;
+		}
+	}
+	pte_wakeup();
+	spinlock_release(&phymem_lock);
+
+	if (result == 0) {
+		textcache_purge(vn);
+	}
+	if (result == 0 && !shared) {
+		vm_tlbinvalidate(as, pte->vpage);
+	}
+	return result;
+}
+
+/*
+ * Count PTE of AS becoming resident (DELTA 1) or going away (-1). ZERO
+ * says whether it maps the zero page. Called with phymem_lock held.
+ */
+void
+vm_rss_adjust(struct addrspace *as, int delta, bool zero)
+{
+	KASSERT(spinlock_do_i_hold(&phymem_lock));
+	as->as_rss += delta;
+	rss_total += delta;
+	if (zero) {
+		as->as_rss_zero += delta;
+	}
+	if (as->as_rss > as->as_rss_peak) {
+		as->as_rss_peak = as->as_rss;
+	}
+}
+
+/*
+ * Map PTE, which has never been written and has nothing to read in, to
+ * the zero page. It is copy-on-write like any shared page, so the first
+ * write gives it a frame of its own. Called with phymem_lock held.
+ */
+static void
+zero_map(struct addrspace *as, struct pg_table_entry *pte)
+{
+	KASSERT(spinlock_do_i_hold(&phymem_lock));
+	coremap[CM_INDEX(zero_ppage)].refcount++;
+	pte->ppage = zero_ppage;
+	pte->state = PG_MEM;
+	pte->cow = true;
+	zero_faults++;
+	vm_rss_adjust(as, 1, true);
+}
+
+/*
+ * Page merging (ksm.c). The scanner grabs a private page with
+ * vm_merge_grab, which takes it out of its owner's TLB and marks it
+ * busy so that it can't change while being hashed and compared, and
+ * then either gives it back with vm_merge_release or replaces it with
+ * a shared copy-on-write frame (vm_merge, vm_merge_zero).
+ */
+bool
+vm_merge_grab(int index)
+{
+	struct coremap_t *cm = &coremap[index];
+	struct tlbbatch tb;
+
+	spinlock_acquire(&phymem_lock);
+	if (!cm->status || !cm->cm_mergeable || cm->busy ||
+	    cm->refcount != 1 || cm->pte == NULL || cm->pte->cow ||
+	    (cm->pte->state != PG_MEM && cm->pte->state != PG_TLB)) {
+		spinlock_release(&phymem_lock);
+		return false;
+	}
+	cm->busy = true;
+	cm->pte->state = PG_BUSY;
+	vm_tlbbatch_init(&tb, true);
+	vm_tlbbatch_add(&tb, cm->as, cm->pte->vpage);
+	spinlock_release(&phymem_lock);
+	vm_tlbbatch_flush(&tb);
+	return true;
+}
+
+void
+vm_merge_release(int index)
+{
+	spinlock_acquire(&phymem_lock);
+	coremap[index].pte->state = PG_MEM;
+	coremap[index].busy = false;
+	pte_wakeup();
+	spinlock_release(&phymem_lock);
+}
+
+/*
+ * The grabbed page at INDEX now maps frame PA copy-on-write; its own
+ * frame goes. Called with phymem_lock held.
+ */
+static void
+merge_remap(int index, paddr_t pa)
+{
+	struct pg_table_entry *pte = coremap[index].pte;
+	struct addrspace *as = coremap[index].as;
+
+	KASSERT(spinlock_do_i_hold(&phymem_lock));
+	if (pte->swp_slot) {
+		swap_free(pte->swp_offset);
+		pte->swp_slot = false;
+	}
+	pte->ppage = pa;
+	pte->cow = true;
+	pte->state = PG_MEM;
+	coremap[index].pte = NULL;
+	coremap[index].as = NULL;
+	coremap[index].busy = false;
+	if (pa != zero_ppage) {
+		rmap_add(CM_INDEX(pa), as, pte);
+	}
+	coremap_decref(index);
+	pte_wakeup();
+}
+
+/*
+ * Replace the grabbed page at INDEX with TARGET, which has the same
+ * contents (hashing to HASH). TARGET is either another grabbed page,
+ * which becomes the shared copy, or a shared copy already, on which
+ * the caller holds a reference for INDEX's PTE to take over.
+ */
+void
+vm_merge(int index, int target, uint32_t hash)
+{
+	struct coremap_t *tcm = &coremap[target];
+
+	spinlock_acquire(&phymem_lock);
+	if (tcm->as != NULL) {
+		KASSERT(tcm->busy && tcm->refcount == 1);
+		if (tcm->pte->swp_slot) {
+			swap_free(tcm->pte->swp_offset);
+			tcm->pte->swp_slot = false;
+		}
+		tcm->pte->cow = true;
+		tcm->pte->state = PG_MEM;
+		rmap_share(target);
+		tcm->busy = false;
+		/* Whoever ends up with it alone must not just drop it */
+		tcm->dirty = true;
+		tcm->refcount++;
+		ksm_enter(target, hash);
+	}
+	merge_remap(index, tcm->ppage);
+	spinlock_release(&phymem_lock);
+}
+
+/*
+ * The grabbed page at INDEX is all zeros: map the zero page instead.
+ */
+void
+vm_merge_zero(int index)
+{
+	struct addrspace *as;
+
+	spinlock_acquire(&phymem_lock);
+	as = coremap[index].as;
+	coremap[CM_INDEX(zero_ppage)].refcount++;
+	vm_rss_adjust(as, -1, false);
+	vm_rss_adjust(as, 1, true);
+	merge_remap(index, zero_ppage);
+	spinlock_release(&phymem_lock);
+}
+
+/*
+ * Address space IDs.
+ *
+ * Each CPU hands out the 64 hardware ASIDs in order; the bits above
+ * them in asid_cache count generations. An address space's ASID is
+ * good on the CPU it was handed out on, for as long as that CPU stays
+ * in the same generation. Running out of ASIDs starts a new generation
+ * with a flushed TLB, which invalidates all the old ones at once.
+ *
+ * An address space that moves to another CPU gets a new ASID there,
+ * and whatever it left in the old CPU's TLB can never match again.
+ * So only the CPU an address space last ran on (as_cpu) can hold
+ * entries for it: a process changing its own mappings only has to
+ * fix up the local TLB, and anyone else only has to send a shootdown
+ * to that one CPU.
+ *
+ * TLB probes, reads and writes clobber c0_entryhi, which also holds
+ * the current ASID, so everything here puts it back when done.
+ */
+#define ASID_MASK	(TLBHI_PID >> TLBHI_PIDSHIFT)
+#define SET_ENTRYHI(x)	__asm volatile("mtc0 %0,$10" :: "r" (x))
+
+static uint32_t asid_cache[MAXCPUS];
+static uint32_t asid_current[MAXCPUS];	/* shifted into TLBHI_PID */
+static unsigned asid_rollovers[MAXCPUS];
+static unsigned vm_faults = 0;
+
+static unsigned tlb_shootdowns = 0;
+static unsigned tlb_shootdown_ipis = 0;
+
+static bool
+asid_current_gen(uint32_t asid, unsigned cpu)
+{
+	return ((asid ^ asid_cache[cpu]) & ~ASID_MASK) == 0;
+}
+
+static bool
+asid_valid(struct addrspace *as, unsigned cpu)
+{
+	return as->as_cpu == curcpu->c_self &&
+		asid_current_gen(as->as_asid, cpu);
+}
+
+/* Drop the entry for VADDR tagged with ASID from this CPU's TLB */
+static void
+tlb_invalidate_asid(vaddr_t vaddr, uint32_t asid)
+{
+	int i;
+
+	i = tlb_probe((vaddr & PAGE_FRAME) |
+		      ((asid & ASID_MASK) << TLBHI_PIDSHIFT), 0);
+	if (i >= 0) {
+		tlb_write(TLBHI_INVALID(i), TLBLO_INVALID(), i);
+	}
+	SET_ENTRYHI(asid_current[curcpu->c_number]);
+}
+
+static void
+tlb_flush(void)
+{
+	int i;
+
+	for (i = 0; i < NUM_TLB; i++) {
+		tlb_write(TLBHI_INVALID(i), TLBLO_INVALID(), i);
+	}
+}
+
+/* Drop this CPU's kseg2 entries, which are the global ones */
+static void
+tlb_flush_global(void)
+{
+	uint32_t ehi, elo;
+	int i;
+
+	for (i = 0; i < NUM_TLB; i++) {
+		tlb_read(&ehi, &elo, i);
+		if (elo & TLBLO_GLOBAL) {
+			tlb_write(TLBHI_INVALID(i), TLBLO_INVALID(), i);
+		}
+	}
+	SET_ENTRYHI(asid_current[curcpu->c_number]);
+}
 
+/*
+ * Drop every kseg2 entry from every CPU's TLB, for kvm.c. Waits for the
+ * other CPUs, so no spinlocks may be held.
+ */
 void
-vm_bootstrap(void)
+vm_tlbflush_kernel(void)
 {
-	paddr_t lo_ram, hi_ram;
-	int coremap_pages;
-	
-	ram_getsize(&lo_ram, &hi_ram);
-	ppages = (hi_ram - lo_ram)/PAGE_SIZE;
-	coremap = (struct coremap_t *)PADDR_TO_KVADDR(lo_ram);
-	coremap_pages = (sizeof(struct coremap_t) * ppages)/(PAGE_SIZE + 1) + 1;
-	lo_ram += (coremap_pages * PAGE_SIZE);
-	ppages -= coremap_pages;
-	coremap_init(lo_ram);
-	vm_initialized = true;
+	struct tlbshootdown ts;
+
+	ts.ts_vaddr = 0;
+	ts.ts_asid = TLBSHOOTDOWN_KERNEL;
+	ipi_tlbshootdown_broadcast(&ts);
 }
 
-paddr_t
-getppages(unsigned long npages)
+/*
+ * Switch this CPU's MMU to AS, giving it an ASID first if it doesn't
+ * have a usable one here.
+ */
+void
+vm_asid_activate(struct addrspace *as)
 {
-	paddr_t addr = 0;
+	unsigned cpu;
+	int spl;
+
+	spl = splhigh();
+	cpu = curcpu->c_number;
+	if (!asid_valid(as, cpu)) {
+		if ((++asid_cache[cpu] & ASID_MASK) == 0) {
+			tlb_flush();
+			asid_rollovers[cpu]++;
+		}
+		as->as_asid = asid_cache[cpu];
+		as->as_cpu = curcpu->c_self;
+	}
+	asid_current[cpu] = (as->as_asid & ASID_MASK) << TLBHI_PIDSHIFT;
+	SET_ENTRYHI(asid_current[cpu]);
+	splx(spl);
+}
+
+/*
+ * Forget all of AS's TLB entries by giving it a fresh ASID.
+ */
+void
+vm_tlbflush_as(struct addrspace *as)
+{
+	as->as_cpu = NULL;
+	if (curthread->t_addrspace == as) {
+		vm_asid_activate(as);
+	}
+}
+
+/*
+ * Drop AS's translation for VADDR from this CPU's TLB, if it is there.
+ */
+void
+vm_tlbinvalidate(struct addrspace *as, vaddr_t vaddr)
+{
+	int spl;
+
+	spl = splhigh();
+	if (asid_valid(as, curcpu->c_number)) {
+		tlb_invalidate_asid(vaddr, as->as_asid);
+	}
+	splx(spl);
+}
+
+/*
+ * Invalidate everything in this CPU's TLB.
+ */
+void
+vm_tlbshootdown_all(void)
+{
+	int spl;
+
+	spl = splhigh();
+	tlb_flush();
+	SET_ENTRYHI(asid_current[curcpu->c_number]);
+	splx(spl);
+}
+
+/*
+ * Another CPU took away a page that was mapped here. If this CPU has
+ * started a new ASID generation since, the entry is already gone.
+ * Called from interprocessor_interrupt.
+ */
+void
+vm_tlbshootdown(const struct tlbshootdown *ts)
+{
+	int spl;
+
+	spl = splhigh();
+	if (ts->ts_asid == TLBSHOOTDOWN_KERNEL) {
+		tlb_flush_global();
+	}
+	else if (asid_current_gen(ts->ts_asid, curcpu->c_number)) {
+		tlb_invalidate_asid(ts->ts_vaddr, ts->ts_asid);
+	}
+	splx(spl);
+}
+
+/*
+ * Batched shootdowns. Mappings of the current CPU are dropped right
+ * away; the rest are queued per target CPU and sent with one IPI per
+ * CPU, either when TLBSHOOTDOWN_MAX have piled up or at
+ * vm_tlbbatch_flush(). A waiting batch (TB->tb_wait) must only be
+ * flushed with no spinlocks held.
+ */
+void
+vm_tlbbatch_init(struct tlbbatch *tb, bool wait)
+{
+	tb->tb_wait = wait;
+	tb->tb_count = 0;
+}
+
+void
+vm_tlbbatch_add(struct tlbbatch *tb, struct addrspace *as, vaddr_t vaddr)
+{
+	struct cpu *target;
+	int spl;
+
+	spl = splhigh();
+	target = as->as_cpu;
+	if (target == NULL) {
+		/* Never ran, or had its ASID retired */
+		splx(spl);
+		return;
+	}
+	if (target == curcpu->c_self) {
+		vm_tlbinvalidate(as, vaddr);
+		splx(spl);
+		return;
+	}
+	splx(spl);
+
+	if (tb->tb_count == TLBSHOOTDOWN_MAX) {
+		vm_tlbbatch_flush(tb);
+	}
+	tb->tb_cpu[tb->tb_count] = target;
+	tb->tb_ts[tb->tb_count].ts_vaddr = vaddr & PAGE_FRAME;
+	tb->tb_ts[tb->tb_count].ts_asid = as->as_asid;
+	tb->tb_count++;
+}
+
+void
+vm_tlbbatch_flush(struct tlbbatch *tb)
+{
+	struct tlbshootdown ts[TLBSHOOTDOWN_MAX];
+	struct cpu *targets[TLBSHOOTDOWN_MAX];
+	unsigned tickets[TLBSHOOTDOWN_MAX];
+	unsigned i, j, n, ntargets = 0;
+	struct cpu *target;
+
+	for (i = 0; i < tb->tb_count; i++) {
+		target = tb->tb_cpu[i];
+		if (target == NULL) {
+			continue;
+		}
+		/* Gather everything for this CPU into one IPI */
+		n = 0;
+		for (j = i; j < tb->tb_count; j++) {
+			if (tb->tb_cpu[j] == target) {
+				ts[n++] = tb->tb_ts[j];
+				tb->tb_cpu[j] = NULL;
+			}
+		}
+		tickets[ntargets] = ipi_tlbshootdown_batch(target, ts, n);
+		targets[ntargets++] = target;
+	}
+
+	if (tb->tb_wait) {
+		for (i = 0; i < ntargets; i++) {
+			ipi_tlbshootdown_wait(targets[i], tickets[i]);
+		}
+	}
+
+	spinlock_acquire(&tlb_lock);
+	tlb_shootdowns += tb->tb_count;
+	tlb_shootdown_ipis += ntargets;
+	spinlock_release(&tlb_lock);
+
+	tb->tb_count = 0;
+}
+
+void
+vm_printstats(void)
+{
+	unsigned i, rollovers = 0;
+
+	for (i = 0; i < MAXCPUS; i++) {
+		rollovers += asid_rollovers[i];
+	}
+
+	spinlock_acquire(&phymem_lock);
+	kprintf("Physical memory: %d pages, %d free, %d kernel\n",
+		ppages, free_pages, kpages_in_use);
+	kprintf("TLB faults: %u, ASID rollovers: %u\n", vm_faults, rollovers);
+	kprintf("TLB shootdowns: %u pages in %u IPIs\n",
+		tlb_shootdowns, tlb_shootdown_ipis);
+	kprintf("Resident user pages: %u, %u of them on the zero page\n",
+		rss_total, coremap[CM_INDEX(zero_ppage)].refcount - 1);
+	kprintf("Zero page: %u read faults mapped to it, %u later written\n",
+		zero_faults, zero_copies);
+	kprintf("Shared frames: %u given back to their last user\n",
+		rmap_owned);
+	kprintf("Zeroed pool: %u/%u frames, %u zeroed while idle, "
+		"%u allocations hit, %u missed\n", zpool_count, zpool_target,
+		zpool_filled, zpool_hits, zpool_misses);
+	spinlock_release(&phymem_lock);
+	textcache_printstats();
+	shm_printstats();
+	ksm_printstats();
+	swap_printstats();
+	pageout_printstats();
+}
+
+/*
+ * Load a translation for VADDR into this CPU's TLB. An existing entry
+ * for the same page (e.g. a read-only one being upgraded) is replaced
+ * in place; otherwise use a free slot, or evict one at random.
+ */
+static void
+tlb_install(vaddr_t vaddr, uint32_t newlo)
+{
+	uint32_t ehi, elo;
 	int i;
-	
-	if (!vm_initialized) {
-		spinlock_acquire(&phymem_lock);
-		addr = ram_stealmem(npages);
-		spinlock_release(&phymem_lock);
-	} else {
-		spinlock_acquire(&phymem_lock);
-		for (i = 0; i < ppages; i++) {
-			if (coremap[i].status == false) {
-				coremap[i].status = true;
-				addr = coremap[i].ppage;
+
+	/* Disable interrupts on this CPU while frobbing the TLB. */
+	spinlock_acquire(&tlb_lock);
+	vaddr |= asid_current[curcpu->c_number];
+	i = tlb_probe(vaddr, 0);
+	if (i < 0) {
+		for (i = 0; i < NUM_TLB; i++) {
+			tlb_read(&ehi, &elo, i);
+			if (!(elo & TLBLO_VALID)) {
 				break;
 			}
 		}
-		as_zero_region(addr, 1);
-		spinlock_release(&phymem_lock);
 	}
-	KASSERT(addr != 0);
-	return addr;
+	if (i == NUM_TLB) {
+		DEBUG(DB_VM, "Ran out of TLB entries - doing random TLB replacement\n");
+		i = random() % NUM_TLB;
+	}
+	tlb_write(vaddr, newlo, i);
+	SET_ENTRYHI(asid_current[curcpu->c_number]);
+	spinlock_release(&tlb_lock);
 }
 
-/* Allocate/free some kernel-space virtual pages */
-vaddr_t 
-alloc_kpages(int npages)
+static void
+tlb_load(vaddr_t vaddr, paddr_t paddr, bool writable)
 {
-	paddr_t pa;
-	
-	pa = getppages(npages);
-	if (pa == 0) {
-		return 0;
+	uint32_t newlo;
+
+	/* make sure it's page-aligned */
+	KASSERT((paddr & PAGE_FRAME) == paddr);
+
+	newlo = paddr | TLBLO_VALID;
+	if (writable) {
+		newlo |= TLBLO_DIRTY;
 	}
-	kpages_in_use++;
-	return PADDR_TO_KVADDR(pa);
+	DEBUG(DB_VM, "vm: 0x%x -> 0x%x\n", vaddr, paddr);
+	tlb_install(vaddr, newlo);
 }
 
-void 
-free_kpages(vaddr_t addr)
+/*
+ * Map kseg2 page VADDR to PADDR, writable and under every ASID. Called
+ * by kvm_fault.
+ */
+void
+vm_tlbload_kernel(vaddr_t vaddr, paddr_t paddr)
 {
-	int i;
-	
-	if (!vm_initialized) {
-		return;
+	KASSERT(vaddr >= MIPS_KSEG2);
+	KASSERT((paddr & PAGE_FRAME) == paddr);
+	tlb_install(vaddr, paddr | TLBLO_VALID | TLBLO_DIRTY | TLBLO_GLOBAL);
+}
+
+/*
+ * A copy-on-write page is being written, or touched by the last one
+ * sharing it. If we are the last one holding the frame, just take it
+ * over; otherwise give this PTE its own copy and drop our reference
+ * to the shared one. Called and returns with phymem_lock held.
+ */
+static int
+cow_break(struct addrspace *as, struct pg_table_entry *pte)
+{
+	paddr_t oldpage = pte->ppage;
+	paddr_t newpage;
+	int index = CM_INDEX(oldpage);
+
+	KASSERT(spinlock_do_i_hold(&phymem_lock));
+	if (coremap[index].refcount == 1) {
+		/* Ours alone again, and about to change */
+		ksm_forget(index);
+		coremap[index].as = as;
+		coremap[index].pte = pte;
+		pte->cow = false;
+		return 0;
+	}
+
+	/*
+	 * Shared frames aren't evicted, and if the others let go of it
+	 * meanwhile it is ours and busy: oldpage stays put either way.
+	 */
+	pte->state = PG_BUSY;
+	spinlock_release(&phymem_lock);
+
+	/* New frames come zeroed, which is all a zero page copy needs */
+	newpage = alloc_upage(as, pte);
+	if (newpage != 0 && oldpage != zero_ppage) {
+		memmove((void *)PADDR_TO_KVADDR(newpage),
+			(const void *)PADDR_TO_KVADDR(oldpage), PAGE_SIZE);
 	}
+
 	spinlock_acquire(&phymem_lock);
-	for (i = 0; i < ppages; i++) {
-		vaddr_t va = PADDR_TO_KVADDR(coremap[i].ppage);
-		if (va == addr) {
-			coremap[i].status = false;
-			kpages_in_use--;
+	pte->state = PG_MEM;
+	pte_wakeup();
+	if (newpage == 0) {
+		return ENOMEM;
+	}
+	if (oldpage == zero_ppage) {
+		zero_copies++;
+		as->as_rss_zero--;
+	}
+	rmap_remove(index, pte);
+	coremap_decref(index);
+	coremap_unbusy(newpage);
+	pte->ppage = newpage;
+	pte->cow = false;
+	return 0;
+}
+
+/*
+ * Fault-around.
+ *
+ * A program walking through an array takes a fault on every new page.
+ * When the faults look sequential, each one also populates the next
+ * fa_window pages in the same direction: pages that are already
+ * resident just get their TLB entries preloaded, and pages that would
+ * only be zero filled anyway get a frame from the zeroed pool, while it
+ * has any. Anything that needs I/O (swap, the executable) is left for
+ * its own fault. The window doubles on every sequential fault up to
+ * fa_maxwindow and halves otherwise.
+ *
+ * Zero pages filled after a write fault are assumed to be about to be
+ * written too and are mapped dirty; after a read fault they are just
+ * pointed at the zero page, like the faulting page itself.
+ */
+#define FA_DEFAULT_MAXWINDOW	8
+#define FA_MIN_FREE		32	/* don't zero fill ahead below this */
+
+static unsigned fa_maxwindow = FA_DEFAULT_MAXWINDOW;
+static bool fa_report = false;
+static struct as_faultaround fa_totals;	/* of exited address spaces */
+
+static void
+fa_adapt(struct as_faultaround *fa, vaddr_t faultaddress)
+{
+	int delta, span;
+
+	delta = ((int)faultaddress - (int)fa->fa_last) / PAGE_SIZE;
+	span = fa->fa_window + 1;
+	fa->fa_faults++;
+
+	if (delta != 0 && delta >= -span && delta <= span) {
+		fa->fa_sequential++;
+		fa->fa_dir = delta > 0 ? 1 : -1;
+		fa->fa_window = fa->fa_window ? fa->fa_window * 2 : 1;
+		if (fa->fa_window > fa_maxwindow) {
+			fa->fa_window = fa_maxwindow;
+		}
+	}
+	else if (delta != 0) {
+		fa->fa_window /= 2;
+	}
+	fa->fa_last = faultaddress;
+}
+
+/*
+ * Give PTE, which has never been touched and isn't backed by a file,
+ * a frame from the zeroed pool without waiting for anything. Returns
+ * false if memory is getting short or the pool is empty: zeroing a
+ * frame here would hold phymem_lock through the bzero, for a page
+ * nobody has asked for yet, so that is left to the page's own fault.
+ */
+static bool
+fa_zero_fill(struct addrspace *as, struct pg_table_entry *pte)
+{
+	int index;
+
+	if (free_pages + (int)zpool_count < FA_MIN_FREE) {
+		return false;
+	}
+	index = zpool_take();
+	if (index < 0) {
+		return false;
+	}
+	zpool_hits++;
+	coremap[index].as = as;
+	coremap[index].pte = pte;
+	coremap[index].lru_bit = true;
+	coremap[index].dirty = true;
+	pte->ppage = coremap[index].ppage;
+	pte->state = PG_MEM;
+	vm_rss_adjust(as, 1, false);
+	return true;
+}
+
+/*
+ * Size the window for this fault and make sure the neighbours in it
+ * have PTEs, which can't be allocated once phymem_lock is held. The
+ * window never leaves the faulting region.
+ */
+static void
+fa_prepare(struct addrspace *as, struct as_region *rg, vaddr_t faultaddress)
+{
+	struct as_faultaround *fa = &as->as_fa;
+	vaddr_t va;
+	unsigned i;
+
+	fa_adapt(fa, faultaddress);
+
+	va = faultaddress;
+	for (i = 0; i < fa->fa_window; i++) {
+		va += fa->fa_dir * PAGE_SIZE;
+		if (va < rg->rg_start || va >= rg->rg_end) {
+			break;
+		}
+		if (pt_insert(as->page_table, va) == NULL) {
 			break;
 		}
 	}
-	spinlock_release(&phymem_lock);
 }
 
-void 
-free_coremap(paddr_t addr)
+/* Called from vm_fault with phymem_lock held, after fa_prepare */
+static void
+fault_around(struct addrspace *as, struct as_region *rg,
+	     vaddr_t faultaddress, int faulttype)
 {
-	int i;
-	
-	spinlock_acquire(&phymem_lock);
-	for (i = 0; i < ppages; i++) {
-		if (coremap[i].ppage == addr) {
-			coremap[i].status = false;
+	struct as_faultaround *fa = &as->as_fa;
+	struct pg_table_entry *pte;
+	bool writable = (rg->rg_prot & RG_PROT_WRITE) != 0;
+	vaddr_t va;
+	unsigned i;
+	int index;
+
+	KASSERT(spinlock_do_i_hold(&phymem_lock));
+
+	va = faultaddress;
+	for (i = 0; i < fa->fa_window; i++) {
+		va += fa->fa_dir * PAGE_SIZE;
+		if (va < rg->rg_start || va >= rg->rg_end) {
+			break;
+		}
+		pte = pt_lookup(as->page_table, va);
+		if (pte == NULL) {
 			break;
 		}
+
+		if (pte->state == PG_UNALOC && !pte->swp_slot &&
+		    rg->rg_backing == RB_ZERO) {
+			if (faulttype == VM_FAULT_READ) {
+				zero_map(as, pte);
+			}
+			else if (!fa_zero_fill(as, pte)) {
+				break;
+			}
+			fa->fa_zeroed++;
+		}
+		else if (pte->state == PG_MEM || pte->state == PG_TLB) {
+			fa->fa_mapped++;
+		}
+		else {
+			/* Busy, or needs I/O */
+			continue;
+		}
+
+		index = CM_INDEX(pte->ppage);
+		coremap[index].lru_bit = true;
+		pte->state = PG_TLB;
+		tlb_load(va, pte->ppage,
+			 writable && !pte->cow && coremap[index].dirty);
 	}
+}
+
+/*
+ * Fold an address space's fault-around numbers into the totals on its
+ * way out, and print them if asked to.
+ */
+void
+vm_fa_account(struct addrspace *as)
+{
+	struct as_faultaround *fa = &as->as_fa;
+
+	spinlock_acquire(&phymem_lock);
+	fa_totals.fa_faults += fa->fa_faults;
+	fa_totals.fa_sequential += fa->fa_sequential;
+	fa_totals.fa_mapped += fa->fa_mapped;
+	fa_totals.fa_zeroed += fa->fa_zeroed;
 	spinlock_release(&phymem_lock);
+
+	if (fa_report && fa->fa_faults > 0) {
+		kprintf("%s: %u faults (%u sequential), "
+			"fault-around %u mapped, %u zeroed, "
+			"peak RSS %u pages\n",
+			curthread->t_name, fa->fa_faults, fa->fa_sequential,
+			fa->fa_mapped, fa->fa_zeroed, as->as_rss_peak);
+	}
 }
+
 void
-vm_tlbshootdown_all(void)
+vm_fa_setwindow(unsigned maxwindow)
 {
+	fa_maxwindow = maxwindow;
 }
 
 void
-vm_tlbshootdown(const struct tlbshootdown *ts)
+vm_fa_setreport(bool report)
+{
+	fa_report = report;
+}
+
+void
+vm_fa_printstats(void)
 {
-	(void)ts;
+	spinlock_acquire(&phymem_lock);
+	kprintf("Fault-around: max window %u pages, per-process report %s\n",
+		fa_maxwindow, fa_report ? "on" : "off");
+	kprintf("Exited processes: %u faults (%u sequential), "
+		"%u pages mapped, %u zeroed ahead\n",
+		fa_totals.fa_faults, fa_totals.fa_sequential,
+		fa_totals.fa_mapped, fa_totals.fa_zeroed);
+	spinlock_release(&phymem_lock);
 }
 
 int
 vm_fault(int faulttype, vaddr_t faultaddress)
 {
-	vaddr_t stackbase, stacktop;
-	paddr_t paddr = 0;
-	int i;
-	uint32_t ehi, elo;
+	struct pg_table_entry *pte;
+	struct as_region *rg;
 	struct addrspace *as;
-	int spl;
+	int index, result;
 
 	faultaddress &= PAGE_FRAME;
 
@@ -138,8 +1780,6 @@ vm_fault(int faulttype, vaddr_t faultaddress)
 
 	switch (faulttype) {
 	    case VM_FAULT_READONLY:
-		/* We always create pages read-write, so we can't get this */
-		panic("vm: got VM_FAULT_READONLY\n");
 	    case VM_FAULT_READ:
 	    case VM_FAULT_WRITE:
 		break;
@@ -147,6 +1787,11 @@ vm_fault(int faulttype, vaddr_t faultaddress)
 		return EINVAL;
 	}
 
+	/* Large kernel allocations (kvm.c) */
+	if (faultaddress >= MIPS_KSEG2) {
+		return kvm_fault(faulttype, faultaddress);
+	}
+
 	as = curthread->t_addrspace;
 	if (as == NULL) {
 		/*
@@ -160,85 +1805,138 @@ vm_fault(int faulttype, vaddr_t faultaddress)
 	/* Assert that the address space has been set up properly. */
 	KASSERT((as->as_stackpbase & PAGE_FRAME) == as->as_stackpbase);
 	
-	stackbase = USERSTACK - STACKPAGES * PAGE_SIZE;
-	stacktop = USERSTACK;
-	struct pagetable *pte = as->page_table;
-	bool found = false;
-	while (pte != NULL) {
-		if (pte->entry.vpage == faultaddress) {
-			if (pte->entry.state == PG_UNALOC) {
-				pte->entry.ppage = getppages(1);
-			}
-			pte->entry.state = PG_TLB;
-			paddr = pte->entry.ppage;
-			found = true;
-			break;
-		}
-		pte = pte->next;
+	if (faultaddress >= USERSPACETOP) {
+		return EFAULT;
 	}
-	
-	if ((found == false) && (faultaddress >= stackbase) &&
-			(faultaddress < stacktop)) {
-		KASSERT(0);
-		/*	allocate new page and add it to the Pagetable 
-		pte = as->page_table;
-		while (pte->next != NULL) {
-			pte = pte->next;
-		}
-		pte->next = kmalloc(sizeof(struct pagetable));
-		pte->next->entry.ppage = getppages(1);
-		pte->next->entry.state = PG_TLB;
-		pte->next->next = NULL;
-		paddr = pte->next->entry.ppage;
-		found = true;
-	*/
+
+	/* The region list says what is legal; the page table isn't touched */
+	rg = as_find_region(as, faultaddress);
+	if (rg == NULL) {
+		/* Maybe the stack needs to grow */
+		result = as_grow_stack(as, faultaddress);
+		if (result) {
+			return result;
+		}
+		rg = as->as_stack;
 	}
-	
-	if (found == false) {
+	if (faulttype != VM_FAULT_READ && !(rg->rg_prot & RG_PROT_WRITE)) {
 		return EFAULT;
 	}
-	/* make sure it's page-aligned */
-	KASSERT((paddr & PAGE_FRAME) == paddr);
 
-	/* Disable interrupts on this CPU while frobbing the TLB. */
-	spinlock_acquire(&tlb_lock);
-	for (i = 0; i < NUM_TLB; i++) {
-		tlb_read(&ehi, &elo, i);
-		if (elo & TLBLO_VALID) {
-			continue;
+	if (faulttype == VM_FAULT_READ || faulttype == VM_FAULT_WRITE) {
+		fa_prepare(as, rg, faultaddress);
+	}
+
+	/* PTEs only exist for pages that have been touched */
+	pte = pt_insert(as->page_table, faultaddress);
+	if (pte == NULL) {
+		return ENOMEM;
+	}
+
+	/*
+	 * Hold phymem_lock from here on so the page can't be chosen for
+	 * eviction between making it resident and loading the TLB.
+	 */
+	spinlock_acquire(&phymem_lock);
+	vm_faults++;
+	pte_wait_busy(pte);
+
+	if (pte->state == PG_UNALOC && !pte->swp_slot &&
+	    faulttype == VM_FAULT_READ && rg->rg_backing == RB_ZERO) {
+		/* Nothing to read and nothing written yet */
+		zero_map(as, pte);
+	}
+	else if (pte->state == PG_UNALOC || pte->state == PG_SWP) {
+		result = page_in(as, pte);
+		if (result) {
+			spinlock_release(&phymem_lock);
+			return result;
 		}
-		ehi = faultaddress;
-		elo = paddr | TLBLO_DIRTY | TLBLO_VALID;
-		DEBUG(DB_VM, "vm: 0x%x -> 0x%x\n", faultaddress, paddr);
-		tlb_write(ehi, elo, i);
-		spinlock_release(&tlb_lock);
-		return 0;
 	}
-	KASSERT(1);
-	uint32_t tlb_entry = random() % NUM_TLB;
-	tlb_write(TLBHI_INVALID(tlb_entry), TLBLO_INVALID(), tlb_entry);
-	ehi = faultaddress;
-	elo = paddr | TLBLO_DIRTY | TLBLO_VALID;
-	DEBUG(DB_VM, "vm: 0x%x -> 0x%x\n", faultaddress, paddr);
-	tlb_write(ehi, elo, tlb_entry);
-	
-	DEBUG(DB_VM, "Ran out of TLB entries - doing random TLB replacement\n");
-	spinlock_release(&tlb_lock);
+
+	if (pte->cow && (faulttype != VM_FAULT_READ ||
+			 coremap[CM_INDEX(pte->ppage)].refcount == 1)) {
+		result = cow_break(as, pte);
+		if (result) {
+			spinlock_release(&phymem_lock);
+			return result;
+		}
+	}
+
+	/*
+	 * Clean pages are mapped read-only so the first write faults
+	 * (VM_FAULT_READONLY) and gets recorded here.
+	 */
+	index = CM_INDEX(pte->ppage);
+	if (faulttype != VM_FAULT_READ && !pte->cow) {
+		page_dirty(pte);
+	}
+	if (!pte->cow) {
+		/* Page merging may share it if nobody else can see it */
+		coremap[index].cm_mergeable = !rg->rg_shared &&
+			rg->rg_kind != RG_TEXT && rg->rg_kind != RG_SHM;
+	}
+	coremap[index].lru_bit = true;
+	pte->state = PG_TLB;
+
+	/*
+	 * Shared pages stay read-only until someone writes to them, and
+	 * pages of read-only regions (text) stay that way for good.
+	 */
+	tlb_load(faultaddress, pte->ppage, (rg->rg_prot & RG_PROT_WRITE) &&
+		 !pte->cow && coremap[index].dirty);
+
+	if (faulttype != VM_FAULT_READONLY) {
+		fault_around(as, rg, faultaddress, faulttype);
+	}
+	spinlock_release(&phymem_lock);
 	return 0;
 }
 
 static void
 coremap_init(paddr_t lo_ram)
 {
-	int i;
+	int i, order;
+
+	cm_base = lo_ram;
+	for (i = 0; i <= CM_MAX_ORDER; i++) {
+		freelist[i] = -1;
+	}
 	for (i = 0; i < ppages; i++) {
 		coremap[i].ppage = lo_ram;
 		coremap[i].pte = NULL;
+		coremap[i].as = NULL;
+		coremap[i].busy = false;
 		coremap[i].lru_bit = false;
-		coremap[i].nxt_pg = false;
+		coremap[i].dirty = false;
 		coremap[i].status = false;
+		coremap[i].refcount = 0;
+		coremap[i].cm_rmap = NULL;
+		coremap[i].cm_order = 0;
+		coremap[i].cm_next = -1;
+		coremap[i].cm_prev = -1;
+		coremap[i].cm_vnode = NULL;
+		coremap[i].cm_vpage = 0;
+		coremap[i].cm_tcnext = -1;
+		coremap[i].cm_mergeable = false;
+		coremap[i].cm_merged = false;
+		coremap[i].cm_hash = 0;
+		coremap[i].cm_ksmnext = -1;
 		lo_ram = lo_ram + PAGE_SIZE;
 	}
+
+	/* Carve RAM into the largest naturally aligned free blocks */
+	i = 0;
+	while (i < ppages) {
+		order = CM_MAX_ORDER;
+		while ((i & ((1 << order) - 1)) != 0 ||
+		       i + (1 << order) > ppages) {
+			order--;
+		}
+		freelist_push(i, order);
+		i += 1 << order;
+	}
+	free_pages = ppages;
 }
 
 static void
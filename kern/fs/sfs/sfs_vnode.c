@@ -1110,14 +1110,16 @@ sfs_fsync(struct vnode *v)
 }
 
 /*
- * Called for mmap().
+ * Called for mmap(). The VM pages regular files in and out through
+ * sfs_read and sfs_write, so there is nothing to set up. (Directories
+ * use the ISDIR table entry.)
  */
 static
 int
-sfs_mmap(struct vnode *v   /* add stuff as needed */)
+sfs_mmap(struct vnode *v)
 {
 	(void)v;
-	return EUNIMP;
+	return 0;
 }
 
 /*
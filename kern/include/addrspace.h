@@ -39,7 +39,88 @@
 #include "opt-dumbvm.h"
 
 struct vnode;
+struct cpu;
+struct shm_segment;
 
+/*
+ * The user stack starts out one page long and grows down on faults,
+ * up to stack_maxpages pages. It never grows to within
+ * STACK_GUARDPAGES of the heap, and the heap stops the same distance
+ * below the stack.
+ */
+#define STACK_DEFAULT_MAXPAGES  1024
+#define STACK_GUARDPAGES        16
+
+extern unsigned stack_maxpages;
+
+/*
+ * Part of an address space whose pages are read in from a file on
+ * first touch (executable text and initialized data). The rest of the
+ * page(s) around the file data is zero filled.
+ */
+struct as_filemap {
+	vaddr_t fm_vaddr;		/* where the file data goes */
+	size_t fm_filesize;		/* how much of it there is */
+	off_t fm_offset;		/* file offset of fm_vaddr */
+	struct vnode *fm_vnode;		/* referenced */
+	struct as_filemap *fm_next;
+};
+
+/*
+ * A region is a page-aligned range of the address space that may be
+ * used: a text, data or BSS segment, the heap or the stack. Anything
+ * not inside one faults with EFAULT. PTEs are only created for pages
+ * of a region as they are touched, so a large, sparsely used region
+ * costs one descriptor rather than one PTE per page.
+ */
+#define RG_PROT_READ	0x1
+#define RG_PROT_WRITE	0x2
+#define RG_PROT_EXEC	0x4
+
+typedef enum {
+	RG_TEXT,
+	RG_DATA,
+	RG_BSS,
+	RG_HEAP,
+	RG_STACK,
+	RG_MMAP,
+	RG_SHM
+} region_kind_t;
+
+/* Where the contents of a page come from the first time it's touched */
+typedef enum {
+	RB_ZERO,			/* zero filled */
+	RB_FILE,			/* read from the file maps */
+	RB_VNODE,			/* mmap: rg_vnode from rg_offset on */
+	RB_SHM				/* the frames of rg_shm */
+} region_backing_t;
+
+struct as_region {
+	vaddr_t rg_start;		/* first page */
+	vaddr_t rg_end;			/* page after the last one */
+	int rg_prot;			/* RG_PROT_* */
+	region_kind_t rg_kind;
+	region_backing_t rg_backing;
+	struct vnode *rg_vnode;		/* RB_VNODE only; referenced */
+	off_t rg_offset;		/* file offset of rg_start */
+	bool rg_shared;			/* frames stay shared across fork */
+	struct shm_segment *rg_shm;	/* RB_SHM only; an attachment */
+	struct as_region *rg_next;	/* next region up */
+};
+
+/*
+ * Fault-around state and statistics for one address space; see
+ * fault_around() in vm.c.
+ */
+struct as_faultaround {
+	vaddr_t fa_last;		/* page of the previous fault */
+	unsigned fa_window;		/* pages to populate past a fault */
+	int fa_dir;			/* +1 forward, -1 backward */
+	unsigned fa_faults;		/* TLB-miss faults taken */
+	unsigned fa_sequential;		/* ...that looked sequential */
+	unsigned fa_mapped;		/* resident neighbours put in the TLB */
+	unsigned fa_zeroed;		/* neighbours zero filled ahead of use */
+};
 
 /* 
  * Address space - data structure associated with the virtual memory
@@ -59,6 +140,22 @@ struct addrspace {
 	/* end of dumbvm */
 	paddr_t as_stackpbase;
 	struct pagetable *page_table;
+	struct as_filemap *as_filemaps;
+	struct as_faultaround as_fa;
+	struct as_region *as_regions;	/* sorted by address */
+	struct as_region *as_lastregion;	/* last one as_find_region hit */
+	struct as_region *as_heap;	/* grows with sbrk */
+	struct as_region *as_stack;	/* grows down on faults */
+	/*
+	 * TLB address space ID. Only valid on as_cpu, the CPU that last
+	 * ran us; no other CPU can have our translations (see vm.c).
+	 */
+	uint32_t as_asid;
+	struct cpu *as_cpu;
+	/* Resident set, kept by vm.c under phymem_lock */
+	unsigned as_rss;		/* PTEs with a frame, shared or not */
+	unsigned as_rss_zero;		/* ...that map the shared zero page */
+	unsigned as_rss_peak;
 	/* used after sbrk() */
 	int heap_base;
 	int cur_brk;
@@ -85,7 +182,7 @@ struct addrspace {
  *                the way this works if implementing user-level threads.
  *
  *    as_define_region - set up a region of memory within the address
- *                space.
+ *                space. Regions that overlap are merged.
  *
  *    as_prepare_load - this is called before actually loading from an
  *                executable into the address space.
@@ -96,6 +193,43 @@ struct addrspace {
  *    as_define_stack - set up the stack region in the address space.
  *                (Normally called *after* as_complete_load().) Hands
  *                back the initial stack pointer for the new process.
+ *
+ *    as_define_filemap - say that FILESIZE bytes at VADDR come from
+ *                file V at OFFSET. Nothing is read until the pages
+ *                are touched.
+ *
+ *    as_fill_page - fill in a freshly allocated (zeroed) page from
+ *                whatever file maps cover it. Called by vm_fault.
+ *
+ *    as_find_region - the region containing VADDR, or NULL.
+ *
+ *    as_text_vnode - the executable VPAGE is read-only text of, if it
+ *                is; such pages can be shared through the text cache.
+ *
+ *    as_grow_stack - extend the stack down to cover VADDR, if that is
+ *                allowed. Called by vm_fault for addresses outside
+ *                every region.
+ *
+ *    as_map_file - map LEN bytes of V from OFFSET at an address of our
+ *                choosing, handed back in RET. Nothing is read until
+ *                the pages are touched.
+ *
+ *    as_unmap  - remove the file mappings in [START, END), writing
+ *                back shared pages first. EINVAL if the range covers
+ *                anything other than file mappings.
+ *
+ *    as_sync   - write back the changed pages of shared file mappings
+ *                in [START, END), or only those of vnode V if it is
+ *                not NULL. Changed pages are the dirty resident ones
+ *                and those with a swap slot; afterwards they are clean
+ *                with no slot, so they can be dropped and read back
+ *                from the file like text.
+ *
+ *    as_map_shm - attach shared memory segment SEG at ADDR, or at an
+ *                address of our choosing if ADDR is 0.
+ *
+ *    as_unmap_shm - detach the segment attached at ADDR, handing it
+ *                back in RET.
  */
 
 struct addrspace *as_create(void);
@@ -111,6 +245,25 @@ int               as_define_region(struct addrspace *as,
 int               as_prepare_load(struct addrspace *as);
 int               as_complete_load(struct addrspace *as);
 int               as_define_stack(struct addrspace *as, vaddr_t *initstackptr);
+int               as_define_filemap(struct addrspace *as, struct vnode *v,
+                                    off_t offset, vaddr_t vaddr,
+                                    size_t filesize);
+int               as_fill_page(struct addrspace *as, vaddr_t vpage,
+                               paddr_t paddr);
+struct as_region *as_find_region(struct addrspace *as, vaddr_t vaddr);
+struct vnode     *as_text_vnode(struct addrspace *as, vaddr_t vpage);
+int               as_grow_stack(struct addrspace *as, vaddr_t vaddr);
+int               as_map_file(struct addrspace *as, struct vnode *v,
+                              off_t offset, size_t len, int prot,
+                              bool shared, vaddr_t *ret);
+int               as_unmap(struct addrspace *as, vaddr_t start,
+                           vaddr_t end);
+int               as_sync(struct addrspace *as, vaddr_t start, vaddr_t end,
+                          struct vnode *v);
+int               as_map_shm(struct addrspace *as, struct shm_segment *seg,
+                             vaddr_t addr, int prot, vaddr_t *ret);
+int               as_unmap_shm(struct addrspace *as, vaddr_t addr,
+                               struct shm_segment **ret);
 
 
 /*
@@ -59,6 +59,11 @@
 #define SYS_mmap         8
 #define SYS_munmap       9
 #define SYS_mprotect     10
+#define SYS_msync        121
+#define SYS_shmget       122
+#define SYS_shmat        123
+#define SYS_shmdt        124
+#define SYS_shmctl       125
 //#define SYS_madvise    11
 //#define SYS_mincore    12
 //#define SYS_mlock      13
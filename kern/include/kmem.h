@@ -0,0 +1,38 @@
+#ifndef _KMEM_H_
+#define _KMEM_H_
+
+/*
+ * Object caches (vm/kmem.c), for structures that are allocated and
+ * set up the same way over and over.
+ *
+ * A cache hands out objects of one size. Its constructor, if any, runs
+ * when an object is first made and its destructor when the memory goes
+ * back to kmalloc; in between, kmem_cache_free keeps the object as it
+ * is for the next kmem_cache_alloc. So an object must be freed in its
+ * constructed state: locks released, nothing waiting, tables empty.
+ * Destructors may be run with a spinlock held and must not sleep.
+ *
+ *    kmem_cache_create - make a cache of SIZE-byte objects called NAME
+ *                        (not copied). CTOR returns 0 or an error code.
+ *                        Either function may be NULL.
+ *    kmem_cache_destroy - free a cache whose objects are all freed.
+ *    kmem_cache_alloc  - a constructed object, or NULL if out of memory.
+ *    kmem_cache_free   - give an object back to its cache.
+ *    kmem_cache_reap   - destroy the free objects of every cache to give
+ *                        their memory back. Returns whether there were
+ *                        any.
+ *    kmem_cache_printstats - per-cache statistics (in "kh").
+ */
+
+struct kmem_cache;
+
+struct kmem_cache *kmem_cache_create(const char *name, size_t size,
+				     int (*ctor)(void *obj),
+				     void (*dtor)(void *obj));
+void kmem_cache_destroy(struct kmem_cache *kc);
+void *kmem_cache_alloc(struct kmem_cache *kc);
+void kmem_cache_free(struct kmem_cache *kc, void *obj);
+bool kmem_cache_reap(void);
+void kmem_cache_printstats(void);
+
+#endif /* _KMEM_H_ */
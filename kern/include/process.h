@@ -8,6 +8,8 @@
 
 #define MAX_PID 1024
 
+struct kmem_cache;
+
 int get_pid(void);
 void clear_pid(int pid);
 void pid_init(void);
@@ -22,6 +24,7 @@ int __waitpid(pid_t *pid, struct process_struct *child_ps_table);
 extern uint32_t pid_map[MAX_PID/(sizeof(int) * 8)];
 extern struct lock *global_ps_table_lk;
 extern struct lock *global_file_count_lk;
+extern struct kmem_cache *file_handler_cache;	/* with flock made */
 extern int pid_count;
 extern int global_file_count;
 
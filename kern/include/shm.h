@@ -0,0 +1,25 @@
+#ifndef _SHM_H_
+#define _SHM_H_
+
+#include <types.h>
+
+/*
+ * Anonymous shared memory segments (vm/shm.c). A segment owns its
+ * frames, one reference each, and every PTE mapping one of them holds
+ * another; attached regions point at the segment and count as
+ * attachments.
+ */
+
+struct shm_segment;
+
+/* How many segments there can be at once */
+#define SHM_MAXSEGS	64
+
+void shm_bootstrap(void);
+size_t shm_size(struct shm_segment *seg);
+int shm_getpage(struct shm_segment *seg, unsigned pageno, paddr_t *ret);
+void shm_ref(struct shm_segment *seg);
+void shm_detach(struct shm_segment *seg);
+void shm_printstats(void);
+
+#endif /* _SHM_H_ */
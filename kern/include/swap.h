@@ -0,0 +1,59 @@
+#ifndef _SWAP_H_
+#define _SWAP_H_
+
+#include <types.h>
+
+struct pg_table_entry;
+
+/*
+ * Swap device set up at boot; configure lhd1 in sys161.conf. More disks
+ * or swap files can be added later with swap_add ("swapon" in the menu).
+ */
+#define SWAP_DEVICE "lhd1raw:"
+#define SWAP_MAXDEVS	8
+
+/* Page replacement policies, see swap_setpolicy() */
+#define SWAP_POLICY_RANDOM	0
+#define SWAP_POLICY_CLOCK	1
+
+/*
+ * Pages moved per device request: up to swap_cluster victims are
+ * written together, and a swap-in fault reads up to swap_readahead
+ * consecutive slots of the same region.
+ */
+#define SWAP_CLUSTER_MAX	16
+#define SWAP_DEFAULT_CLUSTER	8
+#define SWAP_DEFAULT_READAHEAD	4
+
+extern unsigned swap_cluster;
+extern unsigned swap_readahead;
+
+void swap_bootstrap(void);
+int swap_add(const char *path, int prio, unsigned pages);
+unsigned swap_out_cluster(paddr_t *frames, unsigned max);
+paddr_t swap_out(void);
+int swap_in(paddr_t *frames, unsigned n, off_t offset);
+void swap_dup(off_t offset);
+void swap_free(off_t offset);
+int swap_setpolicy(const char *name);
+int swap_setcluster(unsigned cluster, unsigned readahead);
+void swap_printstats(void);
+
+/* Compressed swap cache (zswap.c) */
+extern bool zswap_enabled;
+
+void zswap_bootstrap(void);
+int zswap_setenabled(bool on, unsigned limit);
+int zswap_store(paddr_t pa, unsigned *ret);
+int zswap_load(unsigned index, paddr_t pa);
+void zswap_dup(unsigned index);
+void zswap_free(unsigned index);
+void zswap_printstats(unsigned total_in);
+
+/* Pageout daemon (pageout.c) */
+void pageout_bootstrap(void);
+void pageout_check(unsigned freepages);
+int pageout_setwatermarks(unsigned low, unsigned high);
+void pageout_printstats(void);
+
+#endif /* _SWAP_H_ */
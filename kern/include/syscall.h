@@ -72,5 +72,14 @@ int sys_chdir(userptr_t pathname);
 int sys___getcwd(userptr_t buf, size_t buflen, int32_t *actual_len);
 int sys_dup2(int oldfd, int newfd, int *fd_ret);
 int sys_sbrk(intptr_t amount, int32_t *cur_brk);
+int sys_mmap(vaddr_t addr, size_t len, int prot, int flags, userptr_t stackargs,
+	     int32_t *retval);
+int sys_munmap(vaddr_t addr, size_t len);
+int sys_msync(vaddr_t addr, size_t len, int flags);
+int sys_fsync(int fd);
+int sys_shmget(int key, size_t size, int flags, int32_t *retval);
+int sys_shmat(int shmid, vaddr_t addr, int flags, int32_t *retval);
+int sys_shmdt(vaddr_t addr);
+int sys_shmctl(int shmid, int cmd, userptr_t buf);
 
 #endif /* _SYSCALL_H_ */
@@ -103,6 +103,7 @@ int printfile(int, char **);
 int malloctest(int, char **);
 int mallocstress(int, char **);
 int nettest(int, char **);
+int ptbench(int, char **);
 
 /* Routine for running a user-level program. */
 int runprogram(char *progname, long nargs, void *ptr, void *ps_table);
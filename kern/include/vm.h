@@ -55,6 +55,14 @@ int vm_fault(int faulttype, vaddr_t faultaddress);
 vaddr_t alloc_kpages(int npages);
 void free_kpages(vaddr_t addr);
 
+/* Large kernel allocations mapped page by page in kseg2 (kmalloc) */
+vaddr_t kvm_alloc(unsigned npages);
+bool kvm_free(vaddr_t addr);
+void kvm_printstats(void);
+
+/* Background page zeroing, called from the idle loop */
+bool vm_idle_zero(void);
+
 /* TLB shootdown handling called from interprocessor_interrupt */
 void vm_tlbshootdown_all(void);
 void vm_tlbshootdown(const struct tlbshootdown *);
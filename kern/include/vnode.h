@@ -54,6 +54,7 @@ struct stat;
 struct vnode {
 	int vn_refcount;                /* Reference count */
 	int vn_opencount;
+	int vn_textpages;               /* Frames in the VM text cache */
 
 	struct fs *vn_fs;               /* Filesystem vnode belongs to */
 
@@ -135,9 +136,10 @@ struct vnode {
  *    vop_fsync       - Force any dirty buffers associated with this file
  *                      to stable storage.
  *
- *    vop_mmap        - Map file into memory. If you implement this
- *                      feature, you're responsible for choosing the
- *                      arguments for this operation.
+ *    vop_mmap        - Check that the file can be mapped into memory.
+ *                      The VM system reads and writes the pages of a
+ *                      mapping with vop_read and vop_write at page
+ *                      aligned offsets; return 0 if that will work.
  *
  *    vop_truncate    - Forcibly set size of file to the length passed
  *                      in, discarding any excess blocks.
@@ -1,10 +1,12 @@
 #include <process.h>
 #include <file.h>
+#include <kern/errno.h>
 #include <kern/fcntl.h>
 #include <current.h>
 #include <lib.h>
 #include <vfs.h>
 #include <syscall.h>
+#include <kmem.h>
 
 /* forward declaration to avoid cyclic dependency */
 struct thread;
@@ -16,11 +18,60 @@ int global_file_count;
 struct lock *global_ps_table_lk;
 struct lock *global_pid_lk;
 struct lock *global_file_count_lk;
+struct kmem_cache *file_handler_cache;
+
+/*
+ * Process tables and file handlers are kept with their locks and cv
+ * already made; see kmem.h.
+ */
+static struct kmem_cache *process_cache;
 
 /* local functions */
 static int get_pid_index(int pid_map, int bit_len);
 static int set_pid(int index, int offset);
 
+static int process_ctor(void *obj)
+{
+	struct process_struct *process = obj;
+
+	process->status_cv = cv_create("status_cv");
+	if (process->status_cv == NULL) {
+		return ENOMEM;
+	}
+	process->status_lk = lock_create("status_lk");
+	if (process->status_lk == NULL) {
+		cv_destroy(process->status_cv);
+		return ENOMEM;
+	}
+	return 0;
+}
+
+static void process_dtor(void *obj)
+{
+	struct process_struct *process = obj;
+
+	lock_destroy(process->status_lk);
+	cv_destroy(process->status_cv);
+}
+
+static int file_handler_ctor(void *obj)
+{
+	struct global_file_handler *file_handler = obj;
+
+	file_handler->flock = lock_create("file_handler_lk");
+	if (file_handler->flock == NULL) {
+		return ENOMEM;
+	}
+	return 0;
+}
+
+static void file_handler_dtor(void *obj)
+{
+	struct global_file_handler *file_handler = obj;
+
+	lock_destroy(file_handler->flock);
+}
+
 void process_bootstrap(void)
 {
 	uint32_t i; /* to supress compiler warning */
@@ -33,6 +84,15 @@ void process_bootstrap(void)
 	global_pid_lk = lock_create("global_pid_lk");
 	global_file_count_lk = lock_create("global_file_count_lk");
 	global_file_count = 0;
+
+	process_cache = kmem_cache_create("process",
+		sizeof(struct process_struct), process_ctor, process_dtor);
+	file_handler_cache = kmem_cache_create("file handler",
+		sizeof(struct global_file_handler), file_handler_ctor,
+		file_handler_dtor);
+	if (process_cache == NULL || file_handler_cache == NULL) {
+		panic("process_bootstrap: out of memory\n");
+	}
 	return;
 }
 
@@ -114,7 +174,8 @@ create_process_table(void)
 {
 	struct process_struct *process;
 	int i;
-	process = kmalloc(sizeof(struct process_struct));
+	/* status_cv and status_lk come with it */
+	process = kmem_cache_alloc(process_cache);
 	if (process == NULL) {
 		return NULL;
 	}
@@ -125,7 +186,7 @@ create_process_table(void)
 	process->file_table = kmalloc(MAX_FILES_PER_PROCESS * sizeof(struct global_file_hanlder**));
 	
 	if (process->file_table == NULL) {
-		kfree(process);
+		kmem_cache_free(process_cache, process);
 		return NULL;
 	}
 	
@@ -138,21 +199,6 @@ create_process_table(void)
 	process->father = curthread->process_table;
 	process->exit_code = 0;
 	
-	process->status_cv = cv_create("status_cv");
-	if (process->status_cv == NULL) {
-		kfree(process->file_table);
-		kfree(process);
-		return NULL;
-	}
-	
-	process->status_lk = lock_create("status_lk");
-	if (process->status_lk == NULL) {
-		cv_destroy(process->status_cv);
-		kfree(process->file_table);
-		kfree(process);
-		return NULL;
-	}
-	
 	return process;
 }
 
@@ -168,35 +214,34 @@ int open_std_streams(struct global_file_handler **file_table)
 	strcpy(console, "con:");
 	ret = vfs_open(console, O_RDONLY, 0, &std_in);
 	KASSERT(ret == 0);
-	file_table[0] = kmalloc(sizeof(struct global_file_handler));
+	file_table[0] = kmem_cache_alloc(file_handler_cache);
+	KASSERT(file_table[0] != NULL);
 	file_table[0]->vnode = std_in;
 	file_table[0]->offset = 0;
 	file_table[0]->open_count = 1;
 	file_table[0]->open_flags = O_RDONLY;
-	/* Ref counts and locks migh not be required for std io streams */
-	file_table[0]->flock = lock_create("file_handler_lk");
 	
 	/* Open STDOUT */
 	strcpy(console, "con:");
 	ret = vfs_open(console, O_WRONLY, 0, &std_out);
 	KASSERT(ret == 0);
-	file_table[1] = kmalloc(sizeof(struct global_file_handler));
+	file_table[1] = kmem_cache_alloc(file_handler_cache);
+	KASSERT(file_table[1] != NULL);
 	file_table[1]->vnode = std_out;
 	file_table[1]->offset = 0;
 	file_table[1]->open_count = 1;
 	file_table[1]->open_flags = O_WRONLY;
-	file_table[1]->flock = lock_create("file_handler_lk");
 	
 	/* Open STDERR */
 	strcpy(console, "con:");
 	ret = vfs_open(console, O_WRONLY, 0, &std_err);
 	KASSERT(ret == 0);
-	file_table[2] = kmalloc(sizeof(struct global_file_handler));
+	file_table[2] = kmem_cache_alloc(file_handler_cache);
+	KASSERT(file_table[2] != NULL);
 	file_table[2]->vnode = std_err;
 	file_table[2]->offset = 0;
 	file_table[2]->open_count = 1;
 	file_table[2]->open_flags = O_WRONLY;
-	file_table[2]->flock = lock_create("file_handler_lk");
 	
 	return 0;
 }
@@ -205,13 +250,12 @@ void
 destroy_process_table(struct process_struct *ps_table)
 {
 	clear_pid(ps_table->pid);
-	lock_destroy(ps_table->status_lk);
-	cv_destroy(ps_table->status_cv);
 	if (ps_table->process_name != NULL) {	
 		/* If process name is assigned, reclaim it */
 		kfree(ps_table->process_name);
 	}
-	kfree(ps_table);
+	/* The lock and cv stay with it for the next process */
+	kmem_cache_free(process_cache, ps_table);
 	return;
 }
 
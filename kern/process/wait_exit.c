@@ -8,6 +8,7 @@
 #include <kern/wait.h>
 #include <copyinout.h>
 #include <kern/errno.h>
+#include <kmem.h>
 
 static void adopt_grand_children(struct child_process_list *children, struct process_struct *new_parent);
 
@@ -126,8 +127,7 @@ sys__exit(int exit_code)
 		if (fh->open_count == 0) {
 			vfs_close(fh->vnode);
 			lock_release(fh->flock);
-			lock_destroy(fh->flock);
-			kfree(fh);
+			kmem_cache_free(file_handler_cache, fh);
 		} else {
 			lock_release(fh->flock);
 		}
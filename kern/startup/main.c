@@ -42,6 +42,8 @@
 #include <current.h>
 #include <synch.h>
 #include <vm.h>
+#include <swap.h>
+#include <shm.h>
 #include <mainbus.h>
 #include <vfs.h>
 #include <device.h>
@@ -122,6 +124,10 @@ boot(void)
 
 	/* Late phase of initialization. */
 	vm_bootstrap();
+	swap_bootstrap();
+	pageout_bootstrap();
+	shm_bootstrap();
+	ksm_bootstrap();
 	kprintf_bootstrap();
 	thread_start_cpus();
 
@@ -39,6 +39,9 @@
 #include <vfs.h>
 #include <sfs.h>
 #include <syscall.h>
+#include <vm.h>
+#include <swap.h>
+#include <addrspace.h>
 #include <test.h>
 #include "opt-synchprobs.h"
 #include "opt-sfs.h"
@@ -168,7 +171,7 @@ common_prog(int nargs, char **args)
 	kfree(thread_args);	
 	
 	if (child_ps_table->status == PS_FAIL) {
-		kfree(child_ps_table);
+		destroy_process_table(child_ps_table);
 		/* Could not think of an appropriate error */
 		return 0;
 	}/* else creation has succeeded, wait for the user process to gracefully exit */		
@@ -412,6 +415,186 @@ cmd_kheapstats(int nargs, char **args)
 	return 0;
 }
 
+static
+int
+cmd_vmstats(int nargs, char **args)
+{
+	(void)nargs;
+	(void)args;
+
+	vm_printstats();
+
+	return 0;
+}
+
+/*
+ * Command to pick the page replacement policy. Put it on the sys161
+ * command line ("swp random; ...") to choose one at boot.
+ */
+static
+int
+cmd_swappolicy(int nargs, char **args)
+{
+	if (nargs == 4 && !strcmp(args[1], "cluster")) {
+		return swap_setcluster(atoi(args[2]), atoi(args[3]));
+	}
+	if (nargs != 2) {
+		kprintf("Usage: swp random|clock\n");
+		kprintf("       swp cluster OUT IN    (pages per request)\n");
+		return EINVAL;
+	}
+
+	return swap_setpolicy(args[1]);
+}
+
+/*
+ * Command to add a swap device or file. Raw disks are used whole; a file
+ * is created and filled out to PAGES pages first.
+ */
+static
+int
+cmd_swapon(int nargs, char **args)
+{
+	if (nargs < 2 || nargs > 4) {
+		kprintf("Usage: swapon DEVICE|FILE [PRIORITY [PAGES]]\n");
+		return EINVAL;
+	}
+
+	return swap_add(args[1], nargs > 2 ? atoi(args[2]) : 0,
+			nargs > 3 ? atoi(args[3]) : 0);
+}
+
+/*
+ * Command for tuning fault-around: "fa" shows the settings and the
+ * totals, "fa N" sets the largest window (0 turns it off), and
+ * "fa report on|off" prints each process's numbers when it exits.
+ */
+static
+int
+cmd_faultaround(int nargs, char **args)
+{
+	if (nargs == 2) {
+		vm_fa_setwindow(atoi(args[1]));
+	}
+	else if (nargs == 3 && !strcmp(args[1], "report")) {
+		vm_fa_setreport(!strcmp(args[2], "on"));
+	}
+	else if (nargs != 1) {
+		kprintf("Usage: fa [window | report on|off]\n");
+		return EINVAL;
+	}
+
+	vm_fa_printstats();
+	return 0;
+}
+
+/*
+ * Command to set how far user stacks may grow, in pages.
+ */
+static
+int
+cmd_stacklimit(int nargs, char **args)
+{
+	if (nargs == 2) {
+		stack_maxpages = atoi(args[1]);
+	}
+	else if (nargs != 1) {
+		kprintf("Usage: stk [maxpages]\n");
+		return EINVAL;
+	}
+
+	kprintf("User stack limit: %u pages\n", stack_maxpages);
+	return 0;
+}
+
+/*
+ * Command for the pageout daemon: "pgo" shows its watermarks and what
+ * it has done, "pgo LOW HIGH" sets the watermarks (in free frames).
+ */
+static
+int
+cmd_pageout(int nargs, char **args)
+{
+	int result;
+
+	if (nargs == 3) {
+		result = pageout_setwatermarks(atoi(args[1]), atoi(args[2]));
+		if (result) {
+			kprintf("pgo: need 0 < low < high <= half of RAM\n");
+			return result;
+		}
+	}
+	else if (nargs != 1) {
+		kprintf("Usage: pgo [low high]\n");
+		return EINVAL;
+	}
+
+	pageout_printstats();
+	return 0;
+}
+
+/*
+ * Command to turn the compressed swap cache on or off, optionally with
+ * a limit on how much memory (in pages) the compressed data may take.
+ */
+static
+int
+cmd_zswap(int nargs, char **args)
+{
+	int result;
+
+	if (nargs == 2 || nargs == 3) {
+		if (strcmp(args[1], "on") && strcmp(args[1], "off")) {
+			kprintf("Usage: zsw [on|off [PAGES]]\n");
+			return EINVAL;
+		}
+		result = zswap_setenabled(!strcmp(args[1], "on"),
+					  nargs == 3 ? atoi(args[2]) : 0);
+		if (result) {
+			kprintf("zsw: limit is at most half of RAM\n");
+			return result;
+		}
+	}
+	else if (nargs != 1) {
+		kprintf("Usage: zsw [on|off [PAGES]]\n");
+		return EINVAL;
+	}
+
+	swap_printstats();
+	return 0;
+}
+
+/*
+ * Command to start or stop merging identical pages, optionally setting
+ * how many frames a second the scanner looks at.
+ */
+static
+int
+cmd_ksm(int nargs, char **args)
+{
+	int result;
+
+	if (nargs == 2 || nargs == 3) {
+		if (strcmp(args[1], "on") && strcmp(args[1], "off")) {
+			kprintf("Usage: ksm [on|off [PAGES-PER-SEC]]\n");
+			return EINVAL;
+		}
+		result = ksm_setenabled(!strcmp(args[1], "on"),
+					nargs == 3 ? atoi(args[2]) : 0);
+		if (result) {
+			kprintf("ksm: rate is at most 4096 pages/s\n");
+			return result;
+		}
+	}
+	else if (nargs != 1) {
+		kprintf("Usage: ksm [on|off [PAGES-PER-SEC]]\n");
+		return EINVAL;
+	}
+
+	ksm_printstats();
+	return 0;
+}
+
 ////////////////////////////////////////
 //
 // Menus.
@@ -472,6 +655,7 @@ static const char *testmenu[] = {
 	"[bt]  Bitmap test                   ",
 	"[km1] Kernel malloc test            ",
 	"[km2] kmalloc stress test           ",
+	"[ptb] Page table benchmark          ",
 	"[tt1] Thread test 1                 ",
 	"[tt2] Thread test 2                 ",
 	"[tt3] Thread test 3                 ",
@@ -513,6 +697,14 @@ static const char *mainmenu[] = {
 	"[?o] Operations menu                ",
 	"[?t] Tests menu                     ",
 	"[kh] Kernel heap stats              ",
+	"[vs] VM and swap stats              ",
+	"[swp] Page replacement policy       ",
+	"[swapon] Add swap disk or file      ",
+	"[fa] Fault-around settings/stats    ",
+	"[stk] User stack size limit         ",
+	"[pgo] Pageout watermarks/stats      ",
+	"[zsw] Compressed swap cache         ",
+	"[ksm] Same-page merging             ",
 	"[q] Quit and shut down              ",
 	NULL
 };
@@ -561,12 +753,21 @@ static struct {
 
 	/* stats */
 	{ "kh",         cmd_kheapstats },
+	{ "vs",         cmd_vmstats },
+	{ "swp",        cmd_swappolicy },
+	{ "swapon",     cmd_swapon },
+	{ "fa",         cmd_faultaround },
+	{ "stk",        cmd_stacklimit },
+	{ "pgo",        cmd_pageout },
+	{ "zsw",        cmd_zswap },
+	{ "ksm",        cmd_ksm },
 
 	/* base system tests */
 	{ "at",		arraytest },
 	{ "bt",		bitmaptest },
 	{ "km1",	malloctest },
 	{ "km2",	mallocstress },
+	{ "ptb",	ptbench },
 #if OPT_NET
 	{ "net",	nettest },
 #endif
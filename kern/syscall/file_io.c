@@ -20,6 +20,9 @@
 #include <uio.h>
 #include <vnode.h>
 #include <vfs.h>
+#include <vm.h>
+#include <kmem.h>
+#include <process.h>
 
 /***********************************************************************
  * OPEN
@@ -79,6 +82,9 @@ sys_open(userptr_t u_file, int flags, int mode, int *fd_ret){
 	if (result) {
 		goto end;
 	}
+	if (flags & O_TRUNC) {
+		textcache_purge(vnode);
+	}
 	
 	if (flags & O_APPEND) {
 		struct stat file_stat;
@@ -103,14 +109,12 @@ sys_open(userptr_t u_file, int flags, int mode, int *fd_ret){
 	global_file_count++;
 	lock_release(global_file_count_lk);
 	
-	file_handler = kmalloc(sizeof(struct global_file_handler));
+	file_handler = kmem_cache_alloc(file_handler_cache);
 	KASSERT(file_handler);
 
 	file_handler->vnode = vnode;
 	file_handler->open_count = 1;
 	file_handler->open_flags = flags;
-	file_handler->flock = lock_create("file_handler_lk");
-	KASSERT(file_handler->flock);
 	file_handler->offset = offset;
 	
 	curthread->process_table->file_table[fd] = file_handler;
@@ -151,6 +155,8 @@ sys_write(int fd, userptr_t buf, int size, int *bytes_written)
 		if (ret) {
 			return ret;
 		}
+		/* Programs started from now on must see the new contents */
+		textcache_purge(file_handler->vnode);
 		offset += size;
 		/* acquire lock */
 		lock_acquire(file_handler->flock);
@@ -235,8 +241,7 @@ void __close(int fd)
 
 	if (file_handler->open_count == 0) {
 		vfs_close(file_handler->vnode);
-		lock_destroy(file_handler->flock);
-		kfree(file_handler);
+		kmem_cache_free(file_handler_cache, file_handler);
 		
 		lock_acquire(global_file_count_lk);
 		global_file_count--;
@@ -52,6 +52,7 @@
 
 #include <types.h>
 #include <kern/errno.h>
+#include <kern/stat.h>
 #include <lib.h>
 #include <uio.h>
 #include <thread.h>
@@ -69,10 +70,13 @@
  * FILESIZE may be less than MEMSIZE; if so the remaining portion of
  * the in-memory segment should be zero-filled.
  *
- * Note that uiomove will catch it if someone tries to load an
- * executable whose load address is in kernel space. If you should
- * change this code to not use uiomove, be sure to check for this case
- * explicitly.
+ * Nothing is actually read here: the file part is recorded as a file
+ * map and each page is read in by vm_fault when it is first touched.
+ * The rest (BSS) is zero filled on demand like any other new page, so
+ * exec only pays for the pages the program uses. as_define_region has
+ * already checked that the segment lies in user space. The file is
+ * still checked to be long enough, so that a truncated executable fails
+ * here with ENOEXEC as it did when the segment was read in full.
  */
 static
 int
@@ -80,68 +84,31 @@ load_segment(struct vnode *v, off_t offset, vaddr_t vaddr,
 	     size_t memsize, size_t filesize,
 	     int is_executable)
 {
-	struct iovec iov;
-	struct uio u;
+	struct stat st;
 	int result;
 
+	(void)is_executable;
+
 	if (filesize > memsize) {
 		kprintf("ELF: warning: segment filesize > segment memsize\n");
 		filesize = memsize;
 	}
 
-	DEBUG(DB_EXEC, "ELF: Loading %lu bytes to 0x%lx\n", 
-	      (unsigned long) filesize, (unsigned long) vaddr);
-
-	iov.iov_ubase = (userptr_t)vaddr;
-	iov.iov_len = memsize;		 // length of the memory space
-	u.uio_iov = &iov;
-	u.uio_iovcnt = 1;
-	u.uio_resid = filesize;          // amount to read from the file
-	u.uio_offset = offset;
-	u.uio_segflg = is_executable ? UIO_USERISPACE : UIO_USERSPACE;
-	u.uio_rw = UIO_READ;
-	u.uio_space = curthread->t_addrspace;
-
-	result = VOP_READ(v, &u);
+	result = VOP_STAT(v, &st);
 	if (result) {
 		return result;
 	}
-
-	if (u.uio_resid != 0) {
-		/* short read; problem with executable? */
-		kprintf("ELF: short read on segment - file truncated?\n");
+	if (offset + (off_t)filesize > st.st_size) {
+		/* short file; problem with executable? */
+		kprintf("ELF: segment past end of file - file truncated?\n");
 		return ENOEXEC;
 	}
 
-	/*
-	 * If memsize > filesize, the remaining space should be
-	 * zero-filled. There is no need to do this explicitly,
-	 * because the VM system should provide pages that do not
-	 * contain other processes' data, i.e., are already zeroed.
-	 *
-	 * During development of your VM system, it may have bugs that
-	 * cause it to (maybe only sometimes) not provide zero-filled
-	 * pages, which can cause user programs to fail in strange
-	 * ways. Explicitly zeroing program BSS may help identify such
-	 * bugs, so the following disabled code is provided as a
-	 * diagnostic tool. Note that it must be disabled again before
-	 * you submit your code for grading.
-	 */
-#if 0
-	{
-		size_t fillamt;
+	DEBUG(DB_EXEC, "ELF: Mapping %lu bytes at 0x%lx\n", 
+	      (unsigned long) filesize, (unsigned long) vaddr);
 
-		fillamt = memsize - filesize;
-		if (fillamt > 0) {
-			DEBUG(DB_EXEC, "ELF: Zero-filling %lu more bytes\n", 
-			      (unsigned long) fillamt);
-			u.uio_resid += fillamt;
-			result = uiomovezeros(fillamt, &u);
-		}
-	}
-#endif
-	
-	return result;
+	return as_define_filemap(curthread->t_addrspace, v, offset, vaddr,
+				 filesize);
 }
 
 /*
@@ -221,7 +188,8 @@ load_elf(struct vnode *v, vaddr_t *entrypoint)
 		if (result) {
 			return result;
 		}
-		kprintf(">>>Segment starts at %x, size = %d, type = %x\n", ph.p_vaddr, ph.p_memsz, ph.p_type);
+		DEBUG(DB_EXEC, "ELF: segment at 0x%x, size %d, type %x\n",
+		      ph.p_vaddr, ph.p_memsz, ph.p_type);
 
 		if (ku.uio_resid != 0) {
 			/* short read; problem with executable? */
@@ -240,7 +208,6 @@ load_elf(struct vnode *v, vaddr_t *entrypoint)
 			return ENOEXEC;
 		}
 
-		kprintf("Loading...\n");
 		result = as_define_region(curthread->t_addrspace,
 					  ph.p_vaddr, ph.p_memsz,
 					  ph.p_flags & PF_R,
@@ -268,7 +235,8 @@ load_elf(struct vnode *v, vaddr_t *entrypoint)
 	
 	KASSERT((curthread->t_addrspace->heap_base & (~PAGE_FRAME)) == 0);
 	curthread->t_addrspace->cur_brk = curthread->t_addrspace->heap_base;
-	kprintf("heap_base = cur_brk = %x\n", curthread->t_addrspace->heap_base);
+	DEBUG(DB_EXEC, "ELF: heap_base = cur_brk = 0x%x\n",
+	      curthread->t_addrspace->heap_base);
 	/*
 	 * Now actually load each segment.
 	 */
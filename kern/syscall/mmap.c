@@ -0,0 +1,180 @@
+/*
+ * mmap.c
+ *
+ *  mmap(), munmap(), msync() and fsync(). The work is done by the
+ *  address space code; these check the arguments and the open file.
+ */
+
+#include <types.h>
+#include <kern/errno.h>
+#include <kern/fcntl.h>
+#include <kern/mman.h>
+#include <lib.h>
+#include <file.h>
+#include <syscall.h>
+#include <thread.h>
+#include <current.h>
+#include <copyinout.h>
+#include <vnode.h>
+#include <addrspace.h>
+
+/*
+ * The open file behind FD, or NULL.
+ */
+static struct global_file_handler *
+mmap_getfile(int fd)
+{
+	if (fd < 0 || fd >= MAX_FILES_PER_PROCESS) {
+		return NULL;
+	}
+	return curthread->process_table->file_table[fd];
+}
+
+/*
+ * Check that [ADDR, ADDR+LEN) is a page-aligned piece of user space and
+ * hand back its (page-rounded) end.
+ */
+static int
+mmap_range(vaddr_t addr, size_t len, vaddr_t *end)
+{
+	if (addr & ~(vaddr_t)PAGE_FRAME) {
+		return EINVAL;
+	}
+	if (addr >= USERSPACETOP || len > USERSPACETOP - addr) {
+		return EINVAL;
+	}
+	*end = addr + ROUNDUP(len, PAGE_SIZE);
+	return 0;
+}
+
+/*
+ * The file descriptor and offset are the fifth and sixth arguments, so
+ * they come in on the user stack (the offset 64-bit aligned), like
+ * lseek's whence.
+ */
+int
+sys_mmap(vaddr_t addr, size_t len, int prot, int flags, userptr_t stackargs,
+	 int32_t *retval)
+{
+	struct global_file_handler *fh;
+	int fd, accmode, rgprot;
+	off_t offset;
+	bool shared;
+	vaddr_t start;
+	int result;
+
+	/* ADDR is only a hint, and we don't take hints */
+	(void)addr;
+
+	result = copyin(stackargs, &fd, sizeof(fd));
+	if (result) {
+		return result;
+	}
+	result = copyin((userptr_t)((vaddr_t)stackargs + 8), &offset,
+			sizeof(offset));
+	if (result) {
+		return result;
+	}
+
+	fh = mmap_getfile(fd);
+	if (fh == NULL) {
+		return EBADF;
+	}
+	if (len == 0 || offset < 0 || (offset & ~(off_t)PAGE_FRAME) != 0) {
+		return EINVAL;
+	}
+	if ((flags & (MAP_SHARED | MAP_PRIVATE)) == 0 ||
+	    (flags & (MAP_SHARED | MAP_PRIVATE)) == (MAP_SHARED | MAP_PRIVATE) ||
+	    (flags & ~(MAP_SHARED | MAP_PRIVATE)) != 0) {
+		return EINVAL;
+	}
+	shared = (flags & MAP_SHARED) != 0;
+
+	/* Pages are read from the file, and a shared one written back */
+	accmode = fh->open_flags & O_ACCMODE;
+	if (accmode == O_WRONLY) {
+		return EACCES;
+	}
+	if (shared && (prot & PROT_WRITE) && accmode != O_RDWR) {
+		return EACCES;
+	}
+
+	result = VOP_MMAP(fh->vnode);
+	if (result) {
+		return result;
+	}
+
+	rgprot = RG_PROT_READ;
+	if (prot & PROT_WRITE) {
+		rgprot |= RG_PROT_WRITE;
+	}
+	if (prot & PROT_EXEC) {
+		rgprot |= RG_PROT_EXEC;
+	}
+	result = as_map_file(curthread->t_addrspace, fh->vnode, offset, len,
+			     rgprot, shared, &start);
+	if (result) {
+		return result;
+	}
+	*retval = (int32_t)start;
+	return 0;
+}
+
+int
+sys_munmap(vaddr_t addr, size_t len)
+{
+	vaddr_t end;
+	int result;
+
+	if (len == 0) {
+		return EINVAL;
+	}
+	result = mmap_range(addr, len, &end);
+	if (result) {
+		return result;
+	}
+	return as_unmap(curthread->t_addrspace, addr, end);
+}
+
+/*
+ * All writeback is synchronous, so MS_ASYNC is MS_SYNC; and pages are
+ * only ever shared with our own forks, so there are no other copies
+ * for MS_INVALIDATE to throw away.
+ */
+int
+sys_msync(vaddr_t addr, size_t len, int flags)
+{
+	vaddr_t end;
+	int result;
+
+	if ((flags & ~(MS_ASYNC | MS_SYNC | MS_INVALIDATE)) != 0 ||
+	    (flags & (MS_ASYNC | MS_SYNC)) == (MS_ASYNC | MS_SYNC)) {
+		return EINVAL;
+	}
+	result = mmap_range(addr, len, &end);
+	if (result) {
+		return result;
+	}
+	return as_sync(curthread->t_addrspace, addr, end, NULL);
+}
+
+/*
+ * Flush what our shared mappings of the file have changed, then the
+ * file itself.
+ */
+int
+sys_fsync(int fd)
+{
+	struct global_file_handler *fh;
+	int result;
+
+	fh = mmap_getfile(fd);
+	if (fh == NULL) {
+		return EBADF;
+	}
+	result = as_sync(curthread->t_addrspace, 0, USERSPACETOP, fh->vnode);
+	if (result) {
+		return result;
+	}
+	return VOP_FSYNC(fh->vnode);
+}
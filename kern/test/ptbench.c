@@ -0,0 +1,180 @@
+/*
+ * ptbench.c
+ *
+ *  Page table lookup benchmark. Builds the same set of user pages both
+ *  as the old doubly-linked PTE list and as the two-level page table,
+ *  then times the lookup vm_fault() does for every page, so the cost
+ *  of the two can be compared side by side as the address space grows.
+ *
+ *  Usage: ptb [maxpages]
+ */
+
+#include <types.h>
+#include <lib.h>
+#include <clock.h>
+#include <vm.h>
+#include <test.h>
+
+#define PTB_DEFAULT_MAX 2048
+#define PTB_PASSES      4
+
+/* Layout of the old page table: one node per page, appended at the tail */
+struct ptb_listnode {
+	struct pg_table_entry entry;
+	struct ptb_listnode *next;
+	struct ptb_listnode *prev;
+};
+
+/*
+ * Spread the pages over text, data/heap and stack the way a real
+ * program would, so the two-level table has to use several slices.
+ */
+static
+vaddr_t
+ptb_vaddr(unsigned i, unsigned npages)
+{
+	unsigned text = npages / 8;
+	unsigned stack = npages / 8;
+
+	if (i < text) {
+		return 0x00400000 + i * PAGE_SIZE;
+	}
+	if (i < npages - stack) {
+		return 0x10000000 + (i - text) * PAGE_SIZE;
+	}
+	return (USERSTACK - PAGE_SIZE) - (i - (npages - stack)) * PAGE_SIZE;
+}
+
+/*
+ * Average nanoseconds per operation between two timestamps. Divide
+ * before multiplying so long list walks don't overflow 32 bits.
+ */
+static
+uint32_t
+ptb_per_op_ns(time_t s1, uint32_t ns1, time_t s2, uint32_t ns2, uint32_t nops)
+{
+	time_t secs;
+	uint32_t nsecs;
+
+	getinterval(s1, ns1, s2, ns2, &secs, &nsecs);
+	return secs * (1000000000 / nops) + nsecs / nops;
+}
+
+static
+void
+ptb_list_free(struct ptb_listnode *head)
+{
+	struct ptb_listnode *tmp;
+
+	while (head != NULL) {
+		tmp = head;
+		head = head->next;
+		kfree(tmp);
+	}
+}
+
+/*
+ * Time one address space size. Returns nonzero if we ran out of
+ * memory building the two tables.
+ */
+static
+int
+ptb_run(unsigned npages)
+{
+	struct ptb_listnode *head = NULL, *tail = NULL, *node;
+	struct pagetable *pt;
+	time_t s1, s2;
+	uint32_t ns1, ns2, list_ns, pt_ns, nlookups;
+	unsigned i, pass;
+	vaddr_t va;
+
+	pt = pt_create();
+	if (pt == NULL) {
+		return 1;
+	}
+
+	for (i = 0; i < npages; i++) {
+		va = ptb_vaddr(i, npages);
+
+		node = kmalloc(sizeof(struct ptb_listnode));
+		if (node == NULL || pt_insert(pt, va) == NULL) {
+			kfree(node);
+			ptb_list_free(head);
+			pt_destroy(pt);
+			return 1;
+		}
+		node->entry.vpage = va;
+		node->entry.state = PG_UNALOC;
+		node->next = NULL;
+		node->prev = tail;
+		if (tail == NULL) {
+			head = node;
+		}
+		else {
+			tail->next = node;
+		}
+		tail = node;
+	}
+
+	nlookups = npages * PTB_PASSES;
+
+	/* Old behaviour: walk the list from the head on every fault */
+	gettime(&s1, &ns1);
+	for (pass = 0; pass < PTB_PASSES; pass++) {
+		for (i = 0; i < npages; i++) {
+			va = ptb_vaddr(i, npages);
+			for (node = head; node != NULL; node = node->next) {
+				if (node->entry.vpage == va) {
+					break;
+				}
+			}
+			KASSERT(node != NULL);
+		}
+	}
+	gettime(&s2, &ns2);
+	list_ns = ptb_per_op_ns(s1, ns1, s2, ns2, nlookups);
+
+	/* New behaviour: index the two-level table */
+	gettime(&s1, &ns1);
+	for (pass = 0; pass < PTB_PASSES; pass++) {
+		for (i = 0; i < npages; i++) {
+			va = ptb_vaddr(i, npages);
+			if (pt_lookup(pt, va) == NULL) {
+				panic("ptb: lost the PTE for 0x%x\n", va);
+			}
+		}
+	}
+	gettime(&s2, &ns2);
+	pt_ns = ptb_per_op_ns(s1, ns1, s2, ns2, nlookups);
+
+	kprintf("%8u %14u %14u\n", npages, list_ns, pt_ns);
+
+	ptb_list_free(head);
+	pt_destroy(pt);
+	return 0;
+}
+
+int
+ptbench(int nargs, char **args)
+{
+	unsigned maxpages = PTB_DEFAULT_MAX;
+	unsigned npages;
+
+	if (nargs > 1) {
+		maxpages = atoi(args[1]);
+	}
+	if (maxpages < 8) {
+		maxpages = 8;
+	}
+
+	kprintf("Page table lookup cost per fault (ns)\n");
+	kprintf("%8s %14s %14s\n", "pages", "linked list", "two-level");
+	for (npages = 8; npages <= maxpages; npages *= 2) {
+		if (ptb_run(npages)) {
+			kprintf("ptb: out of memory at %u pages\n", npages);
+			break;
+		}
+	}
+	kprintf("ptb done.\n");
+	return 0;
+}
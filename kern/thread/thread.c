@@ -45,8 +45,10 @@
 #include <current.h>
 #include <synch.h>
 #include <addrspace.h>
+#include <vm.h>
 #include <mainbus.h>
 #include <vnode.h>
+#include <kmem.h>
 
 #include "opt-synchprobs.h"
 #include "opt-defaultscheduler.h"
@@ -71,6 +73,10 @@ static struct cpuarray allcpus;
 /* Used to wait for secondary CPUs to come online. */
 static struct semaphore *cpu_startup_sem;
 
+/* Thread structures and stacks, kept for reuse (see kmem.h). */
+static struct kmem_cache *thread_cache;
+static struct kmem_cache *stack_cache;
+
 ////////////////////////////////////////////////////////////
 
 /*
@@ -122,14 +128,14 @@ thread_create(const char *name)
 
 	DEBUGASSERT(name != NULL);
 
-	thread = kmalloc(sizeof(*thread));
+	thread = kmem_cache_alloc(thread_cache);
 	if (thread == NULL) {
 		return NULL;
 	}
 
 	thread->t_name = kstrdup(name);
 	if (thread->t_name == NULL) {
-		kfree(thread);
+		kmem_cache_free(thread_cache, thread);
 		return NULL;
 	}
 	thread->t_wchan_name = "NEW";
@@ -192,6 +198,7 @@ cpu_create(unsigned hardware_number)
 
 	c->c_ipi_pending = 0;
 	c->c_numshootdown = 0;
+	c->c_shootdown_gen = 0;
 	spinlock_init(&c->c_ipi_lock);
 
 	result = cpuarray_add(&allcpus, c, &c->c_number);
@@ -215,7 +222,7 @@ cpu_create(unsigned hardware_number)
 		/*c->c_curthread->t_stack = ... */
 	}
 	else {
-		c->c_curthread->t_stack = kmalloc(STACK_SIZE);
+		c->c_curthread->t_stack = kmem_cache_alloc(stack_cache);
 		if (c->c_curthread->t_stack == NULL) {
 			panic("cpu_create: couldn't allocate stack");
 		}
@@ -256,7 +263,7 @@ thread_destroy(struct thread *thread)
 
 	/* Thread subsystem fields */
 	if (thread->t_stack != NULL) {
-		kfree(thread->t_stack);
+		kmem_cache_free(stack_cache, thread->t_stack);
 	}
 	threadlistnode_cleanup(&thread->t_listnode);
 	thread_machdep_cleanup(&thread->t_machdep);
@@ -265,7 +272,7 @@ thread_destroy(struct thread *thread)
 	thread->t_wchan_name = "DESTROYED";
 
 	kfree(thread->t_name);
-	kfree(thread);
+	kmem_cache_free(thread_cache, thread);
 }
 
 /*
@@ -357,6 +364,14 @@ thread_bootstrap(void)
 
 	cpuarray_init(&allcpus);
 
+	thread_cache = kmem_cache_create("thread", sizeof(struct thread),
+					 NULL, NULL);
+	stack_cache = kmem_cache_create("thread stack", STACK_SIZE,
+					NULL, NULL);
+	if (thread_cache == NULL || stack_cache == NULL) {
+		panic("thread_bootstrap: Out of memory\n");
+	}
+
 	/*
 	 * Create the cpu structure for the bootup CPU, the one we're
 	 * currently running on. Assume the hardware number is 0; that
@@ -492,7 +507,7 @@ thread_fork(const char *name,
 	}
 
 	/* Allocate a stack */
-	newthread->t_stack = kmalloc(STACK_SIZE);
+	newthread->t_stack = kmem_cache_alloc(stack_cache);
 	if (newthread->t_stack == NULL) {
 		thread_destroy(newthread);
 		return ENOMEM;
@@ -646,7 +661,10 @@ thread_switch(threadstate_t newstate, struct wchan *wc)
 		next = threadlist_remhead(&curcpu->c_runqueue);
 		if (next == NULL) {
 			spinlock_release(&curcpu->c_runqueue_lock);
-			cpu_idle();
+			/* Zero a page for the VM if it wants one, else sleep */
+			if (!vm_idle_zero()) {
+				cpu_idle();
+			}
 			spinlock_acquire(&curcpu->c_runqueue_lock);
 		}
 	} while (next == NULL);
@@ -1188,6 +1206,75 @@ ipi_tlbshootdown(struct cpu *target, const struct tlbshootdown *mapping)
 	spinlock_release(&target->c_ipi_lock);
 }
 
+unsigned
+ipi_tlbshootdown_batch(struct cpu *target,
+		       const struct tlbshootdown *mappings, unsigned n)
+{
+	unsigned i, ticket;
+	int num;
+
+	spinlock_acquire(&target->c_ipi_lock);
+
+	for (i=0; i<n; i++) {
+		num = target->c_numshootdown;
+		if (num == TLBSHOOTDOWN_ALL) {
+			break;
+		}
+		if (num == TLBSHOOTDOWN_MAX) {
+			target->c_numshootdown = TLBSHOOTDOWN_ALL;
+			break;
+		}
+		target->c_shootdown[num] = mappings[i];
+		target->c_numshootdown = num+1;
+	}
+	ticket = target->c_shootdown_gen;
+
+	target->c_ipi_pending |= (uint32_t)1 << IPI_TLBSHOOTDOWN;
+	mainbus_send_ipi(target);
+
+	spinlock_release(&target->c_ipi_lock);
+	return ticket;
+}
+
+/*
+ * Wait for TARGET to get through a shootdown sent with
+ * ipi_tlbshootdown_batch. Interrupts must be on, or two cpus waiting
+ * on each other would never see each other's IPIs.
+ */
+void
+ipi_tlbshootdown_wait(struct cpu *target, unsigned ticket)
+{
+	KASSERT(curthread->t_curspl == 0);
+	while (target->c_shootdown_gen == ticket) {
+		/* spin */
+	}
+}
+
+/*
+ * Whichever CPU we are on when its turn comes does MAPPING itself, so
+ * each one gets it exactly once even if we migrate along the way.
+ */
+void
+ipi_tlbshootdown_broadcast(const struct tlbshootdown *mapping)
+{
+	unsigned i, ticket;
+	struct cpu *c;
+	int spl;
+
+	for (i=0; i < cpuarray_num(&allcpus); i++) {
+		c = cpuarray_get(&allcpus, i);
+		spl = splhigh();
+		if (c == curcpu->c_self) {
+			vm_tlbshootdown(mapping);
+			splx(spl);
+			continue;
+		}
+		ticket = ipi_tlbshootdown_batch(c, mapping, 1);
+		splx(spl);
+		ipi_tlbshootdown_wait(c, ticket);
+	}
+}
+
 void
 interprocessor_interrupt(void)
 {
@@ -1228,6 +1315,7 @@ interprocessor_interrupt(void)
 			}
 		}
 		curcpu->c_numshootdown = 0;
+		curcpu->c_shootdown_gen++;
 	}
 
 	curcpu->c_ipi_pending = 0;
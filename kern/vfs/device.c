@@ -42,6 +42,7 @@
 #include <synch.h>
 #include <vnode.h>
 #include <device.h>
+#include <vm.h>
 
 /*
  * Called for each open().
@@ -241,15 +242,19 @@ null_fsync(struct vnode *v)
 }
 
 /*
- * For mmap. If you want this to do anything, you have to write it
- * yourself. Some devices may not make sense to map. Others do.
+ * For mmap. Block devices can be paged like files, as long as their
+ * blocks divide the page size; character devices can't be mapped.
  */
 static
 int
-dev_mmap(struct vnode *v  /* add stuff as needed */)
+dev_mmap(struct vnode *v)
 {
-	(void)v;
-	return EUNIMP;
+	struct device *d = v->vn_data;
+
+	if (d->d_blocks == 0 || PAGE_SIZE % d->d_blocksize != 0) {
+		return ENODEV;
+	}
+	return 0;
 }
 
 /*
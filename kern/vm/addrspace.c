@@ -40,11 +40,19 @@
 #include <mips/tlb.h>
 #include <mips/vm.h>
 #include <syscall.h>
+#include <uio.h>
+#include <vnode.h>
+#include <stat.h>
+#include <shm.h>
 
-#define STACK_VPAGES    12
+unsigned stack_maxpages = STACK_DEFAULT_MAXPAGES;
 
+static void
+free_vrange(struct addrspace *as, vaddr_t start, vaddr_t end);
 static int
-free_vpages(vaddr_t vpage, int npages);
+copy_filemaps(struct addrspace *old, struct addrspace *new_as);
+static int
+copy_regions(struct addrspace *old, struct addrspace *new_as);
 
 struct addrspace *
 as_create(void)
@@ -56,58 +64,133 @@ as_create(void)
 		return NULL;
 	}
 	as->as_stackpbase = 0;
-	as->page_table = NULL; 
+	as->page_table = pt_create();
+	if (as->page_table == NULL) {
+		kfree(as);
+		return NULL;
+	}
+	as->as_filemaps = NULL;
+	bzero(&as->as_fa, sizeof(as->as_fa));
+	as->as_regions = NULL;
+	as->as_lastregion = NULL;
+	as->as_heap = NULL;
+	as->as_stack = NULL;
+	as->as_asid = 0;
+	as->as_cpu = NULL;
+	as->as_rss = 0;
+	as->as_rss_zero = 0;
+	as->as_rss_peak = 0;
 	as->heap_base = 0;
 	as->cur_brk = 0;
 	return as;
 }
 
+struct as_copy_args {
+	struct addrspace *old_as;
+	struct addrspace *new_as;
+};
+
+/*
+ * pt_walk callback for as_copy: duplicate one PTE into the new address
+ * space. Pages are not copied; both PTEs share the frame copy-on-write
+ * and whoever writes first gets a private copy. Pages of MAP_SHARED
+ * mappings stay shared for good, so both sides see each other's writes.
+ */
+static int
+copy_pte(struct pg_table_entry *old_pte, void *data)
+{
+	struct as_copy_args *args = data;
+	struct pg_table_entry *new_pte;
+	struct as_region *rg;
+
+	new_pte = pt_insert(args->new_as->page_table, old_pte->vpage);
+	if (new_pte == NULL) {
+		return ENOMEM;
+	}
+	rg = as_find_region(args->old_as, old_pte->vpage);
+	return vm_share_page(args->old_as, old_pte, args->new_as, new_pte,
+			     rg == NULL || !rg->rg_shared);
+}
+
 int
 as_copy(struct addrspace *old, struct addrspace **ret)
 {
 	struct addrspace *new_as;
-   	new_as = as_create();
+	struct as_copy_args args;
+	int result;
+
+	new_as = as_create();
 	if (new_as == NULL) {
 		return ENOMEM;
 	}
-	new_as->page_table = kmalloc(sizeof(struct pagetable));
-	/* First copy the Page table */	
-	struct pagetable *old_pte = old->page_table;
-	struct pagetable *new_pte = new_as->page_table;
-	new_pte->prev = NULL;
-	while (old_pte != NULL) {
-		new_pte->entry = old_pte->entry;
-		if (old_pte->entry.state != PG_UNALOC) {
-			new_pte->entry.ppage = getppages(1);
-			KASSERT(new_pte->entry.ppage);
-			memmove((void *)PADDR_TO_KVADDR(new_pte->entry.ppage),
-						(const void *)PADDR_TO_KVADDR(old_pte->entry.ppage),
-						PAGE_SIZE);
-		}
-		if (old_pte->next == NULL) {
-			new_pte->next = NULL;
-		} else {
-			new_pte->next = kmalloc(sizeof(struct pagetable));
-			new_pte->next->prev = new_pte;
-			new_pte = new_pte->next;
-		}
-		old_pte = old_pte->next;
+	new_as->heap_base = old->heap_base;
+	new_as->cur_brk = old->cur_brk;
+
+	result = copy_regions(old, new_as);
+	if (result) {
+		as_destroy(new_as);
+		return result;
+	}
+	result = copy_filemaps(old, new_as);
+	if (result) {
+		as_destroy(new_as);
+		return result;
+	}
+
+	/* Only the populated part of the page table is visited */
+	args.old_as = old;
+	args.new_as = new_as;
+	result = pt_walk(old->page_table, copy_pte, &args);
+
+	/*
+	 * The parent may still have writable TLB entries for pages
+	 * that are now shared; get rid of them.
+	 */
+	vm_tlbflush_as(old);
+
+	if (result) {
+		as_destroy(new_as);
+		return result;
 	}
 
 	*ret = new_as;
 	return 0;
 }
 
+static int
+free_pte_page(struct pg_table_entry *pte, void *data)
+{
+	vm_free_pte_page(data, pte);
+	return 0;
+}
+
 void
 as_destroy(struct addrspace *as)
 {
-	struct pagetable *pte = as->page_table;
-	while (pte != NULL) {
-		struct pagetable *tmp;
-		free_coremap(pte->entry.ppage);
-		tmp = pte;
-		pte = pte->next;
-		kfree(tmp);
+	struct as_filemap *fm;
+	struct as_region *rg;
+
+	vm_fa_account(as);
+	/* Nobody can see an error from here; it's the same as munmap */
+	as_sync(as, 0, USERSPACETOP, NULL);
+	pt_walk(as->page_table, free_pte_page, as);
+	pt_destroy(as->page_table);
+	while (as->as_filemaps != NULL) {
+		fm = as->as_filemaps;
+		as->as_filemaps = fm->fm_next;
+		VOP_DECREF(fm->fm_vnode);
+		kfree(fm);
+	}
+	while (as->as_regions != NULL) {
+		rg = as->as_regions;
+		as->as_regions = rg->rg_next;
+		if (rg->rg_vnode != NULL) {
+			VOP_DECREF(rg->rg_vnode);
+		}
+		if (rg->rg_shm != NULL) {
+			shm_detach(rg->rg_shm);
+		}
+		kfree(rg);
 	}
 	kfree(as);
 }
@@ -115,14 +198,131 @@ as_destroy(struct addrspace *as)
 void
 as_activate(struct addrspace *as)
 {
-	/* as is not needed for the algorithm implemented */
-	(void)as;
-	int i, spl;
-	spl = splhigh();
-	for (i = 0; i < NUM_TLB; i++) {
-		tlb_write(TLBHI_INVALID(i), TLBLO_INVALID(), i);
+	/*
+	 * Kernel-only threads leave the TLB alone: the user entries in
+	 * it are tagged with their ASID and can't match anything else.
+	 */
+	if (as == NULL) {
+		return;
+	}
+	vm_asid_activate(as);
+}
+
+/*
+ * Add [START, END) to the sorted region list. If it overlaps regions
+ * that are already there (two segments sharing a page), they are all
+ * merged into one with the union of their protections. Returns the
+ * region now covering the range, or NULL if out of memory.
+ */
+static struct as_region *
+region_insert(struct addrspace *as, vaddr_t start, vaddr_t end, int prot,
+	      region_kind_t kind)
+{
+	struct as_region **pp, *rg, *next;
+
+	for (pp = &as->as_regions; *pp != NULL; pp = &(*pp)->rg_next) {
+		if ((*pp)->rg_end > start) {
+			break;
+		}
+	}
+
+	rg = *pp;
+	if (rg != NULL && rg->rg_start < end && start < end) {
+		if (start < rg->rg_start) {
+			rg->rg_start = start;
+		}
+		if (end > rg->rg_end) {
+			rg->rg_end = end;
+		}
+		rg->rg_prot |= prot;
+		while (rg->rg_next != NULL &&
+		       rg->rg_next->rg_start < rg->rg_end) {
+			next = rg->rg_next;
+			if (next->rg_end > rg->rg_end) {
+				rg->rg_end = next->rg_end;
+			}
+			rg->rg_prot |= next->rg_prot;
+			rg->rg_next = next->rg_next;
+			kfree(next);
+		}
+		if (rg->rg_prot & RG_PROT_EXEC) {
+			rg->rg_kind = RG_TEXT;
+		}
+		as->as_lastregion = NULL;
+		return rg;
+	}
+
+	rg = kmalloc(sizeof(struct as_region));
+	if (rg == NULL) {
+		return NULL;
+	}
+	rg->rg_start = start;
+	rg->rg_end = end;
+	rg->rg_prot = prot;
+	rg->rg_kind = kind;
+	rg->rg_backing = RB_ZERO;
+	rg->rg_vnode = NULL;
+	rg->rg_offset = 0;
+	rg->rg_shared = false;
+	rg->rg_shm = NULL;
+	rg->rg_next = *pp;
+	*pp = rg;
+	return rg;
+}
+
+struct as_region *
+as_find_region(struct addrspace *as, vaddr_t vaddr)
+{
+	struct as_region *rg;
+
+	/* Faults tend to come in runs in the same region */
+	rg = as->as_lastregion;
+	if (rg != NULL && vaddr >= rg->rg_start && vaddr < rg->rg_end) {
+		return rg;
+	}
+
+	for (rg = as->as_regions; rg != NULL; rg = rg->rg_next) {
+		if (vaddr < rg->rg_start) {
+			break;
+		}
+		if (vaddr < rg->rg_end) {
+			as->as_lastregion = rg;
+			return rg;
+		}
 	}
-	splx(spl);
+	return NULL;
+}
+
+static int
+copy_regions(struct addrspace *old, struct addrspace *new_as)
+{
+	struct as_region *rg, *copy, **tail;
+
+	tail = &new_as->as_regions;
+	for (rg = old->as_regions; rg != NULL; rg = rg->rg_next) {
+		copy = kmalloc(sizeof(struct as_region));
+		if (copy == NULL) {
+			return ENOMEM;
+		}
+		*copy = *rg;
+		copy->rg_next = NULL;
+		*tail = copy;
+		tail = &copy->rg_next;
+		if (copy->rg_vnode != NULL) {
+			VOP_INCREF(copy->rg_vnode);
+		}
+		if (copy->rg_shm != NULL) {
+			shm_ref(copy->rg_shm);
+		}
+
+		if (rg == old->as_heap) {
+			new_as->as_heap = copy;
+		}
+		if (rg == old->as_stack) {
+			new_as->as_stack = copy;
+		}
+	}
+	return 0;
 }
 
 /*
@@ -130,12 +330,14 @@ as_activate(struct addrspace *as)
  * segment in memory extends from VADDR up to (but not including)
  * VADDR+MEMSIZE.
  *
+ * Only the region is recorded; vm_fault creates PTEs as the pages
+ * get used.
  */
 int
 as_define_region(struct addrspace *as, vaddr_t vaddr, size_t sz,
 		 int readable, int writeable, int executable)
 {
-	size_t npages; 
+	int prot = 0;
 
 	/* Align the region. First, the base... */
 	sz += vaddr & ~(vaddr_t)PAGE_FRAME;
@@ -144,41 +346,162 @@ as_define_region(struct addrspace *as, vaddr_t vaddr, size_t sz,
 	/* ...and now the length. */
 	sz = (sz + PAGE_SIZE - 1) & PAGE_FRAME;
 
-	npages = sz / PAGE_SIZE;
+	/* Loading used to catch this in uiomove; now nothing is copied */
+	if (sz > USERSPACETOP || vaddr > USERSPACETOP - sz) {
+		return EFAULT;
+	}
+	if (sz == 0) {
+		return 0;
+	}
+
+	if (readable) {
+		prot |= RG_PROT_READ;
+	}
+	if (writeable) {
+		prot |= RG_PROT_WRITE;
+	}
+	if (executable) {
+		prot |= RG_PROT_EXEC;
+	}
 
-	/* We don't use these - all pages are read-write */
-	(void)readable;
-	(void)writeable;
-	(void)executable;
+	if (region_insert(as, vaddr, vaddr + sz, prot,
+			  executable ? RG_TEXT : RG_DATA) == NULL) {
+		return ENOMEM;
+	}
+	return 0;
+}
 
-	uint32_t i;	
-	if (as->page_table == NULL) {
-		as->page_table = kmalloc(sizeof(struct pagetable));
-		as->page_table->next = NULL;
-		as->page_table->prev = NULL;
-		as->page_table->entry.ppage = 0;
-		as->page_table->entry.vpage = vaddr;
-		as->page_table->entry.ppage = 0;
-		as->page_table->entry.state = PG_UNALOC;
-		as->page_table->entry.swp_offset = 0;
-	   	npages--;
-		vaddr += PAGE_SIZE;
-	}
-	
-	struct pagetable *pte = as->page_table;
-	while (pte->next != NULL) {
-		pte = pte->next;
-	}
-	for (i = 0; i < npages; i++) {
-		pte->next = kmalloc(sizeof(struct pagetable));
-		KASSERT(pte->next);
-		pte->next->prev = pte;
-		pte = pte->next;
-		pte->next = NULL;
-		pte->entry.vpage = vaddr;
-		pte->entry.ppage = 0;
-		pte->entry.state = PG_UNALOC;
-		vaddr += PAGE_SIZE;
+int
+as_define_filemap(struct addrspace *as, struct vnode *v, off_t offset,
+		  vaddr_t vaddr, size_t filesize)
+{
+	struct as_filemap *fm;
+	struct as_region *rg;
+
+	if (filesize == 0) {
+		return 0;
+	}
+
+	fm = kmalloc(sizeof(struct as_filemap));
+	if (fm == NULL) {
+		return ENOMEM;
+	}
+	fm->fm_vaddr = vaddr;
+	fm->fm_filesize = filesize;
+	fm->fm_offset = offset;
+	fm->fm_vnode = v;
+	VOP_INCREF(v);
+
+	fm->fm_next = as->as_filemaps;
+	as->as_filemaps = fm;
+
+	/* Mark the regions the data lands in as file backed */
+	for (rg = as->as_regions; rg != NULL; rg = rg->rg_next) {
+		if (rg->rg_start < vaddr + filesize && rg->rg_end > vaddr) {
+			rg->rg_backing = RB_FILE;
+		}
+	}
+	return 0;
+}
+
+/*
+ * Read the file data for the page at VPAGE into PADDR. A page can
+ * straddle the end of one segment and the start of the next, so look
+ * at every file map; bytes no map covers stay zero.
+ */
+int
+as_fill_page(struct addrspace *as, vaddr_t vpage, paddr_t paddr)
+{
+	struct as_filemap *fm;
+	struct as_region *rg;
+	struct iovec iov;
+	struct uio ku;
+	vaddr_t start, end;
+	int result;
+
+	rg = as_find_region(as, vpage);
+	if (rg == NULL || rg->rg_backing == RB_ZERO) {
+		return 0;
+	}
+	if (rg->rg_backing == RB_VNODE) {
+		/* Past the end of the file the page just stays zero */
+		uio_kinit(&iov, &ku, (void *)PADDR_TO_KVADDR(paddr), PAGE_SIZE,
+			  rg->rg_offset + (vpage - rg->rg_start), UIO_READ);
+		return VOP_READ(rg->rg_vnode, &ku);
+	}
+
+	for (fm = as->as_filemaps; fm != NULL; fm = fm->fm_next) {
+		start = vpage;
+		if (start < fm->fm_vaddr) {
+			start = fm->fm_vaddr;
+		}
+		end = vpage + PAGE_SIZE;
+		if (end > fm->fm_vaddr + fm->fm_filesize) {
+			end = fm->fm_vaddr + fm->fm_filesize;
+		}
+		if (start >= end) {
+			continue;
+		}
+
+		uio_kinit(&iov, &ku,
+			  (void *)(PADDR_TO_KVADDR(paddr) + (start - vpage)),
+			  end - start, fm->fm_offset + (start - fm->fm_vaddr),
+			  UIO_READ);
+		result = VOP_READ(fm->fm_vnode, &ku);
+		if (result) {
+			return result;
+		}
+		if (ku.uio_resid != 0) {
+			/* The executable got truncated under us */
+			return EIO;
+		}
+	}
+	return 0;
+}
+
+/*
+ * The file VPAGE's contents come from, if the page is read-only text
+ * and so the same in every process running that file; else NULL.
+ * Doesn't sleep.
+ */
+struct vnode *
+as_text_vnode(struct addrspace *as, vaddr_t vpage)
+{
+	struct as_filemap *fm;
+	struct as_region *rg;
+	struct vnode *v = NULL;
+
+	rg = as_find_region(as, vpage);
+	if (rg == NULL || rg->rg_kind != RG_TEXT ||
+	    rg->rg_backing != RB_FILE || (rg->rg_prot & RG_PROT_WRITE)) {
+		return NULL;
+	}
+	for (fm = as->as_filemaps; fm != NULL; fm = fm->fm_next) {
+		if (fm->fm_vaddr >= vpage + PAGE_SIZE ||
+		    fm->fm_vaddr + fm->fm_filesize <= vpage) {
+			continue;
+		}
+		if (v != NULL && v != fm->fm_vnode) {
+			return NULL;
+		}
+		v = fm->fm_vnode;
+	}
+	return v;
+}
+
+static int
+copy_filemaps(struct addrspace *old, struct addrspace *new_as)
+{
+	struct as_filemap *fm;
+	int result;
+
+	for (fm = old->as_filemaps; fm != NULL; fm = fm->fm_next) {
+		result = as_define_filemap(new_as, fm->fm_vnode,
+					   fm->fm_offset, fm->fm_vaddr,
+					   fm->fm_filesize);
+		if (result) {
+			return result;
+		}
 	}
 	return 0;
 }
@@ -190,33 +513,86 @@ as_prepare_load(struct addrspace *as)
 	return 0;
 }
 
+/*
+ * Split the all-zero tail off a file-backed data region, so BSS pages
+ * are known to be zero filled without looking at the file maps.
+ */
+static int
+split_bss(struct addrspace *as, struct as_region *rg)
+{
+	struct as_filemap *fm;
+	struct as_region *bss;
+	vaddr_t filetop = rg->rg_start;
+
+	for (fm = as->as_filemaps; fm != NULL; fm = fm->fm_next) {
+		if (fm->fm_vaddr < rg->rg_end &&
+		    fm->fm_vaddr + fm->fm_filesize > filetop) {
+			filetop = fm->fm_vaddr + fm->fm_filesize;
+		}
+	}
+	filetop = (filetop + PAGE_SIZE - 1) & PAGE_FRAME;
+	if (filetop >= rg->rg_end) {
+		return 0;
+	}
+
+	bss = kmalloc(sizeof(struct as_region));
+	if (bss == NULL) {
+		return ENOMEM;
+	}
+	bss->rg_start = filetop;
+	bss->rg_end = rg->rg_end;
+	bss->rg_prot = rg->rg_prot;
+	bss->rg_kind = RG_BSS;
+	bss->rg_backing = RB_ZERO;
+	bss->rg_vnode = NULL;
+	bss->rg_offset = 0;
+	bss->rg_shared = false;
+	bss->rg_shm = NULL;
+	bss->rg_next = rg->rg_next;
+	rg->rg_next = bss;
+	rg->rg_end = filetop;
+	return 0;
+}
+
 int
 as_complete_load(struct addrspace *as)
 {
-	(void)as;
+	struct as_region *rg;
+	int result;
+
+	for (rg = as->as_regions; rg != NULL; rg = rg->rg_next) {
+		if (rg->rg_kind != RG_DATA) {
+			continue;
+		}
+		if (rg->rg_backing == RB_ZERO) {
+			rg->rg_kind = RG_BSS;
+			continue;
+		}
+		result = split_bss(as, rg);
+		if (result) {
+			return result;
+		}
+	}
+	as->as_lastregion = NULL;
+
+	/* Empty to start with; sbrk moves the top */
+	as->as_heap = region_insert(as, as->heap_base, as->heap_base,
+				    RG_PROT_READ | RG_PROT_WRITE, RG_HEAP);
+	if (as->as_heap == NULL) {
+		return ENOMEM;
+	}
 	return 0;
 }
 
+
 int
 as_define_stack(struct addrspace *as, vaddr_t *stackptr)
 {
-	struct pagetable *pte = as->page_table;
-	int i;
-	KASSERT(pte != NULL);
-	while (pte->next != NULL) {
-		pte = pte->next;
-	}
-	vaddr_t stack_pg = (USERSTACK - 1) & PAGE_FRAME;
-	for (i = 0; i < _STACKPAGES; i++) {
-		pte->next = kmalloc(sizeof(struct pagetable));
-		KASSERT(pte->next);
-		pte->next->prev = pte;
-		pte = pte->next;
-		pte->next = NULL;
-		pte->entry.vpage = stack_pg;
-		pte->entry.ppage = 0;
-		pte->entry.state = PG_UNALOC;
-		stack_pg -= PAGE_SIZE;
+	/* Just the top page; the rest comes in through as_grow_stack */
+	as->as_stack = region_insert(as, USERSTACK - PAGE_SIZE, USERSTACK,
+				     RG_PROT_READ | RG_PROT_WRITE, RG_STACK);
+	if (as->as_stack == NULL) {
+		return ENOMEM;
 	}
 
 	/* Initial user-level stack pointer */
@@ -225,107 +601,404 @@ as_define_stack(struct addrspace *as, vaddr_t *stackptr)
 }
 
 int
-sys_sbrk(intptr_t amount, int32_t *cur_brk)
+as_grow_stack(struct addrspace *as, vaddr_t vaddr)
 {
-	size_t npages; 
-	vaddr_t heap_pg;
-	uint32_t i;
-	struct pagetable *pte = curthread->t_addrspace->page_table;
-	int free_heap = 0;
-
-	*cur_brk = (int32_t)curthread->t_addrspace->cur_brk;
-	/*kprintf("sbrk request amount = %u\n", (uint32_t)amount);*/
-	
-	if (amount == 0) {
-		return 0;	
-	} else if (amount > 0) {
-		/* Check if the existing allocation can satisfy request */
-		if (curthread->t_addrspace->cur_brk != curthread->t_addrspace->heap_base) {
-			/* at least 1 page has been allocated */
-			free_heap = PAGE_SIZE - (curthread->t_addrspace->cur_brk % PAGE_SIZE);
-			if (free_heap == PAGE_SIZE) {
-				free_heap = 0;	
+	struct as_region *stack = as->as_stack;
+	struct as_region *rg, *below = NULL;
+	vaddr_t limit;
+
+	vaddr &= PAGE_FRAME;
+	if (stack == NULL || vaddr >= stack->rg_start) {
+		return EFAULT;
+	}
+
+	limit = 0;
+	if (stack_maxpages < USERSTACK / PAGE_SIZE) {
+		limit = USERSTACK - stack_maxpages * PAGE_SIZE;
+	}
+	if (vaddr < limit) {
+		return EFAULT;
+	}
+
+	/* Stay clear of the heap, or whatever else is below us */
+	for (rg = as->as_regions; rg != stack; rg = rg->rg_next) {
+		below = rg;
+	}
+	if (below != NULL &&
+	    vaddr < below->rg_end + STACK_GUARDPAGES * PAGE_SIZE) {
+		return EFAULT;
+	}
+
+	/* Pages get PTEs as they are touched, like any other region */
+	stack->rg_start = vaddr;
+	return 0;
+}
+
+/*
+ * How high mappings may go: clear of everything the stack may grow
+ * into, plus the guard gap.
+ */
+static vaddr_t
+mmap_ceiling(struct addrspace *as)
+{
+	vaddr_t top;
+
+	top = as->as_stack->rg_start;
+	if (stack_maxpages < USERSTACK / PAGE_SIZE &&
+	    USERSTACK - stack_maxpages * PAGE_SIZE < top) {
+		top = USERSTACK - stack_maxpages * PAGE_SIZE;
+	}
+	if (top < STACK_GUARDPAGES * PAGE_SIZE) {
+		return 0;
+	}
+	return top - STACK_GUARDPAGES * PAGE_SIZE;
+}
+
+/*
+ * Find room for SIZE bytes of mappings: the highest gap below
+ * mmap_ceiling that is clear of the heap's guard gap. Returns 0 if
+ * there is none.
+ */
+static vaddr_t
+mmap_findspace(struct addrspace *as, size_t size)
+{
+	struct as_region *rg;
+	vaddr_t lo, hi, top, found = 0;
+
+	top = mmap_ceiling(as);
+
+	/* Never hand out page 0 */
+	lo = PAGE_SIZE;
+	for (rg = as->as_regions; ; rg = rg->rg_next) {
+		hi = (rg == NULL || rg->rg_start > top) ? top : rg->rg_start;
+		if (hi >= lo && hi - lo >= size) {
+			found = hi - size;
+		}
+		if (rg == NULL || rg->rg_start >= top) {
+			break;
+		}
+		lo = rg->rg_end;
+		if (rg == as->as_heap) {
+			lo += STACK_GUARDPAGES * PAGE_SIZE;
+		}
+	}
+	return found;
+}
+
+int
+as_map_file(struct addrspace *as, struct vnode *v, off_t offset, size_t len,
+	    int prot, bool shared, vaddr_t *ret)
+{
+	struct as_region *rg;
+	vaddr_t start;
+	size_t size;
+
+	size = ROUNDUP(len, PAGE_SIZE);
+	if (len == 0 || size < len) {
+		return EINVAL;
+	}
+	start = mmap_findspace(as, size);
+	if (start == 0) {
+		return ENOMEM;
+	}
+
+	rg = region_insert(as, start, start + size, prot, RG_MMAP);
+	if (rg == NULL) {
+		return ENOMEM;
+	}
+	KASSERT(rg->rg_start == start && rg->rg_end == start + size);
+	rg->rg_backing = RB_VNODE;
+	rg->rg_vnode = v;
+	rg->rg_offset = offset;
+	rg->rg_shared = shared;
+	VOP_INCREF(v);
+
+	*ret = start;
+	return 0;
+}
+
+/*
+ * Whether [START, START+SIZE) is somewhere mmap_findspace could have
+ * picked.
+ */
+static bool
+mmap_fits(struct addrspace *as, vaddr_t start, size_t size)
+{
+	struct as_region *rg;
+	vaddr_t end;
+
+	if (start < PAGE_SIZE || start > mmap_ceiling(as) ||
+	    size > mmap_ceiling(as) - start) {
+		return false;
+	}
+	for (rg = as->as_regions; rg != NULL; rg = rg->rg_next) {
+		end = rg->rg_end;
+		if (rg == as->as_heap) {
+			end += STACK_GUARDPAGES * PAGE_SIZE;
+		}
+		if (rg->rg_start < start + size && end > start) {
+			return false;
+		}
+	}
+	return true;
+}
+
+/*
+ * Attach shared memory segment SEG at ADDR, or anywhere if ADDR is 0.
+ * The caller has already counted the attachment.
+ */
+int
+as_map_shm(struct addrspace *as, struct shm_segment *seg, vaddr_t addr,
+	   int prot, vaddr_t *ret)
+{
+	struct as_region *rg;
+	size_t size = shm_size(seg);
+
+	if (addr == 0) {
+		addr = mmap_findspace(as, size);
+		if (addr == 0) {
+			return ENOMEM;
+		}
+	}
+	else if ((addr & ~(vaddr_t)PAGE_FRAME) != 0 ||
+		 !mmap_fits(as, addr, size)) {
+		return EINVAL;
+	}
+
+	rg = region_insert(as, addr, addr + size, prot, RG_SHM);
+	if (rg == NULL) {
+		return ENOMEM;
+	}
+	KASSERT(rg->rg_start == addr && rg->rg_end == addr + size);
+	rg->rg_backing = RB_SHM;
+	rg->rg_shared = true;
+	rg->rg_shm = seg;
+
+	*ret = addr;
+	return 0;
+}
+
+/*
+ * Take out the segment attached at ADDR and hand it back, so the
+ * caller can drop the attachment.
+ */
+int
+as_unmap_shm(struct addrspace *as, vaddr_t addr, struct shm_segment **ret)
+{
+	struct as_region **pp, *rg;
+
+	for (pp = &as->as_regions; (rg = *pp) != NULL; pp = &rg->rg_next) {
+		if (rg->rg_start == addr && rg->rg_kind == RG_SHM) {
+			break;
+		}
+	}
+	if (rg == NULL) {
+		return EINVAL;
+	}
+
+	free_vrange(as, rg->rg_start, rg->rg_end);
+	*pp = rg->rg_next;
+	as->as_lastregion = NULL;
+	*ret = rg->rg_shm;
+	kfree(rg);
+	return 0;
+}
+
+/*
+ * Write back what shared mappings have changed. Only pages that have a
+ * PTE can have been written; ones past the end of the file are dropped,
+ * as there is nowhere to put them.
+ */
+int
+as_sync(struct addrspace *as, vaddr_t start, vaddr_t end, struct vnode *v)
+{
+	struct as_region *rg;
+	struct pg_table_entry *pte;
+	struct stat st;
+	vaddr_t va, top;
+	off_t off;
+	int result;
+
+	for (rg = as->as_regions; rg != NULL; rg = rg->rg_next) {
+		if (rg->rg_end <= start) {
+			continue;
+		}
+		if (rg->rg_start >= end) {
+			break;
+		}
+		if (rg->rg_backing != RB_VNODE || !rg->rg_shared ||
+		    (v != NULL && rg->rg_vnode != v)) {
+			continue;
+		}
+
+		result = VOP_STAT(rg->rg_vnode, &st);
+		if (result) {
+			return result;
+		}
+		va = start > rg->rg_start ? start : rg->rg_start;
+		top = end < rg->rg_end ? end : rg->rg_end;
+		for (; va < top; va += PAGE_SIZE) {
+			off = rg->rg_offset + (va - rg->rg_start);
+			if (off >= st.st_size) {
+				break;
+			}
+			pte = pt_lookup(as->page_table, va);
+			if (pte == NULL) {
+				continue;
+			}
+			result = vm_writeback_page(as, pte, rg->rg_vnode, off,
+				st.st_size - off < PAGE_SIZE ?
+				st.st_size - off : PAGE_SIZE);
+			if (result) {
+				return result;
 			}
 		}
-		if (amount <= free_heap) {
-			/* kprintf("Satisfied in existing heap 0x%x\n", curthread->t_addrspace->cur_brk & PAGE_FRAME); */
-			curthread->t_addrspace->cur_brk += amount;
-			return 0;
-		}
-		amount -= free_heap;
-		npages = 1 + (amount - 1) / PAGE_SIZE;
-
-		while (pte->next != NULL) {
-			pte = pte->next;
-		}
-		
-		struct pagetable *heap_pte = pte;
-		heap_pg = (curthread->t_addrspace->cur_brk + free_heap) & PAGE_FRAME;
-		for (i = 0; i < npages; i++) {
-			/* kprintf("Allocating new heap page at 0x%x\n", heap_pg); */
-			pte->next = kmalloc(sizeof(struct pagetable));
-			if (pte->next == NULL) {
-				/* Ran out of memory, no swapping implemented */
-				heap_pte = heap_pte->next;
-				if (heap_pte == NULL) {
-					return ENOMEM;
-				}
-				heap_pte->prev->next = NULL;
-				while (heap_pte->next != NULL) {
-					heap_pte = heap_pte->next;
-					kfree(heap_pte->prev);
-				}
-				/* Last node itself */
-				kfree(heap_pte);
+	}
+	return 0;
+}
+
+/*
+ * Unmap [START, END). Holes in the range are fine, but anything mapped
+ * there has to be a file mapping: the rest of the address space isn't
+ * ours to take apart. At most one mapping is split in two (when the
+ * range is strictly inside it), so that piece is allocated up front
+ * and nothing can fail once pages start going away.
+ */
+int
+as_unmap(struct addrspace *as, vaddr_t start, vaddr_t end)
+{
+	struct as_region **pp, *rg, *tail = NULL;
+	int result;
+
+	for (rg = as->as_regions; rg != NULL; rg = rg->rg_next) {
+		if (rg->rg_end <= start) {
+			continue;
+		}
+		if (rg->rg_start >= end) {
+			break;
+		}
+		if (rg->rg_kind != RG_MMAP) {
+			return EINVAL;
+		}
+		if (rg->rg_start < start && rg->rg_end > end) {
+			tail = kmalloc(sizeof(struct as_region));
+			if (tail == NULL) {
 				return ENOMEM;
 			}
-			pte->next->prev = pte;
-			pte = pte->next;
-			pte->next = NULL;
-			pte->entry.vpage = heap_pg;
-			pte->entry.ppage = 0;
-			pte->entry.state = PG_UNALOC;
-			heap_pg += PAGE_SIZE;
-		}
-		curthread->t_addrspace->cur_brk += (amount + free_heap);
-		/* kprintf("Setting cur_brk to 0x%x\n", curthread->t_addrspace->cur_brk); */
-	} else {
-		/* free page operation */
-		if ((curthread->t_addrspace->cur_brk + amount) < curthread->t_addrspace->heap_base) {
-			return EINVAL;
 		}
-		vaddr_t old_brk_page = curthread->t_addrspace->cur_brk & PAGE_FRAME;
-		vaddr_t new_brk_page = (curthread->t_addrspace->cur_brk + amount) & PAGE_FRAME;
-		
-		int ret = free_vpages(new_brk_page + PAGE_SIZE, (old_brk_page - new_brk_page)/PAGE_SIZE);
-		KASSERT(ret == 0);
 	}
+
+	result = as_sync(as, start, end, NULL);
+	if (result) {
+		kfree(tail);
+		return result;
+	}
+	free_vrange(as, start, end);
+
+	pp = &as->as_regions;
+	while ((rg = *pp) != NULL && rg->rg_start < end) {
+		if (rg->rg_end <= start) {
+			pp = &rg->rg_next;
+		}
+		else if (rg->rg_start < start && rg->rg_end > end) {
+			*tail = *rg;
+			tail->rg_start = end;
+			tail->rg_offset += end - rg->rg_start;
+			VOP_INCREF(tail->rg_vnode);
+			rg->rg_end = start;
+			rg->rg_next = tail;
+			break;
+		}
+		else if (rg->rg_start < start) {
+			rg->rg_end = start;
+			pp = &rg->rg_next;
+		}
+		else if (rg->rg_end > end) {
+			rg->rg_offset += end - rg->rg_start;
+			rg->rg_start = end;
+			break;
+		}
+		else {
+			*pp = rg->rg_next;
+			VOP_DECREF(rg->rg_vnode);
+			kfree(rg);
+		}
+	}
+	as->as_lastregion = NULL;
 	return 0;
 }
 
-int free_vpages(vaddr_t vpage, int npages)
+/*
+ * Move the break. The heap is just a region, so this only moves the
+ * region's top: growing creates nothing (pages appear as they fault),
+ * and shrinking hands back whatever the dropped range had in one pass.
+ */
+int
+sys_sbrk(intptr_t amount, int32_t *cur_brk)
 {
-	struct pagetable *pte = curthread->t_addrspace->page_table;
-	
-	while (pte != NULL || npages != 0) {
-		if (pte->entry.vpage == vpage) {
-			struct pagetable *tmp;
-			free_kpages(vpage);
-			vpage += PAGE_SIZE;
-			npages--;
-			/* unlink the pte from the table and free it */
-			tmp = pte;
-			pte = pte->next;
-			/* heap entry can never be the first entry in the page table */
-			KASSERT(tmp->prev != NULL);
-			if (tmp->next != NULL){
-				tmp->prev->next = tmp->next;
-				tmp->next->prev = tmp->prev;
-			}
-			kfree(tmp);
-		} else {
-			pte = pte->next;
+	struct addrspace *as = curthread->t_addrspace;
+	vaddr_t brk = as->cur_brk;
+	vaddr_t old_top, new_top, ceiling;
+
+	*cur_brk = (int32_t)brk;
+	if (amount == 0) {
+		return 0;
+	}
+
+	if (amount > 0) {
+		/* Stay a guard gap below the next region, mapping or stack */
+		ceiling = as->as_heap->rg_next->rg_start;
+		if ((vaddr_t)amount > ceiling - brk ||
+		    ceiling - brk - amount < STACK_GUARDPAGES * PAGE_SIZE) {
+			return ENOMEM;
 		}
 	}
-	return npages;
+	else if ((vaddr_t)-amount > brk - as->heap_base) {
+		return EINVAL;
+	}
+
+	old_top = ROUNDUP(brk, PAGE_SIZE);
+	new_top = ROUNDUP(brk + amount, PAGE_SIZE);
+	as->cur_brk = brk + amount;
+	as->as_heap->rg_end = new_top;
+
+	if (new_top < old_top) {
+		free_vrange(as, new_top, old_top);
+	}
+	return 0;
+}
+
+struct free_vrange_args {
+	struct addrspace *as;
+	bool invalidate;		/* probe the TLB for each page */
+};
+
+static void
+free_vrange_pte(struct pg_table_entry *pte, void *data)
+{
+	struct free_vrange_args *args = data;
+
+	if (args->invalidate) {
+		vm_tlbinvalidate(args->as, pte->vpage);
+	}
+	vm_free_pte_page(args->as, pte);
+}
+
+/*
+ * Release [START, END) of AS along with its PTEs. Only populated parts
+ * of the page table are visited. Past a TLB's worth of pages it is
+ * cheaper to drop all of our TLB entries at once (a new ASID) than to
+ * probe for each page.
+ */
+static void
+free_vrange(struct addrspace *as, vaddr_t start, vaddr_t end)
+{
+	struct free_vrange_args args;
+
+	args.as = as;
+	args.invalidate = (end - start) / PAGE_SIZE <= NUM_TLB;
+	if (!args.invalidate) {
+		vm_tlbflush_as(as);
+	}
+	pt_remove_range(as->page_table, start, end, free_vrange_pte, &args);
 }
@@ -29,8 +29,14 @@
 
 #include <types.h>
 #include <lib.h>
+#include <spl.h>
 #include <spinlock.h>
+#include <cpu.h>
+#include <thread.h>
+#include <current.h>
 #include <vm.h>
+#include <kmem.h>
+#include <platform/maxcpus.h>
 
 /*
  * Kernel malloc.
@@ -179,6 +185,8 @@ freepageref(struct pageref *p)
 	k = ((uint32_t)1) << (j%32);
 	KASSERT((pagerefs_inuse[i] & k) != 0);
 	pagerefs_inuse[i] &= ~k;
+	/* so subpage_blocktype can't match the page it used to describe */
+	p->pageaddr_and_blocktype = 0;
 }
 
 ////////////////////////////////////////
@@ -189,14 +197,47 @@ static struct pageref *allbase;
 ////////////////////////////////////////
 
 /*
- * Use one spinlock for the whole thing. Making parts of the kmalloc
- * logic per-cpu is worthwhile for scalability; however, for the time
- * being at least we won't, because it adds a lot of complexity and in
- * OS/161 performance and scalability aren't super-critical.
+ * Use one spinlock for the pages and their free lists. In front of
+ * them each cpu keeps a magazine per block size: a small stack of
+ * free blocks, touched only by that cpu with interrupts off. kmalloc
+ * and kfree go to the magazine, and only take the spinlock to refill
+ * an empty one or drain a full one, half a magazine at a time.
+ *
+ * Blocks in magazines still count as allocated to the pages, so a
+ * page can be held by them; they are flushed back if a new page can't
+ * be had. The bigger sizes get smaller magazines to bound that.
  */
 
 static struct spinlock kmalloc_spinlock = SPINLOCK_INITIALIZER;
 
+#define KMAG_ROUNDS 16
+
+struct kmag {
+	void *km_rounds[KMAG_ROUNDS];	/* oldest first */
+	unsigned km_count;
+};
+
+struct kmag_cpu {
+	struct kmag kc_mags[NSIZES];
+	unsigned kc_allochits;
+	unsigned kc_allocmisses;	/* refills */
+	unsigned kc_freehits;
+	unsigned kc_freemisses;		/* drains */
+};
+
+static struct kmag_cpu kmag_cpus[MAXCPUS];
+
+/* None until the cpu structures exist */
+#define KMAG_USABLE() (curthread != NULL && curthread->t_cpu != NULL)
+
+/* Half a page of blocks per magazine, at most KMAG_ROUNDS */
+#define KMAG_CAP(blktype) \
+	(PAGE_SIZE/2/sizes[blktype] < KMAG_ROUNDS ? \
+	 PAGE_SIZE/2/sizes[blktype] : KMAG_ROUNDS)
+#define KMAG_BATCH(blktype) ((KMAG_CAP(blktype) + 1) / 2)
+
+static bool kmag_flush(void);
+
 ////////////////////////////////////////
 
 /* SLOWER implies SLOW */
@@ -334,6 +375,8 @@ void
 kheap_printstats(void)
 {
 	struct pageref *pr;
+	struct kmag_cpu *kc;
+	unsigned i, j, cached;
 
 	/* print the whole thing with interrupts off */
 	spinlock_acquire(&kmalloc_spinlock);
@@ -345,6 +388,27 @@ kheap_printstats(void)
 	}
 
 	spinlock_release(&kmalloc_spinlock);
+
+	/* Other cpus' counters may be moving; near enough */
+	kprintf("Per-cpu magazines (their blocks show as in use above):\n");
+	for (i=0; i<MAXCPUS; i++) {
+		kc = &kmag_cpus[i];
+		if (kc->kc_allochits + kc->kc_allocmisses +
+		    kc->kc_freehits + kc->kc_freemisses == 0) {
+			continue;
+		}
+		cached = 0;
+		for (j=0; j<NSIZES; j++) {
+			cached += kc->kc_mags[j].km_count;
+		}
+		kprintf("cpu%u: %u blocks cached; alloc %u hits %u misses, "
+			"free %u hits %u misses\n", i, cached,
+			kc->kc_allochits, kc->kc_allocmisses,
+			kc->kc_freehits, kc->kc_freemisses);
+	}
+
+	kmem_cache_printstats();
+	kvm_printstats();
 }
 
 ////////////////////////////////////////
@@ -392,24 +456,21 @@ int blocktype(size_t sz)
 	return 0;
 }
 
+/*
+ * Take a block off the first page of type BLKTYPE that has one, or
+ * return NULL if none does.
+ */
 static
 void *
-subpage_kmalloc(size_t sz)
+subpage_take(unsigned blktype)
 {
-	unsigned blktype;	// index into sizes[] that we're using
 	struct pageref *pr;	// pageref for page we're allocating from
 	vaddr_t prpage;		// PR_PAGEADDR(pr)
 	vaddr_t fla;		// free list entry address
-	struct freelist *volatile fl;	// free list entry
+	struct freelist *fl;	// free list entry
 	void *retptr;		// our result
 
-	volatile int i;
-
-
-	blktype = blocktype(sz);
-	sz = sizes[blktype];
-
-	spinlock_acquire(&kmalloc_spinlock);
+	KASSERT(spinlock_do_i_hold(&kmalloc_spinlock));
 
 	checksubpages();
 
@@ -420,9 +481,6 @@ subpage_kmalloc(size_t sz)
 		checksubpage(pr);
 
 		if (pr->nfree > 0) {
-
-		doalloc: /* comes here after getting a whole fresh page */
-
 			KASSERT(pr->freelist_offset < PAGE_SIZE);
 			prpage = PR_PAGEADDR(pr);
 			fla = prpage + pr->freelist_offset;
@@ -445,11 +503,38 @@ subpage_kmalloc(size_t sz)
 
 			checksubpages();
 
-			spinlock_release(&kmalloc_spinlock);
 			return retptr;
 		}
 	}
 
+	return NULL;
+}
+
+static
+void *
+subpage_kmalloc(size_t sz)
+{
+	unsigned blktype;	// index into sizes[] that we're using
+	struct pageref *pr;	// pageref for the new page
+	vaddr_t prpage;		// PR_PAGEADDR(pr)
+	vaddr_t fla;		// free list entry address
+	struct freelist *volatile fl;	// free list entry
+	void *retptr;		// our result
+
+	volatile int i;
+
+
+	blktype = blocktype(sz);
+	sz = sizes[blktype];
+
+	spinlock_acquire(&kmalloc_spinlock);
+
+	retptr = subpage_take(blktype);
+	if (retptr != NULL) {
+		spinlock_release(&kmalloc_spinlock);
+		return retptr;
+	}
+
 	/*
 	 * No page of the right size available.
 	 * Make a new one.
@@ -461,6 +546,10 @@ subpage_kmalloc(size_t sz)
 
 	spinlock_release(&kmalloc_spinlock);
 	prpage = alloc_kpages(1);
+	if (prpage==0 && kmag_flush()) {
+		/* This cpu's magazines may have been holding a page */
+		prpage = alloc_kpages(1);
+	}
 	if (prpage==0) {
 		/* Out of memory. */
 		kprintf("kmalloc: Subpage allocator couldn't get a page\n"); 
@@ -504,13 +593,23 @@ subpage_kmalloc(size_t sz)
 	pr->next_all = allbase;
 	allbase = pr;
 
-	/* This is kind of cheesy, but avoids duplicating the alloc code. */
-	goto doalloc;
+	/* The new page is first on its list. */
+	retptr = subpage_take(blktype);
+	KASSERT(retptr != NULL);
+
+	spinlock_release(&kmalloc_spinlock);
+	return retptr;
 }
 
+/*
+ * Put PTR back on its page's free list. If that leaves the page
+ * entirely free, take it off our lists and hand it back in FREEPAGE
+ * for the caller to free_kpages once the spinlock is released.
+ * Returns -1 if PTR isn't on any of our pages.
+ */
 static
 int
-subpage_kfree(void *ptr)
+subpage_put(void *ptr, vaddr_t *freepage)
 {
 	int blktype;		// index into sizes[] that we're using
 	vaddr_t ptraddr;	// same as ptr
@@ -520,9 +619,10 @@ subpage_kfree(void *ptr)
 	struct freelist *fl;	// free list entry
 	vaddr_t offset;		// offset into page
 
-	ptraddr = (vaddr_t)ptr;
+	KASSERT(spinlock_do_i_hold(&kmalloc_spinlock));
 
-	spinlock_acquire(&kmalloc_spinlock);
+	ptraddr = (vaddr_t)ptr;
+	*freepage = 0;
 
 	checksubpages();
 
@@ -541,7 +641,6 @@ subpage_kfree(void *ptr)
 
 	if (pr==NULL) {
 		/* Not on any of our pages - not a subpage allocation */
-		spinlock_release(&kmalloc_spinlock);
 		return -1;
 	}
 
@@ -578,12 +677,26 @@ subpage_kfree(void *ptr)
 		/* Whole page is free. */
 		remove_lists(pr, blktype);
 		freepageref(pr);
-		/* Call free_kpages without kmalloc_spinlock. */
-		spinlock_release(&kmalloc_spinlock);
-		free_kpages(prpage);
+		*freepage = prpage;
 	}
-	else {
-		spinlock_release(&kmalloc_spinlock);
+
+	return 0;
+}
+
+static
+int
+subpage_kfree(void *ptr)
+{
+	vaddr_t freepage;
+	int result;
+
+	spinlock_acquire(&kmalloc_spinlock);
+	result = subpage_put(ptr, &freepage);
+	spinlock_release(&kmalloc_spinlock);
+
+	/* Call free_kpages without kmalloc_spinlock. */
+	if (freepage != 0) {
+		free_kpages(freepage);
 	}
 
 #ifdef SLOWER /* Don't get the lock unless checksubpages does something. */
@@ -592,7 +705,189 @@ subpage_kfree(void *ptr)
 	spinlock_release(&kmalloc_spinlock);
 #endif
 
-	return 0;
+	return result;
+}
+
+////////////////////////////////////////
+//
+// Per-cpu magazines.
+//
+
+/*
+ * The block type of the subpage block at PTRADDR, or -1 if it isn't
+ * one, without kmalloc_spinlock. The caller owns the block, so its
+ * page can't be freed or change hands while we look; other pagerefs
+ * may be changing, but none of them can hold this page address. The
+ * hint remembers which pageref each recently freed page had.
+ */
+
+#define KMAG_NHINT 64
+static unsigned kmag_hint[KMAG_NHINT];
+
+static
+int
+subpage_blocktype(vaddr_t ptraddr)
+{
+	vaddr_t page, pab;
+	unsigned h, i;
+
+	page = ptraddr & PAGE_FRAME;
+	h = (page / PAGE_SIZE) % KMAG_NHINT;
+
+	i = kmag_hint[h];
+	pab = pagerefs[i].pageaddr_and_blocktype;
+	if ((pab & PAGE_FRAME) != page) {
+		for (i=0; i<NPAGEREFS; i++) {
+			pab = pagerefs[i].pageaddr_and_blocktype;
+			if ((pab & PAGE_FRAME) == page) {
+				break;
+			}
+		}
+		if (i == NPAGEREFS) {
+			return -1;
+		}
+		kmag_hint[h] = i;
+	}
+	return pab & ~PAGE_FRAME;
+}
+
+/*
+ * Give the N oldest blocks of KM back to their pages.
+ */
+static
+void
+kmag_drain(struct kmag *km, unsigned n)
+{
+	vaddr_t freepages[KMAG_ROUNDS];
+	unsigned i, nfreepages = 0;
+	int result;
+
+	KASSERT(n <= km->km_count);
+
+	spinlock_acquire(&kmalloc_spinlock);
+	for (i=0; i<n; i++) {
+		result = subpage_put(km->km_rounds[i], &freepages[nfreepages]);
+		KASSERT(result == 0);
+		if (freepages[nfreepages] != 0) {
+			nfreepages++;
+		}
+	}
+	spinlock_release(&kmalloc_spinlock);
+
+	km->km_count -= n;
+	memmove(&km->km_rounds[0], &km->km_rounds[n],
+		km->km_count * sizeof(km->km_rounds[0]));
+
+	for (i=0; i<nfreepages; i++) {
+		free_kpages(freepages[i]);
+	}
+}
+
+/*
+ * Empty all of this cpu's magazines. Returns false if they were empty
+ * already.
+ */
+static
+bool
+kmag_flush(void)
+{
+	struct kmag_cpu *kc;
+	unsigned blktype;
+	bool any = false;
+	int spl;
+
+	if (!KMAG_USABLE()) {
+		return false;
+	}
+
+	spl = splhigh();
+	kc = &kmag_cpus[curcpu->c_number];
+	for (blktype=0; blktype<NSIZES; blktype++) {
+		if (kc->kc_mags[blktype].km_count > 0) {
+			kmag_drain(&kc->kc_mags[blktype],
+				   kc->kc_mags[blktype].km_count);
+			any = true;
+		}
+	}
+	splx(spl);
+	return any;
+}
+
+static
+void *
+kmag_alloc(size_t sz)
+{
+	struct kmag_cpu *kc;
+	struct kmag *km;
+	unsigned blktype;
+	void *ptr;
+	int spl;
+
+	if (!KMAG_USABLE()) {
+		return subpage_kmalloc(sz);
+	}
+	blktype = blocktype(sz);
+
+	spl = splhigh();
+	kc = &kmag_cpus[curcpu->c_number];
+	km = &kc->kc_mags[blktype];
+	if (km->km_count > 0) {
+		kc->kc_allochits++;
+	}
+	else {
+		kc->kc_allocmisses++;
+		spinlock_acquire(&kmalloc_spinlock);
+		while (km->km_count < KMAG_BATCH(blktype)) {
+			ptr = subpage_take(blktype);
+			if (ptr == NULL) {
+				break;
+			}
+			km->km_rounds[km->km_count++] = ptr;
+		}
+		spinlock_release(&kmalloc_spinlock);
+		if (km->km_count == 0) {
+			/* Needs a new page */
+			splx(spl);
+			return subpage_kmalloc(sz);
+		}
+	}
+	ptr = km->km_rounds[--km->km_count];
+	splx(spl);
+	return ptr;
+}
+
+static
+void
+kmag_free(void *ptr, int blktype)
+{
+	struct kmag_cpu *kc;
+	struct kmag *km;
+	vaddr_t offset;
+	int spl;
+
+	if (!KMAG_USABLE()) {
+		subpage_kfree(ptr);
+		return;
+	}
+
+	offset = (vaddr_t)ptr & ~PAGE_FRAME;
+	if (offset % sizes[blktype] != 0) {
+		panic("kfree: subpage free of invalid addr %p\n", ptr);
+	}
+	fill_deadbeef(ptr, sizes[blktype]);
+
+	spl = splhigh();
+	kc = &kmag_cpus[curcpu->c_number];
+	km = &kc->kc_mags[blktype];
+	if (km->km_count < KMAG_CAP(blktype)) {
+		kc->kc_freehits++;
+	}
+	else {
+		kc->kc_freemisses++;
+		kmag_drain(km, KMAG_BATCH(blktype));
+	}
+	km->km_rounds[km->km_count++] = ptr;
+	splx(spl);
 }
 
 //
@@ -607,7 +902,12 @@ kmalloc(size_t sz)
 
 		/* Round up to a whole number of pages. */
 		npages = (sz + PAGE_SIZE - 1)/PAGE_SIZE;
-		address = alloc_kpages(npages);
+
+		/* Map more than a page into kseg2, contiguous if we can't */
+		address = npages > 1 ? kvm_alloc(npages) : 0;
+		if (address==0) {
+			address = alloc_kpages(npages);
+		}
 		if (address==0) {
 			return NULL;
 		}
@@ -615,20 +915,29 @@ kmalloc(size_t sz)
 		return (void *)address;
 	}
 
-	return subpage_kmalloc(sz);
+	return kmag_alloc(sz);
 }
 
 void
 kfree(void *ptr)
 {
+	int blktype;
+
 	/*
 	 * Try subpage first; if that fails, assume it's a big allocation.
 	 */
 	if (ptr == NULL) {
 		return;
-	} else if (subpage_kfree(ptr)) {
+	} else if (kvm_free((vaddr_t)ptr)) {
+		/* It was mapped in kseg2 */
+		return;
+	}
+
+	blktype = subpage_blocktype((vaddr_t)ptr);
+	if (blktype >= 0) {
+		kmag_free(ptr, blktype);
+	} else {
 		KASSERT((vaddr_t)ptr%PAGE_SIZE==0);
 		free_kpages((vaddr_t)ptr);
 	}
 }
-
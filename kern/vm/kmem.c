@@ -0,0 +1,239 @@
+/*
+ * kmem.c
+ *
+ *  Object caches. Each cache keeps a stack of free objects that are
+ *  still constructed, so allocating one is a pop and skips both kmalloc
+ *  and the constructor. Objects beyond what the stack holds, and all
+ *  of them when memory runs short (kmem_cache_reap), are destructed
+ *  and go back to kmalloc. The stack is a separate array so that free
+ *  objects are left untouched.
+ */
+
+#include <types.h>
+#include <lib.h>
+#include <spinlock.h>
+#include <kmem.h>
+
+/* Free objects kept per cache: about this many bytes, within limits */
+#define KMEM_CACHE_BYTES	8192
+#define KMEM_CACHE_MIN		2
+#define KMEM_CACHE_MAX		32
+
+struct kmem_cache {
+	const char *kc_name;
+	size_t kc_size;
+	int (*kc_ctor)(void *obj);
+	void (*kc_dtor)(void *obj);
+	struct spinlock kc_lock;	/* the fields below */
+	void **kc_free;			/* constructed, not in use */
+	unsigned kc_nfree;
+	unsigned kc_maxfree;
+	/* Statistics */
+	unsigned kc_inuse;
+	unsigned kc_allocs;
+	unsigned kc_hits;		/* allocs served from kc_free */
+	unsigned kc_constructed;
+	unsigned kc_destroyed;
+	unsigned kc_failed;		/* kmalloc or the constructor failed */
+	struct kmem_cache *kc_next;
+};
+
+/* The list of caches */
+static struct spinlock kmem_lock = SPINLOCK_INITIALIZER;
+static struct kmem_cache *kmem_caches = NULL;
+
+struct kmem_cache *
+kmem_cache_create(const char *name, size_t size, int (*ctor)(void *obj),
+		  void (*dtor)(void *obj))
+{
+	struct kmem_cache *kc;
+	unsigned maxfree;
+
+	maxfree = KMEM_CACHE_BYTES / size;
+	if (maxfree < KMEM_CACHE_MIN) {
+		maxfree = KMEM_CACHE_MIN;
+	}
+	if (maxfree > KMEM_CACHE_MAX) {
+		maxfree = KMEM_CACHE_MAX;
+	}
+
+	kc = kmalloc(sizeof(struct kmem_cache));
+	if (kc == NULL) {
+		return NULL;
+	}
+	kc->kc_free = kmalloc(maxfree * sizeof(void *));
+	if (kc->kc_free == NULL) {
+		kfree(kc);
+		return NULL;
+	}
+	kc->kc_name = name;
+	kc->kc_size = size;
+	kc->kc_ctor = ctor;
+	kc->kc_dtor = dtor;
+	spinlock_init(&kc->kc_lock);
+	kc->kc_nfree = 0;
+	kc->kc_maxfree = maxfree;
+	kc->kc_inuse = 0;
+	kc->kc_allocs = 0;
+	kc->kc_hits = 0;
+	kc->kc_constructed = 0;
+	kc->kc_destroyed = 0;
+	kc->kc_failed = 0;
+
+	spinlock_acquire(&kmem_lock);
+	kc->kc_next = kmem_caches;
+	kmem_caches = kc;
+	spinlock_release(&kmem_lock);
+	return kc;
+}
+
+/* Destruct and free OBJ, which is no longer counted anywhere */
+static void
+kmem_cache_release(struct kmem_cache *kc, void *obj)
+{
+	if (kc->kc_dtor != NULL) {
+		kc->kc_dtor(obj);
+	}
+	kfree(obj);
+
+	spinlock_acquire(&kc->kc_lock);
+	kc->kc_destroyed++;
+	spinlock_release(&kc->kc_lock);
+}
+
+/*
+ * Destroy the free objects of KC. Returns whether there were any.
+ */
+static bool
+kmem_cache_drain(struct kmem_cache *kc)
+{
+	void *obj;
+	bool any = false;
+
+	while (true) {
+		spinlock_acquire(&kc->kc_lock);
+		if (kc->kc_nfree == 0) {
+			spinlock_release(&kc->kc_lock);
+			break;
+		}
+		obj = kc->kc_free[--kc->kc_nfree];
+		spinlock_release(&kc->kc_lock);
+
+		kmem_cache_release(kc, obj);
+		any = true;
+	}
+	return any;
+}
+
+void
+kmem_cache_destroy(struct kmem_cache *kc)
+{
+	struct kmem_cache **kcp;
+
+	spinlock_acquire(&kmem_lock);
+	for (kcp = &kmem_caches; *kcp != kc; kcp = &(*kcp)->kc_next) {
+		KASSERT(*kcp != NULL);
+	}
+	*kcp = kc->kc_next;
+	spinlock_release(&kmem_lock);
+
+	KASSERT(kc->kc_inuse == 0);
+	kmem_cache_drain(kc);
+	spinlock_cleanup(&kc->kc_lock);
+	kfree(kc->kc_free);
+	kfree(kc);
+}
+
+void *
+kmem_cache_alloc(struct kmem_cache *kc)
+{
+	void *obj;
+
+	spinlock_acquire(&kc->kc_lock);
+	kc->kc_allocs++;
+	if (kc->kc_nfree > 0) {
+		obj = kc->kc_free[--kc->kc_nfree];
+		kc->kc_hits++;
+		kc->kc_inuse++;
+		spinlock_release(&kc->kc_lock);
+		return obj;
+	}
+	spinlock_release(&kc->kc_lock);
+
+	obj = kmalloc(kc->kc_size);
+	if (obj != NULL && kc->kc_ctor != NULL && kc->kc_ctor(obj) != 0) {
+		kfree(obj);
+		obj = NULL;
+	}
+
+	spinlock_acquire(&kc->kc_lock);
+	if (obj == NULL) {
+		kc->kc_failed++;
+	}
+	else {
+		kc->kc_constructed++;
+		kc->kc_inuse++;
+	}
+	spinlock_release(&kc->kc_lock);
+	return obj;
+}
+
+void
+kmem_cache_free(struct kmem_cache *kc, void *obj)
+{
+	if (obj == NULL) {
+		return;
+	}
+
+	spinlock_acquire(&kc->kc_lock);
+	KASSERT(kc->kc_inuse > 0);
+	kc->kc_inuse--;
+	if (kc->kc_nfree < kc->kc_maxfree) {
+		kc->kc_free[kc->kc_nfree++] = obj;
+		spinlock_release(&kc->kc_lock);
+		return;
+	}
+	spinlock_release(&kc->kc_lock);
+
+	kmem_cache_release(kc, obj);
+}
+
+/*
+ * Called when memory is short. kmem_lock keeps the caches from being
+ * destroyed under us, so the destructors run with it held.
+ */
+bool
+kmem_cache_reap(void)
+{
+	struct kmem_cache *kc;
+	bool any = false;
+
+	spinlock_acquire(&kmem_lock);
+	for (kc = kmem_caches; kc != NULL; kc = kc->kc_next) {
+		if (kmem_cache_drain(kc)) {
+			any = true;
+		}
+	}
+	spinlock_release(&kmem_lock);
+	return any;
+}
+
+void
+kmem_cache_printstats(void)
+{
+	struct kmem_cache *kc;
+
+	spinlock_acquire(&kmem_lock);
+	kprintf("Object caches:\n");
+	for (kc = kmem_caches; kc != NULL; kc = kc->kc_next) {
+		spinlock_acquire(&kc->kc_lock);
+		kprintf("%-16s %5u bytes: %u in use, %u/%u free; %u allocs, "
+			"%u hits, %u constructed, %u destroyed, %u failed\n",
+			kc->kc_name, (unsigned)kc->kc_size, kc->kc_inuse,
+			kc->kc_nfree, kc->kc_maxfree, kc->kc_allocs,
+			kc->kc_hits, kc->kc_constructed, kc->kc_destroyed,
+			kc->kc_failed);
+		spinlock_release(&kc->kc_lock);
+	}
+	spinlock_release(&kmem_lock);
+}
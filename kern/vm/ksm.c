@@ -0,0 +1,316 @@
+/*
+ * ksm.c
+ *
+ *  Same-page merging. A kernel thread walks the coremap a few pages
+ *  at a time, hashing the private pages of user processes (data, BSS,
+ *  heap, stack, private mappings). A page that is all zeros is
+ *  replaced by the zero page. Otherwise it is compared against the
+ *  shared copies made so far (the stable table) and against the pages
+ *  hashed earlier in this pass (the unstable table); on an exact match
+ *  both end up mapping one frame copy-on-write, and the first write
+ *  to either gets its own copy back as usual.
+ *
+ *  Shared copies have no owner and are never evicted or written in
+ *  place while in the stable table. A copy leaves the table when it
+ *  is freed or down to one user, who then owns it again.
+ *  The stable table is protected by phymem_lock; the unstable one
+ *  belongs to the scanner thread.
+ */
+
+#include <types.h>
+#include <kern/errno.h>
+#include <lib.h>
+#include <spinlock.h>
+#include <wchan.h>
+#include <thread.h>
+#include <clock.h>
+#include <vm.h>
+#include <mips/vm.h>
+
+#define KSM_DEFAULT_RATE	128	/* pages scanned per second */
+#define KSM_MAX_RATE		4096
+#define KSM_NSTABLE		256	/* buckets */
+#define KSM_NUNSTABLE		256
+
+/* A page hashed earlier in the pass, waiting for a twin */
+struct ksm_candidate {
+	uint32_t kc_hash;
+	int kc_index;			/* -1 if the slot is empty */
+	struct pg_table_entry *kc_pte;	/* its owner when it was hashed */
+};
+
+static bool ksm_enabled = false;
+static unsigned ksm_rate = KSM_DEFAULT_RATE;
+static struct wchan *ksm_wchan;
+static int ksm_stable[KSM_NSTABLE];	/* chains through cm_ksmnext */
+static struct ksm_candidate ksm_unstable[KSM_NUNSTABLE];
+static uint32_t ksm_zerohash;
+
+/* Statistics */
+static unsigned ksm_shared = 0;		/* frames in the stable table */
+static unsigned ksm_passes = 0;
+static unsigned ksm_scanned = 0;
+static unsigned ksm_merged = 0;		/* pages replaced by a shared copy */
+static unsigned ksm_zeroed = 0;		/* ...by the zero page */
+
+/* FNV-1a over the page's words */
+static uint32_t
+ksm_hashpage(int index)
+{
+	const uint32_t *p;
+	uint32_t h = 2166136261U;
+	unsigned i;
+
+	p = (const uint32_t *)PADDR_TO_KVADDR(coremap[index].ppage);
+	for (i = 0; i < PAGE_SIZE / sizeof(uint32_t); i++) {
+		h = (h ^ p[i]) * 16777619U;
+	}
+	return h;
+}
+
+static bool
+ksm_samepage(int a, int b)
+{
+	const uint32_t *pa, *pb;
+	unsigned i;
+
+	pa = (const uint32_t *)PADDR_TO_KVADDR(coremap[a].ppage);
+	pb = (const uint32_t *)PADDR_TO_KVADDR(coremap[b].ppage);
+	for (i = 0; i < PAGE_SIZE / sizeof(uint32_t); i++) {
+		if (pa[i] != pb[i]) {
+			return false;
+		}
+	}
+	return true;
+}
+
+static bool
+ksm_zeropage(int index)
+{
+	const uint32_t *p;
+	unsigned i;
+
+	p = (const uint32_t *)PADDR_TO_KVADDR(coremap[index].ppage);
+	for (i = 0; i < PAGE_SIZE / sizeof(uint32_t); i++) {
+		if (p[i] != 0) {
+			return false;
+		}
+	}
+	return true;
+}
+
+/*
+ * The frame at INDEX has just become a shared copy with contents
+ * hashing to HASH. Called with phymem_lock held.
+ */
+void
+ksm_enter(int index, uint32_t hash)
+{
+	unsigned b = hash % KSM_NSTABLE;
+
+	KASSERT(spinlock_do_i_hold(&phymem_lock));
+	KASSERT(!coremap[index].cm_merged);
+	coremap[index].cm_merged = true;
+	coremap[index].cm_hash = hash;
+	coremap[index].cm_ksmnext = ksm_stable[b];
+	ksm_stable[b] = index;
+	ksm_shared++;
+}
+
+/*
+ * The frame at INDEX is being freed or written; no-op if it isn't a
+ * shared copy. Called with phymem_lock held.
+ */
+void
+ksm_forget(int index)
+{
+	int *pp;
+
+	KASSERT(spinlock_do_i_hold(&phymem_lock));
+	if (!coremap[index].cm_merged) {
+		return;
+	}
+	pp = &ksm_stable[coremap[index].cm_hash % KSM_NSTABLE];
+	while (*pp != index) {
+		KASSERT(*pp >= 0);
+		pp = &coremap[*pp].cm_ksmnext;
+	}
+	*pp = coremap[index].cm_ksmnext;
+	coremap[index].cm_ksmnext = -1;
+	coremap[index].cm_merged = false;
+	ksm_shared--;
+}
+
+/*
+ * A shared copy whose contents hash to HASH, with a reference taken on
+ * it so it stays one, or -1.
+ */
+static int
+ksm_lookup(uint32_t hash)
+{
+	int index;
+
+	spinlock_acquire(&phymem_lock);
+	for (index = ksm_stable[hash % KSM_NSTABLE]; index >= 0;
+	     index = coremap[index].cm_ksmnext) {
+		if (coremap[index].cm_hash == hash) {
+			coremap[index].refcount++;
+			break;
+		}
+	}
+	spinlock_release(&phymem_lock);
+	return index;
+}
+
+static void
+ksm_scan(int index)
+{
+	struct ksm_candidate *kc;
+	uint32_t hash;
+	int target;
+
+	if (!vm_merge_grab(index)) {
+		return;
+	}
+	ksm_scanned++;
+	hash = ksm_hashpage(index);
+
+	if (hash == ksm_zerohash && ksm_zeropage(index)) {
+		vm_merge_zero(index);
+		ksm_zeroed++;
+		return;
+	}
+
+	target = ksm_lookup(hash);
+	if (target >= 0) {
+		if (ksm_samepage(index, target)) {
+			vm_merge(index, target, hash);
+			ksm_merged++;
+			return;
+		}
+		free_coremap(coremap[target].ppage);
+	}
+
+	kc = &ksm_unstable[hash % KSM_NUNSTABLE];
+	if (kc->kc_index >= 0 && kc->kc_index != index &&
+	    kc->kc_hash == hash && vm_merge_grab(kc->kc_index)) {
+		/* The frame may have changed hands since it was hashed */
+		if (coremap[kc->kc_index].pte == kc->kc_pte &&
+		    ksm_samepage(index, kc->kc_index)) {
+			vm_merge(index, kc->kc_index, hash);
+			kc->kc_index = -1;
+			ksm_merged++;
+			return;
+		}
+		vm_merge_release(kc->kc_index);
+	}
+
+	kc->kc_hash = hash;
+	kc->kc_index = index;
+	kc->kc_pte = coremap[index].pte;
+	vm_merge_release(index);
+}
+
+static void
+ksm_thread(void *data1, unsigned long data2)
+{
+	unsigned i, j;
+	int index = 0;
+
+	(void)data1;
+	(void)data2;
+
+	while (true) {
+		wchan_lock(ksm_wchan);
+		if (!ksm_enabled) {
+			wchan_sleep(ksm_wchan);
+			continue;
+		}
+		wchan_unlock(ksm_wchan);
+
+		for (i = 0; i < ksm_rate; i++) {
+			ksm_scan(index);
+			index = (index + 1) % ppages;
+			if (index == 0) {
+				/* Pages hashed last pass may have changed */
+				for (j = 0; j < KSM_NUNSTABLE; j++) {
+					ksm_unstable[j].kc_index = -1;
+				}
+				ksm_passes++;
+				break;
+			}
+		}
+		clocksleep(1);
+	}
+}
+
+void
+ksm_bootstrap(void)
+{
+	unsigned i;
+	uint32_t h = 2166136261U;
+	int result;
+
+	for (i = 0; i < KSM_NSTABLE; i++) {
+		ksm_stable[i] = -1;
+	}
+	for (i = 0; i < KSM_NUNSTABLE; i++) {
+		ksm_unstable[i].kc_index = -1;
+	}
+	for (i = 0; i < PAGE_SIZE / sizeof(uint32_t); i++) {
+		h *= 16777619U;
+	}
+	ksm_zerohash = h;
+
+	ksm_wchan = wchan_create("ksm");
+	if (ksm_wchan == NULL) {
+		panic("ksm: could not create wait channel\n");
+	}
+	result = thread_fork("ksm", ksm_thread, NULL, 0, NULL);
+	if (result) {
+		panic("ksm: thread_fork failed: %s\n", strerror(result));
+	}
+}
+
+/*
+ * Start or stop the scanner, and set how many frames it looks at per
+ * second if RATE isn't 0.
+ */
+int
+ksm_setenabled(bool on, unsigned rate)
+{
+	if (rate > KSM_MAX_RATE) {
+		return EINVAL;
+	}
+	if (rate != 0) {
+		ksm_rate = rate;
+	}
+	wchan_lock(ksm_wchan);
+	ksm_enabled = on;
+	wchan_unlock(ksm_wchan);
+	if (on) {
+		wchan_wakeone(ksm_wchan);
+	}
+	return 0;
+}
+
+void
+ksm_printstats(void)
+{
+	unsigned b, saved = 0;
+	int index;
+
+	spinlock_acquire(&phymem_lock);
+	for (b = 0; b < KSM_NSTABLE; b++) {
+		for (index = ksm_stable[b]; index >= 0;
+		     index = coremap[index].cm_ksmnext) {
+			saved += coremap[index].refcount - 1;
+		}
+	}
+	kprintf("Page merging: %s, %u pages/s, %u passes; %u shared frames "
+		"saving %u frames\n", ksm_enabled ? "on" : "off", ksm_rate,
+		ksm_passes, ksm_shared, saved);
+	kprintf("      %u pages scanned, %u merged, %u replaced by the "
+		"zero page\n", ksm_scanned, ksm_merged, ksm_zeroed);
+	spinlock_release(&phymem_lock);
+}
@@ -0,0 +1,317 @@
+/*
+ * kvm.c
+ *
+ *  Large kernel allocations mapped page by page into kseg2, so they
+ *  don't need physically contiguous RAM. kmalloc sends requests of
+ *  more than a page here first. Each page of the window has an entry in
+ *  kvm_pt, and kernel TLB misses in the window are filled from it by
+ *  kvm_fault with global entries, valid under every ASID. A page with
+ *  no frame (the guard page after each area, or a freed one) faults
+ *  with EFAULT, which panics.
+ *
+ *  Freed addresses aren't handed out again right away, as other CPUs
+ *  may still have their pages in the TLB. They stay stale until an
+ *  allocation finds no room or too many pile up; then every CPU drops
+ *  its kseg2 entries and the stale pages are free again.
+ */
+
+#include <types.h>
+#include <kern/errno.h>
+#include <lib.h>
+#include <spinlock.h>
+#include <bitmap.h>
+#include <vm.h>
+#include <mips/vm.h>
+
+#define KVM_BASE	MIPS_KSEG2
+#define KVM_PAGES	4096			/* 16M of address space */
+#define KVM_STALE_MAX	(KVM_PAGES / 4)		/* purge beyond this */
+
+#define KVM_INWINDOW(va) \
+	((va) >= KVM_BASE && (va) < KVM_BASE + KVM_PAGES * PAGE_SIZE)
+
+struct kvm_area {
+	vaddr_t ka_start;
+	unsigned ka_npages;		/* not counting the guard page */
+	struct kvm_area *ka_next;
+};
+
+/* Everything below; a leaf lock but for tlb_lock in kvm_fault */
+static struct spinlock kvm_lock = SPINLOCK_INITIALIZER;
+static paddr_t *kvm_pt;			/* frame of each page, or 0 */
+static struct bitmap *kvm_used;		/* allocated, guard or stale */
+static struct bitmap *kvm_stale;	/* freed, may still be in a TLB */
+static struct bitmap *kvm_purging;	/* stale, being flushed */
+static struct kvm_area *kvm_areas;
+static unsigned kvm_nstale = 0;
+
+/* Statistics */
+static unsigned kvm_nareas = 0;
+static unsigned kvm_mapped = 0;		/* pages with a frame */
+static unsigned kvm_allocs = 0;
+static unsigned kvm_failed = 0;		/* no address space left */
+static unsigned kvm_purges = 0;
+static unsigned kvm_faults = 0;
+
+void
+kvm_bootstrap(void)
+{
+	paddr_t *pt;
+
+	/* Too early for this to come from kvm_alloc itself */
+	pt = kmalloc(KVM_PAGES * sizeof(paddr_t));
+	kvm_used = bitmap_create(KVM_PAGES);
+	kvm_stale = bitmap_create(KVM_PAGES);
+	kvm_purging = bitmap_create(KVM_PAGES);
+	if (pt == NULL || kvm_used == NULL || kvm_stale == NULL ||
+	    kvm_purging == NULL) {
+		panic("kvm_bootstrap: out of memory\n");
+	}
+	bzero(pt, KVM_PAGES * sizeof(paddr_t));
+
+	spinlock_acquire(&kvm_lock);
+	kvm_pt = pt;
+	spinlock_release(&kvm_lock);
+}
+
+/*
+ * Find and mark NPAGES free pages of the window, first fit.
+ */
+static bool
+kvm_reserve(unsigned npages, unsigned *ret)
+{
+	unsigned i, run = 0;
+
+	spinlock_acquire(&kvm_lock);
+	for (i = 0; i < KVM_PAGES; i++) {
+		if (bitmap_isset(kvm_used, i)) {
+			run = 0;
+			continue;
+		}
+		if (++run == npages) {
+			break;
+		}
+	}
+	if (i == KVM_PAGES) {
+		spinlock_release(&kvm_lock);
+		return false;
+	}
+	*ret = i + 1 - npages;
+	for (i = *ret; i < *ret + npages; i++) {
+		bitmap_mark(kvm_used, i);
+	}
+	spinlock_release(&kvm_lock);
+	return true;
+}
+
+/*
+ * Free the frames of the NPAGES pages from FIRST. Their addresses stay
+ * marked used.
+ */
+static void
+kvm_unmap(unsigned first, unsigned npages)
+{
+	unsigned i;
+	paddr_t pa;
+
+	for (i = first; i < first + npages; i++) {
+		spinlock_acquire(&kvm_lock);
+		pa = kvm_pt[i];
+		kvm_pt[i] = 0;
+		spinlock_release(&kvm_lock);
+		if (pa != 0) {
+			free_kpages(PADDR_TO_KVADDR(pa));
+		}
+	}
+}
+
+/*
+ * Make the stale pages free again, once no TLB can hold them. Pages
+ * go stale with their frame already gone, so they can't be faulted
+ * back in; one flush per CPU after they are set aside is enough, and
+ * a purge running alongside us can release them too. False if we may
+ * not wait for the other CPUs here.
+ */
+static bool
+kvm_purge(void)
+{
+	unsigned i;
+
+	if (!vm_can_sleep()) {
+		return false;
+	}
+
+	spinlock_acquire(&kvm_lock);
+	for (i = 0; i < KVM_PAGES; i++) {
+		if (bitmap_isset(kvm_stale, i)) {
+			bitmap_unmark(kvm_stale, i);
+			bitmap_mark(kvm_purging, i);
+		}
+	}
+	kvm_nstale = 0;
+	spinlock_release(&kvm_lock);
+
+	vm_tlbflush_kernel();
+
+	spinlock_acquire(&kvm_lock);
+	for (i = 0; i < KVM_PAGES; i++) {
+		if (bitmap_isset(kvm_purging, i)) {
+			bitmap_unmark(kvm_purging, i);
+			bitmap_unmark(kvm_used, i);
+		}
+	}
+	kvm_purges++;
+	spinlock_release(&kvm_lock);
+	return true;
+}
+
+/*
+ * Map NPAGES fresh frames at a kseg2 address. Returns 0 before
+ * kvm_bootstrap, or if there are no frames or no address space left;
+ * kmalloc then falls back to contiguous pages.
+ */
+vaddr_t
+kvm_alloc(unsigned npages)
+{
+	struct kvm_area *ka;
+	unsigned first, i;
+	vaddr_t kva;
+	bool purge;
+
+	if (kvm_pt == NULL || npages == 0 || npages >= KVM_PAGES) {
+		return 0;
+	}
+	ka = kmalloc(sizeof(struct kvm_area));
+	if (ka == NULL) {
+		return 0;
+	}
+
+	spinlock_acquire(&kvm_lock);
+	purge = kvm_nstale > KVM_STALE_MAX;
+	spinlock_release(&kvm_lock);
+	if (purge) {
+		kvm_purge();
+	}
+
+	/* One more for the guard page */
+	if (!kvm_reserve(npages + 1, &first) &&
+	    (!kvm_purge() || !kvm_reserve(npages + 1, &first))) {
+		spinlock_acquire(&kvm_lock);
+		kvm_failed++;
+		spinlock_release(&kvm_lock);
+		kfree(ka);
+		return 0;
+	}
+
+	for (i = 0; i < npages; i++) {
+		kva = alloc_kpages(1);
+		if (kva == 0) {
+			/* Never handed out, so never in a TLB */
+			kvm_unmap(first, i);
+			spinlock_acquire(&kvm_lock);
+			for (i = first; i < first + npages + 1; i++) {
+				bitmap_unmark(kvm_used, i);
+			}
+			spinlock_release(&kvm_lock);
+			kfree(ka);
+			return 0;
+		}
+		spinlock_acquire(&kvm_lock);
+		kvm_pt[first + i] = kva - MIPS_KSEG0;
+		spinlock_release(&kvm_lock);
+	}
+
+	ka->ka_start = KVM_BASE + first * PAGE_SIZE;
+	ka->ka_npages = npages;
+	spinlock_acquire(&kvm_lock);
+	ka->ka_next = kvm_areas;
+	kvm_areas = ka;
+	kvm_nareas++;
+	kvm_mapped += npages;
+	kvm_allocs++;
+	spinlock_release(&kvm_lock);
+	return ka->ka_start;
+}
+
+/*
+ * Free the area kvm_alloc handed back at ADDR. False if ADDR isn't in
+ * the window at all, so kfree can try elsewhere.
+ */
+bool
+kvm_free(vaddr_t addr)
+{
+	struct kvm_area *ka, **kap;
+	unsigned first, i;
+
+	if (!KVM_INWINDOW(addr)) {
+		return false;
+	}
+
+	spinlock_acquire(&kvm_lock);
+	for (kap = &kvm_areas; *kap != NULL; kap = &(*kap)->ka_next) {
+		if ((*kap)->ka_start == addr) {
+			break;
+		}
+	}
+	if (*kap == NULL) {
+		panic("kvm_free: 0x%x was not allocated\n", addr);
+	}
+	ka = *kap;
+	*kap = ka->ka_next;
+	spinlock_release(&kvm_lock);
+
+	/* free_kpages takes phymem_lock, which nests outside kvm_lock */
+	first = (addr - KVM_BASE) / PAGE_SIZE;
+	kvm_unmap(first, ka->ka_npages);
+
+	spinlock_acquire(&kvm_lock);
+	for (i = first; i < first + ka->ka_npages + 1; i++) {
+		bitmap_mark(kvm_stale, i);
+	}
+	kvm_nstale += ka->ka_npages + 1;
+	kvm_nareas--;
+	kvm_mapped -= ka->ka_npages;
+	spinlock_release(&kvm_lock);
+
+	kfree(ka);
+	return true;
+}
+
+/*
+ * TLB miss on kernel address VADDR in kseg2. Called by vm_fault.
+ */
+int
+kvm_fault(int faulttype, vaddr_t vaddr)
+{
+	unsigned page;
+	paddr_t pa;
+
+	/* Everything is mapped writable */
+	if (faulttype == VM_FAULT_READONLY || !KVM_INWINDOW(vaddr)) {
+		return EFAULT;
+	}
+	page = (vaddr - KVM_BASE) / PAGE_SIZE;
+
+	/* Load it under the lock, so a purge can't miss the entry */
+	spinlock_acquire(&kvm_lock);
+	pa = kvm_pt == NULL ? 0 : kvm_pt[page];
+	if (pa == 0) {
+		spinlock_release(&kvm_lock);
+		return EFAULT;
+	}
+	vm_tlbload_kernel(vaddr & PAGE_FRAME, pa);
+	kvm_faults++;
+	spinlock_release(&kvm_lock);
+	return 0;
+}
+
+void
+kvm_printstats(void)
+{
+	spinlock_acquire(&kvm_lock);
+	kprintf("kseg2 mappings: %u areas, %u pages mapped, %u/%u pages "
+		"stale\n", kvm_nareas, kvm_mapped, kvm_nstale, KVM_PAGES);
+	kprintf("      %u allocated, %u out of space, %u purges, %u TLB "
+		"faults\n", kvm_allocs, kvm_failed, kvm_purges, kvm_faults);
+	spinlock_release(&kvm_lock);
+}
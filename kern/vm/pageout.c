@@ -0,0 +1,129 @@
+/*
+ * pageout.c
+ *
+ *  Pageout daemon. Allocations that leave fewer than pageout_low free
+ *  frames wake it up; it then evicts pages (writing dirty ones to swap)
+ *  until pageout_high frames are free again, so faulting threads seldom
+ *  have to wait for a page-out themselves.
+ */
+
+#include <types.h>
+#include <kern/errno.h>
+#include <lib.h>
+#include <spinlock.h>
+#include <wchan.h>
+#include <thread.h>
+#include <vm.h>
+#include <mips/vm.h>
+#include <swap.h>
+
+/* Defaults, as a fraction of RAM */
+#define PAGEOUT_LOW_FRACTION	32
+#define PAGEOUT_MIN_LOW		8
+
+static struct wchan *pageout_wchan = NULL;
+static unsigned pageout_low = 0;
+static unsigned pageout_high = 0;
+
+/* Statistics (only the daemon writes them) */
+static unsigned pageout_wakeups = 0;
+static unsigned pageout_pages = 0;
+static unsigned pageout_stalls = 0;	/* ran out of evictable pages */
+
+static void
+pageout_thread(void *data1, unsigned long data2)
+{
+	paddr_t frames[SWAP_CLUSTER_MAX];
+	unsigned i, n;
+	bool stalled = false;
+
+	(void)data1;
+	(void)data2;
+
+	while (true) {
+		/*
+		 * Holding the wchan lock across the check means a wakeup
+		 * can't slip in between it and going to sleep. After a
+		 * stall, wait for the next wakeup before trying again.
+		 */
+		wchan_lock(pageout_wchan);
+		if (stalled || vm_freepages() >= pageout_low) {
+			wchan_sleep(pageout_wchan);
+			stalled = false;
+		}
+		else {
+			wchan_unlock(pageout_wchan);
+		}
+
+		if (vm_freepages() >= pageout_low) {
+			continue;
+		}
+		pageout_wakeups++;
+		while (vm_freepages() < pageout_high) {
+			/* A cluster at a time, so dirty pages go out together */
+			n = swap_out_cluster(frames, pageout_high - vm_freepages());
+			if (n == 0) {
+				pageout_stalls++;
+				stalled = true;
+				break;
+			}
+			for (i = 0; i < n; i++) {
+				free_coremap(frames[i]);
+			}
+			pageout_pages += n;
+		}
+	}
+}
+
+void
+pageout_bootstrap(void)
+{
+	int result;
+
+	pageout_low = ppages / PAGEOUT_LOW_FRACTION;
+	if (pageout_low < PAGEOUT_MIN_LOW) {
+		pageout_low = PAGEOUT_MIN_LOW;
+	}
+	pageout_high = pageout_low * 2;
+
+	pageout_wchan = wchan_create("pageout");
+	if (pageout_wchan == NULL) {
+		panic("pageout: could not create wait channel\n");
+	}
+	result = thread_fork("pageout", pageout_thread, NULL, 0, NULL);
+	if (result) {
+		panic("pageout: thread_fork failed: %s\n", strerror(result));
+	}
+}
+
+/*
+ * Called after an allocation has left FREEPAGES frames free. Must not
+ * be called with phymem_lock held.
+ */
+void
+pageout_check(unsigned freepages)
+{
+	if (pageout_wchan != NULL && freepages < pageout_low) {
+		wchan_wakeone(pageout_wchan);
+	}
+}
+
+int
+pageout_setwatermarks(unsigned low, unsigned high)
+{
+	if (low == 0 || high <= low || high > (unsigned)ppages / 2) {
+		return EINVAL;
+	}
+	pageout_low = low;
+	pageout_high = high;
+	return 0;
+}
+
+void
+pageout_printstats(void)
+{
+	kprintf("Pageout: watermarks low %u high %u, %u pages free\n",
+		pageout_low, pageout_high, vm_freepages());
+	kprintf("Pageout: %u wakeups, %u pages evicted, %u stalls\n",
+		pageout_wakeups, pageout_pages, pageout_stalls);
+}
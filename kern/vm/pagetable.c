@@ -0,0 +1,259 @@
+/*
+ * pagetable.c
+ *
+ *  Two-level page table used by the address space code. Lookups,
+ *  inserts and removes are constant time; walks only visit the
+ *  second-level tables that actually have something in them.
+ *
+ *  Tables, second-level tables and PTEs come from object caches.
+ *  Tables are freed empty and second-level tables all NULL, which is
+ *  how their constructors make them, so reusing one costs nothing.
+ */
+
+#include <types.h>
+#include <lib.h>
+#include <kmem.h>
+#include <vm.h>
+
+static struct kmem_cache *pt_cache;
+static struct kmem_cache *pt_l2_cache;
+static struct kmem_cache *pte_cache;
+
+static int
+pt_ctor(void *obj)
+{
+	struct pagetable *pt = obj;
+	unsigned i;
+
+	for (i = 0; i < PT_L1_ENTRIES; i++) {
+		pt->pt_dir[i] = NULL;
+		pt->pt_used[i] = 0;
+	}
+	pt->pt_npages = 0;
+	return 0;
+}
+
+static int
+pt_l2_ctor(void *obj)
+{
+	struct pg_table_entry **l2 = obj;
+	unsigned j;
+
+	for (j = 0; j < PT_L2_ENTRIES; j++) {
+		l2[j] = NULL;
+	}
+	return 0;
+}
+
+void
+pt_bootstrap(void)
+{
+	pt_cache = kmem_cache_create("pagetable", sizeof(struct pagetable),
+				     pt_ctor, NULL);
+	pt_l2_cache = kmem_cache_create("pagetable L2", PT_L2_ENTRIES *
+					sizeof(struct pg_table_entry *),
+					pt_l2_ctor, NULL);
+	pte_cache = kmem_cache_create("pte", sizeof(struct pg_table_entry),
+				      NULL, NULL);
+	if (pt_cache == NULL || pt_l2_cache == NULL || pte_cache == NULL) {
+		panic("pt_bootstrap: out of memory\n");
+	}
+}
+
+struct pagetable *
+pt_create(void)
+{
+	return kmem_cache_alloc(pt_cache);
+}
+
+/*
+ * Free the table and every PTE still in it. The caller is responsible
+ * for whatever the PTEs were pointing at.
+ */
+void
+pt_destroy(struct pagetable *pt)
+{
+	unsigned i, j;
+
+	for (i = 0; i < PT_L1_ENTRIES; i++) {
+		if (pt->pt_dir[i] == NULL) {
+			continue;
+		}
+		for (j = 0; j < PT_L2_ENTRIES && pt->pt_used[i] > 0; j++) {
+			if (pt->pt_dir[i][j] != NULL) {
+				kmem_cache_free(pte_cache, pt->pt_dir[i][j]);
+				pt->pt_dir[i][j] = NULL;
+				pt->pt_used[i]--;
+			}
+		}
+		kmem_cache_free(pt_l2_cache, pt->pt_dir[i]);
+		pt->pt_dir[i] = NULL;
+	}
+	pt->pt_npages = 0;
+	kmem_cache_free(pt_cache, pt);
+}
+
+struct pg_table_entry *
+pt_lookup(struct pagetable *pt, vaddr_t vaddr)
+{
+	struct pg_table_entry **l2;
+
+	KASSERT(vaddr < USERSPACETOP);
+	l2 = pt->pt_dir[PT_L1_INDEX(vaddr)];
+	if (l2 == NULL) {
+		return NULL;
+	}
+	return l2[PT_L2_INDEX(vaddr)];
+}
+
+/*
+ * Return the PTE for VADDR, creating an unallocated one if the page
+ * has not been defined yet. Returns NULL if out of memory.
+ */
+struct pg_table_entry *
+pt_insert(struct pagetable *pt, vaddr_t vaddr)
+{
+	struct pg_table_entry **l2;
+	struct pg_table_entry *pte;
+	unsigned l1_index;
+
+	KASSERT(vaddr < USERSPACETOP);
+	vaddr &= PAGE_FRAME;
+	l1_index = PT_L1_INDEX(vaddr);
+
+	l2 = pt->pt_dir[l1_index];
+	if (l2 == NULL) {
+		l2 = kmem_cache_alloc(pt_l2_cache);
+		if (l2 == NULL) {
+			return NULL;
+		}
+		pt->pt_dir[l1_index] = l2;
+	}
+
+	pte = l2[PT_L2_INDEX(vaddr)];
+	if (pte != NULL) {
+		return pte;
+	}
+
+	pte = kmem_cache_alloc(pte_cache);
+	if (pte == NULL) {
+		if (pt->pt_used[l1_index] == 0) {
+			kmem_cache_free(pt_l2_cache, l2);
+			pt->pt_dir[l1_index] = NULL;
+		}
+		return NULL;
+	}
+	pte->ppage = 0;
+	pte->vpage = vaddr;
+	pte->state = PG_UNALOC;
+	pte->cow = false;
+	pte->swp_slot = false;
+	pte->swp_offset = 0;
+	pte->rmap_next = NULL;
+	pte->rmap_as = NULL;
+
+	l2[PT_L2_INDEX(vaddr)] = pte;
+	pt->pt_used[l1_index]++;
+	pt->pt_npages++;
+	return pte;
+}
+
+/*
+ * Drop the PTE for VADDR, if there is one, releasing the second-level
+ * table once it becomes empty.
+ */
+void
+pt_remove(struct pagetable *pt, vaddr_t vaddr)
+{
+	struct pg_table_entry **l2;
+	unsigned l1_index, l2_index;
+
+	KASSERT(vaddr < USERSPACETOP);
+	l1_index = PT_L1_INDEX(vaddr);
+	l2_index = PT_L2_INDEX(vaddr);
+
+	l2 = pt->pt_dir[l1_index];
+	if (l2 == NULL || l2[l2_index] == NULL) {
+		return;
+	}
+	kmem_cache_free(pte_cache, l2[l2_index]);
+	l2[l2_index] = NULL;
+	pt->pt_npages--;
+	if (--pt->pt_used[l1_index] == 0) {
+		kmem_cache_free(pt_l2_cache, l2);
+		pt->pt_dir[l1_index] = NULL;
+	}
+}
+
+/*
+ * Drop every PTE in [START, END), calling FUNC on each one first so the
+ * caller can let go of its page. Slices with no second-level table are
+ * skipped whole, and tables that end up empty are released.
+ */
+void
+pt_remove_range(struct pagetable *pt, vaddr_t start, vaddr_t end,
+		void (*func)(struct pg_table_entry *pte, void *data),
+		void *data)
+{
+	struct pg_table_entry **l2;
+	unsigned i, j, jend;
+	vaddr_t next;
+
+	KASSERT(end <= USERSPACETOP);
+	start &= PAGE_FRAME;
+	for (; start < end; start = next) {
+		i = PT_L1_INDEX(start);
+		next = PT_VADDR(i + 1, 0);
+		l2 = pt->pt_dir[i];
+		if (l2 == NULL) {
+			continue;
+		}
+
+		jend = next > end ? PT_L2_INDEX(end - 1) + 1 : PT_L2_ENTRIES;
+		for (j = PT_L2_INDEX(start);
+		     j < jend && pt->pt_used[i] > 0; j++) {
+			if (l2[j] == NULL) {
+				continue;
+			}
+			func(l2[j], data);
+			kmem_cache_free(pte_cache, l2[j]);
+			l2[j] = NULL;
+			pt->pt_npages--;
+			pt->pt_used[i]--;
+		}
+		if (pt->pt_used[i] == 0) {
+			kmem_cache_free(pt_l2_cache, l2);
+			pt->pt_dir[i] = NULL;
+		}
+	}
+}
+
+/*
+ * Call FUNC on every populated PTE in ascending address order. Stops
+ * and returns the first nonzero value FUNC returns.
+ */
+int
+pt_walk(struct pagetable *pt,
+	int (*func)(struct pg_table_entry *pte, void *data), void *data)
+{
+	unsigned i, j, seen;
+	int result;
+
+	for (i = 0; i < PT_L1_ENTRIES; i++) {
+		if (pt->pt_dir[i] == NULL) {
+			continue;
+		}
+		seen = 0;
+		for (j = 0; j < PT_L2_ENTRIES && seen < pt->pt_used[i]; j++) {
+			if (pt->pt_dir[i][j] == NULL) {
+				continue;
+			}
+			seen++;
+			result = func(pt->pt_dir[i][j], data);
+			if (result) {
+				return result;
+			}
+		}
+	}
+	return 0;
+}
@@ -0,0 +1,308 @@
+/*
+ * shm.c
+ *
+ *  Anonymous shared memory segments, System V style: shmget() finds or
+ *  makes a segment, shmat() attaches it as a region of the calling
+ *  address space, shmdt() takes it out again. Frames are allocated on
+ *  first touch by any attacher and stay with the segment until it has
+ *  been removed (IPC_RMID) and the last attacher is gone. Attached
+ *  regions are copied by fork, so children share the segment too.
+ */
+
+#include <types.h>
+#include <kern/errno.h>
+#include <kern/shm.h>
+#include <lib.h>
+#include <spinlock.h>
+#include <synch.h>
+#include <thread.h>
+#include <current.h>
+#include <addrspace.h>
+#include <vm.h>
+#include <mips/vm.h>
+#include <syscall.h>
+#include <shm.h>
+
+struct shm_segment {
+	int seg_key;			/* IPC_PRIVATE if it has none */
+	unsigned seg_npages;
+	paddr_t *seg_frames;		/* 0 until first touched */
+	unsigned seg_nattach;		/* regions attached to it */
+	bool seg_removed;		/* IPC_RMID: goes with the last detach */
+};
+
+/* The table, the attach counts and the frame arrays */
+static struct lock *shm_lock;
+static struct shm_segment *shm_segs[SHM_MAXSEGS];
+
+/* Statistics (under shm_lock) */
+static unsigned shm_nsegs = 0;
+static unsigned shm_resident = 0;	/* frames held by segments */
+
+void
+shm_bootstrap(void)
+{
+	shm_lock = lock_create("shm");
+	if (shm_lock == NULL) {
+		panic("shm_bootstrap: out of memory\n");
+	}
+}
+
+size_t
+shm_size(struct shm_segment *seg)
+{
+	return seg->seg_npages * PAGE_SIZE;
+}
+
+/*
+ * Free SEG and its frames. Whoever still maps a frame has its own
+ * reference to it, so only the segment's goes away here.
+ */
+static void
+shm_destroy(int id)
+{
+	struct shm_segment *seg = shm_segs[id];
+	unsigned i;
+
+	KASSERT(lock_do_i_hold(shm_lock));
+	KASSERT(seg->seg_nattach == 0);
+	for (i = 0; i < seg->seg_npages; i++) {
+		if (seg->seg_frames[i] != 0) {
+			free_coremap(seg->seg_frames[i]);
+			shm_resident--;
+		}
+	}
+	kfree(seg->seg_frames);
+	kfree(seg);
+	shm_segs[id] = NULL;
+	shm_nsegs--;
+}
+
+static int
+shm_lookup(struct shm_segment *seg)
+{
+	int id;
+
+	KASSERT(lock_do_i_hold(shm_lock));
+	for (id = 0; id < SHM_MAXSEGS; id++) {
+		if (shm_segs[id] == seg) {
+			return id;
+		}
+	}
+	panic("shm: segment %p not in the table\n", seg);
+	return -1;
+}
+
+/*
+ * The frame for page PAGENO of SEG, allocating a zeroed one if nobody
+ * has touched the page yet. The caller takes its own reference. May
+ * sleep; called by vm_fault without phymem_lock.
+ */
+int
+shm_getpage(struct shm_segment *seg, unsigned pageno, paddr_t *ret)
+{
+	paddr_t pa;
+
+	KASSERT(pageno < seg->seg_npages);
+
+	lock_acquire(shm_lock);
+	pa = seg->seg_frames[pageno];
+	if (pa == 0) {
+		/* No owner PTE: it isn't any one process's to evict */
+		pa = alloc_upage(NULL, NULL);
+		if (pa == 0) {
+			lock_release(shm_lock);
+			return ENOMEM;
+		}
+		spinlock_acquire(&phymem_lock);
+		coremap_unbusy(pa);
+		spinlock_release(&phymem_lock);
+		seg->seg_frames[pageno] = pa;
+		shm_resident++;
+	}
+	lock_release(shm_lock);
+
+	*ret = pa;
+	return 0;
+}
+
+/* Another region attached to SEG: fork copied one */
+void
+shm_ref(struct shm_segment *seg)
+{
+	lock_acquire(shm_lock);
+	seg->seg_nattach++;
+	lock_release(shm_lock);
+}
+
+/* A region attached to SEG is gone; its pages already are */
+void
+shm_detach(struct shm_segment *seg)
+{
+	lock_acquire(shm_lock);
+	KASSERT(seg->seg_nattach > 0);
+	seg->seg_nattach--;
+	if (seg->seg_nattach == 0 && seg->seg_removed) {
+		shm_destroy(shm_lookup(seg));
+	}
+	lock_release(shm_lock);
+}
+
+int
+sys_shmget(int key, size_t size, int flags, int32_t *retval)
+{
+	struct shm_segment *seg;
+	unsigned npages;
+	int id, freeid = -1;
+
+	lock_acquire(shm_lock);
+	for (id = 0; id < SHM_MAXSEGS; id++) {
+		seg = shm_segs[id];
+		if (seg == NULL) {
+			if (freeid < 0) {
+				freeid = id;
+			}
+			continue;
+		}
+		if (key == IPC_PRIVATE || seg->seg_key != key ||
+		    seg->seg_removed) {
+			continue;
+		}
+		/* Found it */
+		lock_release(shm_lock);
+		if ((flags & IPC_CREAT) && (flags & IPC_EXCL)) {
+			return EEXIST;
+		}
+		if (size > shm_size(seg)) {
+			return EINVAL;
+		}
+		*retval = id;
+		return 0;
+	}
+
+	if (key != IPC_PRIVATE && !(flags & IPC_CREAT)) {
+		lock_release(shm_lock);
+		return ENOENT;
+	}
+	npages = ROUNDUP(size, PAGE_SIZE) / PAGE_SIZE;
+	if (size == 0 || npages > USERSPACETOP / PAGE_SIZE) {
+		lock_release(shm_lock);
+		return EINVAL;
+	}
+	if (freeid < 0) {
+		lock_release(shm_lock);
+		return ENOSPC;
+	}
+
+	seg = kmalloc(sizeof(struct shm_segment));
+	if (seg == NULL) {
+		lock_release(shm_lock);
+		return ENOMEM;
+	}
+	seg->seg_frames = kmalloc(npages * sizeof(paddr_t));
+	if (seg->seg_frames == NULL) {
+		kfree(seg);
+		lock_release(shm_lock);
+		return ENOMEM;
+	}
+	bzero(seg->seg_frames, npages * sizeof(paddr_t));
+	seg->seg_key = key;
+	seg->seg_npages = npages;
+	seg->seg_nattach = 0;
+	seg->seg_removed = false;
+	shm_segs[freeid] = seg;
+	shm_nsegs++;
+	lock_release(shm_lock);
+
+	*retval = freeid;
+	return 0;
+}
+
+/*
+ * Attach segment SHMID at ADDR, or wherever there is room if ADDR is 0.
+ */
+int
+sys_shmat(int shmid, vaddr_t addr, int flags, int32_t *retval)
+{
+	struct shm_segment *seg;
+	vaddr_t start;
+	int prot, result;
+
+	if (flags & ~SHM_RDONLY) {
+		return EINVAL;
+	}
+	prot = RG_PROT_READ;
+	if (!(flags & SHM_RDONLY)) {
+		prot |= RG_PROT_WRITE;
+	}
+
+	lock_acquire(shm_lock);
+	if (shmid < 0 || shmid >= SHM_MAXSEGS || shm_segs[shmid] == NULL ||
+	    shm_segs[shmid]->seg_removed) {
+		lock_release(shm_lock);
+		return EINVAL;
+	}
+	seg = shm_segs[shmid];
+	seg->seg_nattach++;
+	lock_release(shm_lock);
+
+	result = as_map_shm(curthread->t_addrspace, seg, addr, prot, &start);
+	if (result) {
+		shm_detach(seg);
+		return result;
+	}
+	*retval = (int32_t)start;
+	return 0;
+}
+
+int
+sys_shmdt(vaddr_t addr)
+{
+	struct shm_segment *seg;
+	int result;
+
+	result = as_unmap_shm(curthread->t_addrspace, addr, &seg);
+	if (result) {
+		return result;
+	}
+	shm_detach(seg);
+	return 0;
+}
+
+/*
+ * Only IPC_RMID: the segment can't be found by key or attached any
+ * more, and goes away when the last attacher detaches or exits.
+ */
+int
+sys_shmctl(int shmid, int cmd, userptr_t buf)
+{
+	struct shm_segment *seg;
+
+	(void)buf;
+	if (cmd != IPC_RMID) {
+		return EINVAL;
+	}
+
+	lock_acquire(shm_lock);
+	if (shmid < 0 || shmid >= SHM_MAXSEGS || shm_segs[shmid] == NULL ||
+	    shm_segs[shmid]->seg_removed) {
+		lock_release(shm_lock);
+		return EINVAL;
+	}
+	seg = shm_segs[shmid];
+	seg->seg_removed = true;
+	if (seg->seg_nattach == 0) {
+		shm_destroy(shmid);
+	}
+	lock_release(shm_lock);
+	return 0;
+}
+
+void
+shm_printstats(void)
+{
+	lock_acquire(shm_lock);
+	kprintf("Shared memory: %u segments, %u frames\n", shm_nsegs,
+		shm_resident);
+	lock_release(shm_lock);
+}
@@ -1,29 +1,775 @@
-int swap_out(void)
+/*
+ * swap.c
+ *
+ *  Backing store for user pages. Pages are written out to fixed-size
+ *  slots on one or more swap devices (raw disks, or files preallocated
+ *  on a mounted file system), each with its own slot bitmap; the
+ *  device and slot live in the PTE (swp_offset) while the page is out.
+ *  Slots are taken from the highest priority devices that have room,
+ *  round robin between devices of equal priority, so paging is spread
+ *  over every disk. Dirty victims are written in clusters, sorted by
+ *  address into consecutive slots, and a fault reads the following
+ *  slots of the same region along with its own, so paging mostly runs
+ *  at sequential disk speed. A fork leaves the parent's swapped-out
+ *  pages where they are and gives the child's PTEs the same slots, so
+ *  slots are counted and freed with their last PTE.
+ */
+
+#include <types.h>
+#include <kern/errno.h>
+#include <kern/fcntl.h>
+#include <kern/stat.h>
+#include <lib.h>
+#include <spinlock.h>
+#include <bitmap.h>
+#include <uio.h>
+#include <vnode.h>
+#include <vfs.h>
+#include <addrspace.h>
+#include <vm.h>
+#include <mips/vm.h>
+#include <swap.h>
+
+#define MAX_SWAP_TRIES 64
+
+/*
+ * A swap offset is the device number above SWAP_DEV_SHIFT and the byte
+ * offset on that device below it. Slots of different devices are never
+ * adjacent, so a cluster or a readahead never spans two devices.
+ */
+#define SWAP_DEV_SHIFT		40
+#define SWAP_MKOFF(dev, off)	(((off_t)(dev) << SWAP_DEV_SHIFT) | (off))
+#define SWAP_DEV(off)		((unsigned)((off) >> SWAP_DEV_SHIFT))
+#define SWAP_DEVOFF(off)	((off) & (((off_t)1 << SWAP_DEV_SHIFT) - 1))
+
+/* Pseudo-device for pages held by the compressed pool (zswap.c) */
+#define SWAP_ZDEV		SWAP_MAXDEVS
+
+struct swap_device {
+	char *sd_name;
+	struct vnode *sd_vnode;
+	int sd_prio;			/* higher is used first */
+	struct bitmap *sd_map;
+	uint16_t *sd_refs;		/* PTEs using each slot */
+	unsigned sd_slots;
+	unsigned sd_used;
+	unsigned sd_rotor;		/* where to look for free slots next */
+	/* Statistics */
+	unsigned sd_reads;		/* device requests */
+	unsigned sd_writes;
+	unsigned sd_pages_in;
+	unsigned sd_pages_out;
+};
+
+/*
+ * Devices are only ever added, so an entry can be used without the lock
+ * once it has been seen; the lock covers the list, the maps and the
+ * counts.
+ */
+static struct spinlock swap_lock = SPINLOCK_INITIALIZER;
+static struct swap_device *swap_devs[SWAP_MAXDEVS];
+static unsigned swap_ndevs = 0;
+static unsigned swap_next = 0;		/* round robin among equal priorities */
+static unsigned swap_slots = 0;
+static unsigned swap_used = 0;
+
+/* Largest write and read, in pages; see swap_setcluster() */
+unsigned swap_cluster = SWAP_DEFAULT_CLUSTER;
+unsigned swap_readahead = SWAP_DEFAULT_READAHEAD;
+
+/* Replacement policy and the clock hand (protected by phymem_lock) */
+static int swap_policy = SWAP_POLICY_CLOCK;
+static int clock_hand = 0;
+
+/* Statistics */
+static unsigned swap_pages_in = 0;
+static unsigned swap_pages_out = 0;
+static unsigned swap_clean_evictions = 0;
+static unsigned swap_reads = 0;		/* device requests */
+static unsigned swap_writes = 0;
+static unsigned swap_readahead_pages = 0;	/* read in without a fault */
+static unsigned swap_shared = 0;	/* slots given to another PTE */
+
+/*
+ * Extend V with zeros from byte FROM up to byte TO, so that every slot
+ * of a swap file has its blocks before we need them.
+ */
+static int
+swap_prealloc(struct vnode *v, off_t from, off_t to)
 {
-	int victim_indx = ppage_to_evict();
-	coremap[victim_indx].pte->status = BUSY;
-	off_t offset = swap_out_page(victim_indx);
-	coremap[victim_indx].pte->status = SWAP_OUT;
-	return coremap[victim_indx].ppage;
+	struct iovec iov;
+	struct uio ku;
+	void *zeros;
+	size_t len;
+	int result = 0;
+
+	zeros = kmalloc(PAGE_SIZE);
+	if (zeros == NULL) {
+		return ENOMEM;
+	}
+	bzero(zeros, PAGE_SIZE);
+	while (from < to) {
+		len = PAGE_SIZE - (from % PAGE_SIZE);
+		if (len > to - from) {
+			len = to - from;
+		}
+		uio_kinit(&iov, &ku, zeros, len, from, UIO_WRITE);
+		result = VOP_WRITE(v, &ku);
+		if (result) {
+			break;
+		}
+		if (ku.uio_resid != 0) {
+			result = ENOSPC;
+			break;
+		}
+		from += len;
+	}
+	kfree(zeros);
+	return result;
+}
+
+/*
+ * Start swapping to PATH with priority PRIO. With PAGES 0, PATH is used
+ * whole (a raw disk, or an existing swap file); otherwise it is a file,
+ * created if need be and grown to PAGES pages.
+ */
+int
+swap_add(const char *path, int prio, unsigned pages)
+{
+	struct swap_device *sd;
+	struct stat st;
+	char *pathcopy;
+	int result;
+
+	sd = kmalloc(sizeof(struct swap_device));
+	if (sd == NULL) {
+		return ENOMEM;
+	}
+	bzero(sd, sizeof(struct swap_device));
+	sd->sd_prio = prio;
+	sd->sd_name = kstrdup(path);
+	if (sd->sd_name == NULL) {
+		kfree(sd);
+		return ENOMEM;
+	}
+
+	/* vfs_open scribbles on the path */
+	pathcopy = kstrdup(path);
+	if (pathcopy == NULL) {
+		result = ENOMEM;
+		goto fail;
+	}
+	result = vfs_open(pathcopy, pages != 0 ? O_RDWR | O_CREAT : O_RDWR,
+			  0600, &sd->sd_vnode);
+	kfree(pathcopy);
+	if (result) {
+		goto fail;
+	}
+
+	result = VOP_STAT(sd->sd_vnode, &st);
+	if (result) {
+		goto fail;
+	}
+	sd->sd_slots = pages != 0 ? pages : st.st_size / PAGE_SIZE;
+	if (sd->sd_slots == 0) {
+		result = EINVAL;
+		goto fail;
+	}
+	if ((off_t)sd->sd_slots * PAGE_SIZE > st.st_size) {
+		result = swap_prealloc(sd->sd_vnode, st.st_size,
+				       (off_t)sd->sd_slots * PAGE_SIZE);
+		if (result) {
+			goto fail;
+		}
+	}
+	sd->sd_map = bitmap_create(sd->sd_slots);
+	sd->sd_refs = kmalloc(sd->sd_slots * sizeof(uint16_t));
+	if (sd->sd_map == NULL || sd->sd_refs == NULL) {
+		result = ENOMEM;
+		goto fail;
+	}
+	bzero(sd->sd_refs, sd->sd_slots * sizeof(uint16_t));
+
+	spinlock_acquire(&swap_lock);
+	if (swap_ndevs == SWAP_MAXDEVS) {
+		spinlock_release(&swap_lock);
+		result = ENOSPC;
+		goto fail;
+	}
+	swap_devs[swap_ndevs++] = sd;
+	swap_slots += sd->sd_slots;
+	spinlock_release(&swap_lock);
+
+	kprintf("swap: %u pages on %s, priority %d\n", sd->sd_slots, path,
+		prio);
+	return 0;
+
+ fail:
+	if (sd->sd_map != NULL) {
+		bitmap_destroy(sd->sd_map);
+	}
+	kfree(sd->sd_refs);
+	if (sd->sd_vnode != NULL) {
+		vfs_close(sd->sd_vnode);
+	}
+	kfree(sd->sd_name);
+	kfree(sd);
+	return result;
 }
 
-int swap_in()
+void
+swap_bootstrap(void)
 {
+	int result;
+
+	zswap_bootstrap();
 
+	result = swap_add(SWAP_DEVICE, 0, 0);
+	if (result) {
+		kprintf("swap: cannot use %s: %s; swapping disabled until "
+			"swapon\n", SWAP_DEVICE, strerror(result));
+	}
 }
 
-int ppage_to_evict(void)
+/*
+ * The device to take slots from next: the next one round from the last
+ * among those of the highest priority with a free slot, or -1.
+ */
+static int
+swap_pickdev(void)
 {
-	int rand, tries = 0;
-	if (kpages_in_use == ppages) {
-		return NULL;
+	struct swap_device *sd;
+	unsigned i, dev;
+	int best = -1;
+
+	KASSERT(spinlock_do_i_hold(&swap_lock));
+	for (i = 0; i < swap_ndevs; i++) {
+		dev = (swap_next + i) % swap_ndevs;
+		sd = swap_devs[dev];
+		if (sd->sd_used == sd->sd_slots) {
+			continue;
+		}
+		if (best < 0 || sd->sd_prio > swap_devs[best]->sd_prio) {
+			best = dev;
+		}
 	}
-	do {
- 		rand = random() % ppages;
-		tries++;
-		/* Make sure we don't spin forever */
-	} while ((coremap[rand].pte == NULL) && (tries < MAX_SWAP_TRIES));
-	
-	KASSERT(tries < MAX_SWAP_TRIES);
-	return rand;
+	if (best >= 0) {
+		swap_next = (best + 1) % swap_ndevs;
+	}
+	return best;
+}
+
+/*
+ * Allocate a run of up to WANT consecutive slots on the device
+ * swap_pickdev chooses: the free ones that follow the first free slot
+ * at or after its rotor. The run length is handed back in GOT and its
+ * first slot's swap offset in OFFSET. Starting at the rotor keeps
+ * successive clusters next to each other on the disk.
+ */
+static int
+swap_alloc_run(unsigned want, unsigned *got, off_t *offset)
+{
+	struct swap_device *sd;
+	unsigned i, slot, n;
+	int dev;
+
+	spinlock_acquire(&swap_lock);
+	dev = swap_pickdev();
+	if (dev < 0) {
+		spinlock_release(&swap_lock);
+		return ENOSPC;
+	}
+	sd = swap_devs[dev];
+	slot = sd->sd_rotor;
+	for (i = 0; i < sd->sd_slots; i++) {
+		slot = (sd->sd_rotor + i) % sd->sd_slots;
+		if (!bitmap_isset(sd->sd_map, slot)) {
+			break;
+		}
+	}
+	KASSERT(i < sd->sd_slots);
+	for (n = 0; n < want && slot + n < sd->sd_slots &&
+		     !bitmap_isset(sd->sd_map, slot + n); n++) {
+		bitmap_mark(sd->sd_map, slot + n);
+		sd->sd_refs[slot + n] = 1;
+	}
+	sd->sd_used += n;
+	sd->sd_rotor = (slot + n) % sd->sd_slots;
+	swap_used += n;
+	spinlock_release(&swap_lock);
+
+	*got = n;
+	*offset = SWAP_MKOFF(dev, (off_t)slot * PAGE_SIZE);
+	return 0;
+}
+
+/*
+ * One more PTE uses the slot at OFFSET (fork).
+ */
+void
+swap_dup(off_t offset)
+{
+	struct swap_device *sd;
+	unsigned slot;
+
+	if (SWAP_DEV(offset) == SWAP_ZDEV) {
+		zswap_dup(SWAP_DEVOFF(offset) / PAGE_SIZE);
+	}
+
+	spinlock_acquire(&swap_lock);
+	if (SWAP_DEV(offset) != SWAP_ZDEV) {
+		KASSERT(SWAP_DEV(offset) < swap_ndevs);
+		sd = swap_devs[SWAP_DEV(offset)];
+		slot = SWAP_DEVOFF(offset) / PAGE_SIZE;
+		KASSERT(sd->sd_refs[slot] > 0 && sd->sd_refs[slot] < 0xffff);
+		sd->sd_refs[slot]++;
+	}
+	swap_shared++;
+	spinlock_release(&swap_lock);
+}
+
+/*
+ * A PTE is done with the slot at OFFSET; it is free once nobody uses
+ * it.
+ */
+void
+swap_free(off_t offset)
+{
+	struct swap_device *sd;
+	unsigned slot;
+
+	if (SWAP_DEV(offset) == SWAP_ZDEV) {
+		zswap_free(SWAP_DEVOFF(offset) / PAGE_SIZE);
+		return;
+	}
+
+	spinlock_acquire(&swap_lock);
+	KASSERT(SWAP_DEV(offset) < swap_ndevs);
+	sd = swap_devs[SWAP_DEV(offset)];
+	slot = SWAP_DEVOFF(offset) / PAGE_SIZE;
+	KASSERT(bitmap_isset(sd->sd_map, slot));
+	KASSERT(sd->sd_refs[slot] > 0);
+	if (--sd->sd_refs[slot] == 0) {
+		bitmap_unmark(sd->sd_map, slot);
+		sd->sd_used--;
+		swap_used--;
+	}
+	spinlock_release(&swap_lock);
+}
+
+/*
+ * Move the N frames in FRAMES to or from the N slots starting at
+ * OFFSET, in one device request.
+ */
+static int
+swap_io(paddr_t *frames, unsigned n, off_t offset, enum uio_rw rw)
+{
+	struct iovec iov[SWAP_CLUSTER_MAX];
+	struct swap_device *sd;
+	struct uio ku;
+	unsigned i;
+
+	KASSERT(n > 0 && n <= SWAP_CLUSTER_MAX);
+	for (i = 0; i < n; i++) {
+		iov[i].iov_kbase = (void *)PADDR_TO_KVADDR(frames[i]);
+		iov[i].iov_len = PAGE_SIZE;
+	}
+	ku.uio_iov = iov;
+	ku.uio_iovcnt = n;
+	ku.uio_offset = SWAP_DEVOFF(offset);
+	ku.uio_resid = n * PAGE_SIZE;
+	ku.uio_segflg = UIO_SYSSPACE;
+	ku.uio_rw = rw;
+	ku.uio_space = NULL;
+
+	spinlock_acquire(&swap_lock);
+	KASSERT(SWAP_DEV(offset) < swap_ndevs);
+	sd = swap_devs[SWAP_DEV(offset)];
+	if (rw == UIO_READ) {
+		swap_reads++;
+		sd->sd_reads++;
+		sd->sd_pages_in += n;
+	}
+	else {
+		swap_writes++;
+		sd->sd_writes++;
+		sd->sd_pages_out += n;
+	}
+	spinlock_release(&swap_lock);
+
+	if (rw == UIO_READ) {
+		return VOP_READ(sd->sd_vnode, &ku);
+	}
+	return VOP_WRITE(sd->sd_vnode, &ku);
+}
+
+/*
+ * A frame can go if it belongs to exactly one user page and nobody is
+ * in the middle of setting it up. Without a swap device only clean
+ * pages can be dropped.
+ */
+static bool
+evictable(int index)
+{
+	struct coremap_t *cm = &coremap[index];
+
+	return cm->status && !cm->busy && cm->refcount == 1 &&
+		cm->pte != NULL &&
+		(cm->pte->state == PG_MEM || cm->pte->state == PG_TLB) &&
+		(swap_ndevs > 0 || zswap_enabled || !cm->dirty);
+}
+
+/*
+ * Random replacement: try a few random frames, then fall back to a
+ * scan.
+ */
+static int
+evict_random(void)
+{
+	int rand, i, tries;
+
+	for (tries = 0; tries < MAX_SWAP_TRIES; tries++) {
+		rand = random() % ppages;
+		if (evictable(rand)) {
+			return rand;
+		}
+	}
+	for (i = 0; i < ppages; i++) {
+		if (evictable(i)) {
+			return i;
+		}
+	}
+	return -1;
+}
+
+/*
+ * Clock (second chance). vm_fault sets lru_bit whenever a page is
+ * loaded into the TLB. As the hand passes a referenced page it clears
+ * the bit and drops the page's TLB entry, so the bit only comes back
+ * if the page is touched again before the hand returns. Unreferenced
+ * clean pages cost no I/O and are taken first; the first unreferenced
+ * dirty page is remembered in case a full turn finds no clean one.
+ * Two turns are enough, since the first clears every bit.
+ *
+ * The TLB entries only need to go eventually, so the shootdowns are
+ * batched and not waited for.
+ */
+static int
+evict_clock(void)
+{
+	struct coremap_t *cm;
+	struct tlbbatch tb;
+	int victim = -1, dirty_victim = -1;
+	int i, index;
+
+	vm_tlbbatch_init(&tb, false);
+	for (i = 0; i < 2 * ppages; i++) {
+		index = clock_hand;
+		clock_hand = (clock_hand + 1) % ppages;
+		if (!evictable(index)) {
+			continue;
+		}
+		cm = &coremap[index];
+		if (cm->lru_bit) {
+			cm->lru_bit = false;
+			vm_tlbbatch_add(&tb, cm->as, cm->pte->vpage);
+			if (cm->pte->state == PG_TLB) {
+				cm->pte->state = PG_MEM;
+			}
+			continue;
+		}
+		if (!cm->dirty) {
+			victim = index;
+			break;
+		}
+		if (dirty_victim < 0) {
+			dirty_victim = index;
+		}
+		if (i >= ppages) {
+			/* A full turn found no clean page */
+			break;
+		}
+	}
+	vm_tlbbatch_flush(&tb);
+	return victim >= 0 ? victim : dirty_victim;
+}
+
+/*
+ * Pick a user page to throw out, or -1 if there isn't one.
+ */
+static int
+ppage_to_evict(void)
+{
+	KASSERT(spinlock_do_i_hold(&phymem_lock));
+	if (swap_policy == SWAP_POLICY_RANDOM) {
+		return evict_random();
+	}
+	return evict_clock();
+}
+
+int
+swap_setcluster(unsigned cluster, unsigned readahead)
+{
+	if (cluster < 1 || cluster > SWAP_CLUSTER_MAX ||
+	    readahead < 1 || readahead > SWAP_CLUSTER_MAX) {
+		return EINVAL;
+	}
+	swap_cluster = cluster;
+	swap_readahead = readahead;
+	return 0;
+}
+
+int
+swap_setpolicy(const char *name)
+{
+	if (!strcmp(name, "random")) {
+		swap_policy = SWAP_POLICY_RANDOM;
+	}
+	else if (!strcmp(name, "clock")) {
+		swap_policy = SWAP_POLICY_CLOCK;
+	}
+	else {
+		return EINVAL;
+	}
+	return 0;
+}
+
+/*
+ * Order for the victims of one cluster: by address space, then address,
+ * so pages that are next to each other stay next to each other on disk
+ * and can be read back together.
+ */
+static bool
+victim_before(int a, int b)
+{
+	struct coremap_t *ca = &coremap[a], *cb = &coremap[b];
+
+	if (ca->as != cb->as) {
+		return (uintptr_t)ca->as < (uintptr_t)cb->as;
+	}
+	return ca->pte->vpage < cb->pte->vpage;
+}
+
+/*
+ * Evict up to MAX user pages and hand their frames to the caller in
+ * FRAMES; returns how many, 0 if nothing could be evicted. Dirty pages
+ * are written to fresh swap slots first, in as few device requests as
+ * the free slots allow; clean ones just go back to their existing
+ * slot, or to being unallocated if they never left the zero-filled
+ * state. Must be able to sleep.
+ */
+unsigned
+swap_out_cluster(paddr_t *frames, unsigned max)
+{
+	int victims[SWAP_CLUSTER_MAX];
+	bool dirty[SWAP_CLUSTER_MAX];
+	int results[SWAP_CLUSTER_MAX];
+	off_t offsets[SWAP_CLUSTER_MAX];
+	paddr_t dframes[SWAP_CLUSTER_MAX];	/* the dirty ones, in order */
+	unsigned dindex[SWAP_CLUSTER_MAX];	/* ...and where they are */
+	struct coremap_t *cm;
+	struct pg_table_entry *pte;
+	struct tlbbatch tb;
+	unsigned n, i, pos, run, ndirty, nspill, zindex, nout = 0;
+	unsigned nwritten = 0, nclean = 0;
+	off_t offset = 0;
+	int victim, result;
+
+	if (max > swap_cluster) {
+		max = swap_cluster;
+	}
+
+	/*
+	 * Anyone touching the pages from now on waits for us. Make sure
+	 * no CPU can still write to them through a stale TLB entry before
+	 * they go to disk or to their next owner.
+	 */
+	spinlock_acquire(&phymem_lock);
+	vm_tlbbatch_init(&tb, true);
+	for (n = 0; n < max; n++) {
+		victim = ppage_to_evict();
+		if (victim < 0) {
+			break;
+		}
+		pte = coremap[victim].pte;
+		KASSERT(!coremap[victim].dirty || !pte->swp_slot);
+		coremap[victim].busy = true;
+		pte->state = PG_BUSY;
+		vm_tlbbatch_add(&tb, coremap[victim].as, pte->vpage);
+
+		/* Insertion sort; there are only a few */
+		for (i = n; i > 0 && victim_before(victim, victims[i - 1]);
+		     i--) {
+			victims[i] = victims[i - 1];
+		}
+		victims[i] = victim;
+	}
+	ndirty = 0;
+	for (i = 0; i < n; i++) {
+		results[i] = 0;
+		dirty[i] = coremap[victims[i]].dirty;
+		if (dirty[i]) {
+			dindex[ndirty] = i;
+			dframes[ndirty++] = coremap[victims[i]].ppage;
+		}
+	}
+	spinlock_release(&phymem_lock);
+	if (n == 0) {
+		return 0;
+	}
+	vm_tlbbatch_flush(&tb);
+
+	/* The compressed pool takes what it can; the rest go to disk */
+	nspill = 0;
+	for (i = 0; i < ndirty; i++) {
+		if (zswap_store(dframes[i], &zindex) == 0) {
+			offsets[dindex[i]] = SWAP_MKOFF(SWAP_ZDEV,
+						(off_t)zindex * PAGE_SIZE);
+			continue;
+		}
+		dframes[nspill] = dframes[i];
+		dindex[nspill++] = dindex[i];
+	}
+	ndirty = nspill;
+
+	for (pos = 0; pos < ndirty; pos += run) {
+		result = swap_alloc_run(ndirty - pos, &run, &offset);
+		if (result) {
+			/* Out of swap: the rest stay where they are */
+			run = ndirty - pos;
+		}
+		else {
+			result = swap_io(&dframes[pos], run, offset, UIO_WRITE);
+			if (result) {
+				for (i = 0; i < run; i++) {
+					swap_free(offset + i * PAGE_SIZE);
+				}
+			}
+		}
+		for (i = 0; i < run; i++) {
+			results[dindex[pos + i]] = result;
+			offsets[dindex[pos + i]] = offset + i * PAGE_SIZE;
+		}
+	}
+
+	spinlock_acquire(&phymem_lock);
+	for (i = 0; i < n; i++) {
+		cm = &coremap[victims[i]];
+		pte = cm->pte;
+		if (results[i]) {
+			/* Couldn't write it; the page stays where it was */
+			pte->state = PG_MEM;
+			cm->busy = false;
+			continue;
+		}
+		if (dirty[i]) {
+			pte->swp_offset = offsets[i];
+			pte->swp_slot = true;
+			nwritten++;
+		}
+		else {
+			nclean++;
+		}
+		pte->ppage = 0;
+		pte->state = pte->swp_slot ? PG_SWP : PG_UNALOC;
+		vm_rss_adjust(cm->as, -1, false);
+		textcache_forget(victims[i]);
+		cm->pte = NULL;
+		cm->as = NULL;
+		cm->busy = false;
+		frames[nout++] = cm->ppage;
+	}
+
+	spinlock_acquire(&swap_lock);
+	swap_pages_out += nwritten;
+	swap_clean_evictions += nclean;
+	spinlock_release(&swap_lock);
+
+	pte_wakeup();
+	spinlock_release(&phymem_lock);
+	return nout;
+}
+
+/*
+ * Evict one user page and hand its frame to the caller, or 0 if there
+ * was nothing to evict.
+ */
+paddr_t
+swap_out(void)
+{
+	paddr_t paddr;
+
+	if (swap_out_cluster(&paddr, 1) == 0) {
+		return 0;
+	}
+	return paddr;
+}
+
+/*
+ * Read the N consecutive slots starting at OFFSET into FRAMES: the page
+ * that faulted and the ones read ahead with it. The slots are kept, so
+ * the pages can be evicted again for free as long as they stay clean.
+ * The caller has the PTEs marked busy.
+ */
+int
+swap_in(paddr_t *frames, unsigned n, off_t offset)
+{
+	unsigned i;
+	int result = 0;
+
+	if (SWAP_DEV(offset) == SWAP_ZDEV) {
+		for (i = 0; i < n && result == 0; i++) {
+			result = zswap_load(SWAP_DEVOFF(offset) / PAGE_SIZE + i,
+					    frames[i]);
+		}
+	}
+	else {
+		result = swap_io(frames, n, offset, UIO_READ);
+	}
+	if (result) {
+		return result;
+	}
+
+	spinlock_acquire(&swap_lock);
+	swap_pages_in += n;
+	swap_readahead_pages += n - 1;
+	spinlock_release(&swap_lock);
+	return 0;
+}
+
+void
+swap_printstats(void)
+{
+	struct swap_device *sd;
+	const char *policy;
+	unsigned i, pages_in;
+
+	policy = swap_policy == SWAP_POLICY_RANDOM ? "random" : "clock";
+	spinlock_acquire(&swap_lock);
+	if (swap_ndevs == 0 && !zswap_enabled) {
+		spinlock_release(&swap_lock);
+		kprintf("Swap: disabled (%s replacement)\n", policy);
+		return;
+	}
+	kprintf("Swap: %u/%u pages used, %s replacement\n",
+		swap_used, swap_slots, policy);
+	kprintf("      %u paged in, %u paged out, %u clean evictions, "
+		"%u slots shared by fork\n", swap_pages_in, swap_pages_out,
+		swap_clean_evictions, swap_shared);
+	kprintf("      %u reads (%u pages read ahead), %u writes; "
+		"clusters of %u out, %u in\n", swap_reads,
+		swap_readahead_pages, swap_writes, swap_cluster,
+		swap_readahead);
+	for (i = 0; i < swap_ndevs; i++) {
+		sd = swap_devs[i];
+		kprintf("      %s: priority %d, %u/%u pages used, "
+			"%u reads (%u pages), %u writes (%u pages)\n",
+			sd->sd_name, sd->sd_prio, sd->sd_used, sd->sd_slots,
+			sd->sd_reads, sd->sd_pages_in, sd->sd_writes,
+			sd->sd_pages_out);
+	}
+	pages_in = swap_pages_in;
+	spinlock_release(&swap_lock);
+
+	zswap_printstats(pages_in);
 }
@@ -0,0 +1,181 @@
+/*
+ * textcache.c
+ *
+ *  Frames holding executable text, indexed by (vnode, page address).
+ *  A process faulting on a text page first looks here and, if some
+ *  other process running the same binary already has the page, maps
+ *  that frame copy-on-write instead of reading its own copy. Entries
+ *  hold no reference of their own: a frame is forgotten when it is
+ *  freed or evicted, and every frame of a vnode when the file is
+ *  written. Everything here is protected by phymem_lock.
+ */
+
+#include <types.h>
+#include <lib.h>
+#include <spinlock.h>
+#include <vnode.h>
+#include <vm.h>
+#include <mips/vm.h>
+
+#define TC_MINBUCKETS	16
+#define TC_RAMFRACTION	8	/* one bucket per this many frames */
+
+static int *tc_buckets = NULL;	/* heads of chains through cm_tcnext */
+static unsigned tc_nbuckets = 0;
+
+/* Statistics */
+static unsigned tc_pages = 0;		/* frames in the cache */
+static unsigned tc_hits = 0;
+static unsigned tc_entered = 0;
+static unsigned tc_forgotten = 0;	/* frames freed or evicted */
+static unsigned tc_purged = 0;		/* dropped because the file changed */
+
+static unsigned
+tc_hash(struct vnode *v, vaddr_t vpage)
+{
+	return (((uintptr_t)v >> 4) ^ (vpage / PAGE_SIZE)) & (tc_nbuckets - 1);
+}
+
+void
+textcache_bootstrap(void)
+{
+	unsigned i;
+
+	tc_nbuckets = TC_MINBUCKETS;
+	while (tc_nbuckets < (unsigned)ppages / TC_RAMFRACTION) {
+		tc_nbuckets *= 2;
+	}
+	tc_buckets = kmalloc(tc_nbuckets * sizeof(int));
+	if (tc_buckets == NULL) {
+		panic("textcache_bootstrap: out of memory\n");
+	}
+	for (i = 0; i < tc_nbuckets; i++) {
+		tc_buckets[i] = -1;
+	}
+}
+
+/*
+ * The coremap index of the frame holding page VPAGE of V's text, or -1.
+ */
+int
+textcache_lookup(struct vnode *v, vaddr_t vpage)
+{
+	int index;
+
+	KASSERT(spinlock_do_i_hold(&phymem_lock));
+	for (index = tc_buckets[tc_hash(v, vpage)]; index >= 0;
+	     index = coremap[index].cm_tcnext) {
+		if (coremap[index].cm_vnode == v &&
+		    coremap[index].cm_vpage == vpage) {
+			tc_hits++;
+			return index;
+		}
+	}
+	return -1;
+}
+
+/*
+ * Offer the frame at INDEX, just read in, as page VPAGE of V's text.
+ * Ignored if someone else got there first.
+ */
+void
+textcache_enter(int index, struct vnode *v, vaddr_t vpage)
+{
+	unsigned b;
+	int i;
+
+	KASSERT(spinlock_do_i_hold(&phymem_lock));
+	KASSERT(coremap[index].cm_vnode == NULL);
+
+	b = tc_hash(v, vpage);
+	for (i = tc_buckets[b]; i >= 0; i = coremap[i].cm_tcnext) {
+		if (coremap[i].cm_vnode == v && coremap[i].cm_vpage == vpage) {
+			return;
+		}
+	}
+	coremap[index].cm_vnode = v;
+	coremap[index].cm_vpage = vpage;
+	coremap[index].cm_tcnext = tc_buckets[b];
+	tc_buckets[b] = index;
+	v->vn_textpages++;
+	tc_pages++;
+	tc_entered++;
+}
+
+static void
+tc_unlink(int index)
+{
+	struct vnode *v = coremap[index].cm_vnode;
+	int *pp;
+
+	pp = &tc_buckets[tc_hash(v, coremap[index].cm_vpage)];
+	while (*pp != index) {
+		KASSERT(*pp >= 0);
+		pp = &coremap[*pp].cm_tcnext;
+	}
+	*pp = coremap[index].cm_tcnext;
+	coremap[index].cm_tcnext = -1;
+	coremap[index].cm_vnode = NULL;
+	v->vn_textpages--;
+	tc_pages--;
+}
+
+/*
+ * The frame at INDEX is being freed or reused; no-op if it isn't cached.
+ */
+void
+textcache_forget(int index)
+{
+	KASSERT(spinlock_do_i_hold(&phymem_lock));
+	if (coremap[index].cm_vnode != NULL) {
+		tc_unlink(index);
+		tc_forgotten++;
+	}
+}
+
+/*
+ * V has been written to: later execs must read it afresh. Processes
+ * already running it keep the frames they have.
+ */
+void
+textcache_purge(struct vnode *v)
+{
+	unsigned b;
+	int index, next;
+
+	/* Most writes are to files that aren't running anywhere */
+	if (v->vn_textpages == 0) {
+		return;
+	}
+
+	spinlock_acquire(&phymem_lock);
+	for (b = 0; b < tc_nbuckets && v->vn_textpages > 0; b++) {
+		for (index = tc_buckets[b]; index >= 0; index = next) {
+			next = coremap[index].cm_tcnext;
+			if (coremap[index].cm_vnode == v) {
+				tc_unlink(index);
+				tc_purged++;
+			}
+		}
+	}
+	spinlock_release(&phymem_lock);
+}
+
+void
+textcache_printstats(void)
+{
+	unsigned b, saved = 0;
+	int index;
+
+	spinlock_acquire(&phymem_lock);
+	for (b = 0; b < tc_nbuckets; b++) {
+		for (index = tc_buckets[b]; index >= 0;
+		     index = coremap[index].cm_tcnext) {
+			saved += coremap[index].refcount - 1;
+		}
+	}
+	kprintf("Text cache: %u frames saving %u copies, %u hits, "
+		"%u entered, %u freed, %u purged\n", tc_pages, saved, tc_hits,
+		tc_entered, tc_forgotten, tc_purged);
+	spinlock_release(&phymem_lock);
+}
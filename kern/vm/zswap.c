@@ -0,0 +1,403 @@
+/*
+ * zswap.c
+ *
+ *  Compressed swap cache. When it is on, swap_out_cluster offers each
+ *  dirty victim here before giving it a disk slot: the page is packed
+ *  with a small LZ77 codec into a kmalloc'd buffer and the PTE gets an
+ *  entry of this pool as its swap slot instead. A fault on it is then
+ *  a decompression rather than a disk read. Pages that don't shrink to
+ *  ZSWAP_MAXSIZE, or that don't fit under the pool limit, go to disk
+ *  as before.
+ *
+ *  Storing allocates memory, which can itself have to evict a page.
+ *  zswap_lock (which also covers the codec's scratch space) is held
+ *  across that, and a nested store just says no, so the nested
+ *  eviction goes to disk instead of recursing. Entries are freed when
+ *  their page is written, under phymem_lock, so they are only put on
+ *  a dead list there and their memory goes back at the next store.
+ */
+
+#include <types.h>
+#include <kern/errno.h>
+#include <lib.h>
+#include <spinlock.h>
+#include <synch.h>
+#include <bitmap.h>
+#include <vm.h>
+#include <mips/vm.h>
+#include <swap.h>
+
+/* Pages that compress worse than this aren't worth keeping in RAM */
+#define ZSWAP_MAXSIZE		(PAGE_SIZE / 2)
+
+/* Default limit on compressed bytes, as a fraction of RAM */
+#define ZSWAP_LIMIT_FRACTION	8
+
+/*
+ * The codec. Groups of eight items, each group preceded by a control
+ * byte whose bit i says whether item i is a literal byte (0) or a
+ * match (1). A match is two bytes: the length less LZ_MINMATCH in the
+ * top four bits, then a 12-bit distance back into the output; a
+ * length nibble of 15 is followed by one more byte of length.
+ */
+#define LZ_MINMATCH	3
+#define LZ_MAXDIST	4095
+#define LZ_MAXLEN	(LZ_MINMATCH + 15 + 255)
+#define LZ_HASHBITS	10
+
+struct zswap_entry {
+	void *ze_data;			/* NULL if the entry is free */
+	unsigned ze_len;
+	unsigned ze_refs;		/* PTEs using it, as for a disk slot */
+	int ze_nextdead;		/* dead list link */
+};
+
+bool zswap_enabled = false;
+
+/* Stores, and the codec's hash table and output buffer */
+static struct lock *zswap_lock;
+static uint16_t lz_hash[1 << LZ_HASHBITS];	/* position + 1, or 0 */
+static unsigned char zswap_buf[ZSWAP_MAXSIZE];
+
+/* The entries, the dead list and the statistics */
+static struct spinlock zswap_spin = SPINLOCK_INITIALIZER;
+static struct zswap_entry *zswap_table;
+static struct bitmap *zswap_map;
+static unsigned zswap_nentries;
+static int zswap_dead = -1;		/* freed, memory not yet returned */
+static unsigned zswap_limit;		/* bytes */
+
+/* Statistics */
+static unsigned zswap_pages = 0;	/* entries in use */
+static unsigned zswap_bytes = 0;	/* their compressed size */
+static unsigned zswap_stored = 0;
+static unsigned zswap_poor = 0;		/* didn't compress enough */
+static unsigned zswap_full = 0;		/* no room in the pool */
+static unsigned zswap_nested = 0;	/* store from inside a store */
+static unsigned zswap_hits = 0;		/* pages read back from the pool */
+
+static unsigned
+lz_hashof(const unsigned char *p)
+{
+	return ((p[0] << 8 ^ p[1] << 4 ^ p[2]) * 2654435761U) >>
+		(32 - LZ_HASHBITS);
+}
+
+/*
+ * Compress LEN bytes at SRC into DST. Returns the compressed size, or
+ * 0 if it would be more than MAX.
+ */
+static size_t
+lz_compress(const unsigned char *src, size_t len, unsigned char *dst,
+	    size_t max)
+{
+	size_t ip = 0, op = 0, ctrl = 0, ref, mlen, dist;
+	unsigned bit = 8, h;
+
+	bzero(lz_hash, sizeof(lz_hash));
+	while (ip < len) {
+		if (bit == 8) {
+			if (op >= max) {
+				return 0;
+			}
+			ctrl = op++;
+			dst[ctrl] = 0;
+			bit = 0;
+		}
+
+		mlen = 0;
+		if (ip + LZ_MINMATCH <= len) {
+			h = lz_hashof(&src[ip]);
+			ref = lz_hash[h];
+			lz_hash[h] = ip + 1;
+			if (ref != 0 && ip - (ref - 1) <= LZ_MAXDIST) {
+				ref--;
+				while (ip + mlen < len && mlen < LZ_MAXLEN &&
+				       src[ref + mlen] == src[ip + mlen]) {
+					mlen++;
+				}
+			}
+		}
+
+		/* Hash collisions show up as short matches */
+		if (mlen < LZ_MINMATCH) {
+			if (op >= max) {
+				return 0;
+			}
+			dst[op++] = src[ip++];
+		}
+		else {
+			if (op + 3 > max) {
+				return 0;
+			}
+			dist = ip - ref;
+			mlen -= LZ_MINMATCH;
+			dst[ctrl] |= 1 << bit;
+			dst[op++] = (mlen < 15 ? mlen : 15) << 4 | dist >> 8;
+			dst[op++] = dist & 0xff;
+			if (mlen >= 15) {
+				dst[op++] = mlen - 15;
+			}
+			ip += mlen + LZ_MINMATCH;
+		}
+		bit++;
+	}
+	return op;
+}
+
+static int
+lz_decompress(const unsigned char *src, size_t slen, unsigned char *dst,
+	      size_t dlen)
+{
+	size_t ip = 0, op = 0, mlen, dist;
+	unsigned bit, ctrl;
+
+	while (op < dlen) {
+		if (ip >= slen) {
+			return EINVAL;
+		}
+		ctrl = src[ip++];
+		for (bit = 0; bit < 8 && op < dlen; bit++) {
+			if (!(ctrl & (1 << bit))) {
+				if (ip >= slen) {
+					return EINVAL;
+				}
+				dst[op++] = src[ip++];
+				continue;
+			}
+			if (ip + 2 > slen) {
+				return EINVAL;
+			}
+			mlen = src[ip] >> 4;
+			dist = (src[ip] & 0xf) << 8 | src[ip + 1];
+			ip += 2;
+			if (mlen == 15) {
+				if (ip >= slen) {
+					return EINVAL;
+				}
+				mlen += src[ip++];
+			}
+			mlen += LZ_MINMATCH;
+			if (dist == 0 || dist > op || mlen > dlen - op) {
+				return EINVAL;
+			}
+			/* Byte at a time: the source may overlap the copy */
+			for (; mlen > 0; mlen--, op++) {
+				dst[op] = dst[op - dist];
+			}
+		}
+	}
+	return 0;
+}
+
+void
+zswap_bootstrap(void)
+{
+	zswap_lock = lock_create("zswap");
+	zswap_nentries = ppages;
+	zswap_table = kmalloc(zswap_nentries * sizeof(struct zswap_entry));
+	zswap_map = bitmap_create(zswap_nentries);
+	if (zswap_lock == NULL || zswap_table == NULL || zswap_map == NULL) {
+		panic("zswap_bootstrap: out of memory\n");
+	}
+	bzero(zswap_table, zswap_nentries * sizeof(struct zswap_entry));
+	zswap_limit = ppages / ZSWAP_LIMIT_FRACTION * PAGE_SIZE;
+}
+
+/*
+ * Turn the pool on or off, with a limit of LIMIT pages of compressed
+ * data if LIMIT isn't 0. Pages already in the pool stay there until
+ * they are read back or freed.
+ */
+int
+zswap_setenabled(bool on, unsigned limit)
+{
+	if (limit > (unsigned)ppages / 2) {
+		return EINVAL;
+	}
+	spinlock_acquire(&zswap_spin);
+	if (limit != 0) {
+		zswap_limit = limit * PAGE_SIZE;
+	}
+	zswap_enabled = on;
+	spinlock_release(&zswap_spin);
+	return 0;
+}
+
+/*
+ * Give back the memory of entries freed since last time.
+ */
+static void
+zswap_reap(void)
+{
+	void *data;
+	int index;
+
+	while (true) {
+		spinlock_acquire(&zswap_spin);
+		index = zswap_dead;
+		if (index < 0) {
+			spinlock_release(&zswap_spin);
+			break;
+		}
+		zswap_dead = zswap_table[index].ze_nextdead;
+		data = zswap_table[index].ze_data;
+		zswap_table[index].ze_data = NULL;
+		bitmap_unmark(zswap_map, index);
+		spinlock_release(&zswap_spin);
+
+		kfree(data);
+	}
+}
+
+/*
+ * Compress the page in frame PA into the pool and hand back its entry
+ * in RET. Fails if the pool is off or full, if the page compresses
+ * poorly, or if called from within another store.
+ */
+int
+zswap_store(paddr_t pa, unsigned *ret)
+{
+	unsigned index;
+	size_t len;
+	void *data;
+
+	if (!zswap_enabled) {
+		return ENOSYS;
+	}
+	if (lock_do_i_hold(zswap_lock)) {
+		spinlock_acquire(&zswap_spin);
+		zswap_nested++;
+		spinlock_release(&zswap_spin);
+		return EAGAIN;
+	}
+
+	lock_acquire(zswap_lock);
+	zswap_reap();
+	len = lz_compress((void *)PADDR_TO_KVADDR(pa), PAGE_SIZE, zswap_buf,
+			  ZSWAP_MAXSIZE);
+	if (len == 0) {
+		spinlock_acquire(&zswap_spin);
+		zswap_poor++;
+		spinlock_release(&zswap_spin);
+		lock_release(zswap_lock);
+		return EFBIG;
+	}
+
+	data = kmalloc(len);
+
+	spinlock_acquire(&zswap_spin);
+	if (data == NULL || zswap_bytes + len > zswap_limit ||
+	    bitmap_alloc(zswap_map, &index)) {
+		zswap_full++;
+		spinlock_release(&zswap_spin);
+		lock_release(zswap_lock);
+		kfree(data);
+		return ENOSPC;
+	}
+	memcpy(data, zswap_buf, len);
+	zswap_table[index].ze_data = data;
+	zswap_table[index].ze_len = len;
+	zswap_table[index].ze_refs = 1;
+	zswap_pages++;
+	zswap_bytes += len;
+	zswap_stored++;
+	spinlock_release(&zswap_spin);
+	lock_release(zswap_lock);
+
+	*ret = index;
+	return 0;
+}
+
+/*
+ * Decompress entry INDEX into frame PA. The entry is kept, like a disk
+ * slot, so the page can go back for free while it stays clean. The
+ * caller has the page busy, so the entry can't be freed meanwhile.
+ */
+int
+zswap_load(unsigned index, paddr_t pa)
+{
+	struct zswap_entry *ze;
+	void *data;
+	size_t len;
+	int result;
+
+	spinlock_acquire(&zswap_spin);
+	KASSERT(index < zswap_nentries);
+	ze = &zswap_table[index];
+	KASSERT(ze->ze_data != NULL);
+	data = ze->ze_data;
+	len = ze->ze_len;
+	spinlock_release(&zswap_spin);
+
+	result = lz_decompress(data, len, (void *)PADDR_TO_KVADDR(pa),
+			       PAGE_SIZE);
+	if (result == 0) {
+		spinlock_acquire(&zswap_spin);
+		zswap_hits++;
+		spinlock_release(&zswap_spin);
+	}
+	return result;
+}
+
+/*
+ * Another PTE uses entry INDEX (fork). May be called with phymem_lock
+ * held.
+ */
+void
+zswap_dup(unsigned index)
+{
+	spinlock_acquire(&zswap_spin);
+	KASSERT(index < zswap_nentries);
+	KASSERT(zswap_table[index].ze_data != NULL);
+	KASSERT(zswap_table[index].ze_refs > 0);
+	zswap_table[index].ze_refs++;
+	spinlock_release(&zswap_spin);
+}
+
+/*
+ * A page using entry INDEX was written or freed; the entry goes with
+ * the last one. May be called with phymem_lock held.
+ */
+void
+zswap_free(unsigned index)
+{
+	struct zswap_entry *ze;
+
+	spinlock_acquire(&zswap_spin);
+	KASSERT(index < zswap_nentries);
+	ze = &zswap_table[index];
+	KASSERT(ze->ze_data != NULL);
+	KASSERT(ze->ze_refs > 0);
+	if (--ze->ze_refs > 0) {
+		spinlock_release(&zswap_spin);
+		return;
+	}
+	zswap_bytes -= ze->ze_len;
+	zswap_pages--;
+	ze->ze_nextdead = zswap_dead;
+	zswap_dead = index;
+	spinlock_release(&zswap_spin);
+}
+
+/*
+ * Reads of the pool out of all swap-ins (TOTAL_IN) are its hit rate.
+ */
+void
+zswap_printstats(unsigned total_in)
+{
+	unsigned ratio;
+
+	spinlock_acquire(&zswap_spin);
+	ratio = zswap_bytes == 0 ? 0 :
+		(unsigned)((uint64_t)zswap_pages * PAGE_SIZE * 100 /
+			   zswap_bytes);
+	kprintf("Compressed swap: %s, %u pages in %u/%u bytes "
+		"(ratio %u.%02u:1)\n", zswap_enabled ? "on" : "off",
+		zswap_pages, zswap_bytes, zswap_limit, ratio / 100,
+		ratio % 100);
+	kprintf("      %u stored, %u too big, %u pool full, %u nested; "
+		"%u of %u swap-ins hit\n", zswap_stored, zswap_poor,
+		zswap_full, zswap_nested, zswap_hits, total_in);
+	spinlock_release(&zswap_spin);
+}
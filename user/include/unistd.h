@@ -39,8 +39,10 @@
  */
 #include <kern/fcntl.h>
 #include <kern/ioctl.h>
+#include <kern/mman.h>
 #include <kern/reboot.h>
 #include <kern/seek.h>
+#include <kern/shm.h>
 #include <kern/time.h>
 #include <kern/unistd.h>
 #include <kern/wait.h>
@@ -156,6 +158,14 @@ time_t __time(time_t *seconds, unsigned long *nanoseconds);
 int __getcwd(char *buf, size_t buflen);
 /* stat - see sys/stat.h */
 /* lstat - see sys/stat.h */
+void *mmap(void *addr, size_t len, int prot, int flags, int filehandle,
+	   off_t offset);
+int munmap(void *addr, size_t len);
+int msync(void *addr, size_t len, int flags);
+int shmget(int key, size_t size, int flags);
+void *shmat(int shmid, const void *addr, int flags);
+int shmdt(const void *addr);
+int shmctl(int shmid, int cmd, void *buf);
 
 /*
  * These are not themselves system calls, but wrapper routines in libc.
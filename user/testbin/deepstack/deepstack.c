@@ -0,0 +1,58 @@
+/*
+ * deepstack.c
+ *
+ *	Recurses far deeper than the initial one-page user stack, with a
+ *	page-sized frame at every level, so the kernel has to grow the
+ *	stack on demand. Each frame is checked on the way back up to make
+ *	sure none of the pages were lost or mixed up along the way.
+ *
+ *	Usage: deepstack [depth]	(default 256 levels, about 1M)
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <err.h>
+
+#define FrameWords	1000
+#define DefaultDepth	256
+
+static
+unsigned
+recurse(unsigned level, unsigned depth)
+{
+	volatile unsigned frame[FrameWords];
+	unsigned i, sum;
+
+	for (i = 0; i < FrameWords; i++) {
+		frame[i] = level * FrameWords + i;
+	}
+
+	sum = 0;
+	if (level < depth) {
+		sum = recurse(level + 1, depth);
+	}
+
+	for (i = 0; i < FrameWords; i++) {
+		if (frame[i] != level * FrameWords + i) {
+			errx(1, "level %u: word %u is %u", level, i, frame[i]);
+		}
+	}
+	return sum + 1;
+}
+
+int
+main(int argc, char *argv[])
+{
+	unsigned depth = DefaultDepth;
+
+	if (argc > 1) {
+		depth = atoi(argv[1]);
+	}
+
+	printf("deepstack: recursing %u levels\n", depth);
+	if (recurse(0, depth) != depth + 1) {
+		errx(1, "wrong number of levels came back");
+	}
+	printf("deepstack: passed\n");
+	return 0;
+}
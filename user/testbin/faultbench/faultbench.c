@@ -0,0 +1,73 @@
+/*
+ * faultbench.c
+ *
+ *	Measures the cost of page faults as the address space grows.
+ *	Every pass touches one word in each of the first N pages of a
+ *	large BSS array: the first touch of a page takes a zero-fill
+ *	fault, the second pass over a working set bigger than the TLB
+ *	takes a TLB refill for every page. Both go through the page
+ *	table lookup in vm_fault(), so running this on kernels with
+ *	different page table designs shows their fault cost side by side.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+
+#define PageSize	4096
+#define MaxPages	512
+
+static char pages[MaxPages][PageSize];
+
+/* nanoseconds per page between two timestamps */
+static
+unsigned long
+per_page(time_t s1, unsigned long ns1, time_t s2, unsigned long ns2,
+	 unsigned long npages)
+{
+	if (ns2 < ns1) {
+		ns2 += 1000000000;
+		s2--;
+	}
+	return (s2 - s1) * (1000000000 / npages) + (ns2 - ns1) / npages;
+}
+
+int
+main(void)
+{
+	time_t s1, s2;
+	unsigned long ns1, ns2;
+	unsigned long first, refill;
+	int n, i, done = 0;
+
+	printf("%8s %16s %16s\n", "pages", "first touch ns", "TLB refill ns");
+
+	for (n = 64; n <= MaxPages; n *= 2) {
+		/* touch the pages this size adds for the first time */
+		__time(&s1, &ns1);
+		for (i = done; i < n; i++) {
+			pages[i][0] = 1;
+		}
+		__time(&s2, &ns2);
+		first = per_page(s1, ns1, s2, ns2, n - done);
+		done = n;
+
+		/* all resident now; more than fits in the TLB */
+		__time(&s1, &ns1);
+		for (i = 0; i < n; i++) {
+			pages[i][0]++;
+		}
+		__time(&s2, &ns2);
+		refill = per_page(s1, ns1, s2, ns2, n);
+
+		printf("%8d %16lu %16lu\n", n, first, refill);
+	}
+
+	for (i = 0; i < MaxPages; i++) {
+		if (pages[i][0] < 2) {
+			printf("faultbench: page %d lost its contents\n", i);
+			exit(1);
+		}
+	}
+	return 0;
+}
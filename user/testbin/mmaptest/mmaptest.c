@@ -0,0 +1,181 @@
+/*
+ * mmaptest.c
+ *
+ *	Exercises mmap() of a regular file. Writes a file with write(),
+ *	then checks it through a private read-only mapping; scribbles on
+ *	a private writable mapping and makes sure the file didn't change;
+ *	scribbles on a shared mapping, both directly and from a forked
+ *	child, and makes sure msync() and munmap() put it in the file.
+ *
+ *	Usage: mmaptest
+ */
+
+#include <sys/types.h>
+#include <sys/mman.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <err.h>
+
+#define PageSize	4096
+#define FilePages	4
+#define FileSize	(FilePages * PageSize + 100)	/* ends mid-page */
+#define TestFile	"mmaptest.dat"
+
+static char buf[PageSize];
+
+static
+char
+pattern(unsigned pos, int gen)
+{
+	return (char)((pos / 7 + gen * 31) & 0x7f);
+}
+
+/*
+ * Check the file (through read()) against pattern generation GEN, or
+ * against GEN2 where a scribble() with STEP would have written.
+ */
+static
+void
+checkfile(int fd, int gen, int gen2, unsigned step)
+{
+	unsigned pos, i;
+	int len;
+	char want;
+
+	if (lseek(fd, 0, SEEK_SET) != 0) {
+		err(1, "lseek");
+	}
+	for (pos = 0; pos < FileSize; pos += len) {
+		len = read(fd, buf, sizeof(buf));
+		if (len <= 0) {
+			errx(1, "short read at %u", pos);
+		}
+		for (i = 0; i < (unsigned)len; i++) {
+			want = (step && (pos + i) % step == 0) ?
+				pattern(pos + i, gen2) : pattern(pos + i, gen);
+			if (buf[i] != want) {
+				errx(1, "file offset %u: %d, expected %d",
+				     pos + i, buf[i], want);
+			}
+		}
+	}
+}
+
+static
+void
+checkmap(const char *what, char *map, int gen)
+{
+	unsigned i;
+
+	for (i = 0; i < FileSize; i++) {
+		if (map[i] != pattern(i, gen)) {
+			errx(1, "%s offset %u: %d, expected %d",
+			     what, i, map[i], pattern(i, gen));
+		}
+	}
+	/* The rest of the last page reads as zero */
+	for (; i < FilePages * PageSize + PageSize; i++) {
+		if (map[i] != 0) {
+			errx(1, "%s offset %u past EOF: %d", what, i, map[i]);
+		}
+	}
+}
+
+static
+void
+scribble(char *map, int gen, unsigned step)
+{
+	unsigned i;
+
+	for (i = 0; i < FileSize; i += step) {
+		map[i] = pattern(i, gen);
+	}
+}
+
+static
+char *
+domap(int fd, int prot, int flags)
+{
+	void *p;
+
+	p = mmap(NULL, FileSize, prot, flags, fd, 0);
+	if (p == MAP_FAILED) {
+		err(1, "mmap");
+	}
+	return p;
+}
+
+int
+main(void)
+{
+	char *map;
+	unsigned pos, i;
+	int fd, status;
+	pid_t pid;
+
+	fd = open(TestFile, O_RDWR | O_CREAT | O_TRUNC, 0664);
+	if (fd < 0) {
+		err(1, "%s", TestFile);
+	}
+	for (pos = 0; pos < FileSize; pos += i) {
+		for (i = 0; i < PageSize && pos + i < FileSize; i++) {
+			buf[i] = pattern(pos + i, 0);
+		}
+		if (write(fd, buf, i) != (int)i) {
+			err(1, "write");
+		}
+	}
+
+	printf("mmaptest: private read-only mapping\n");
+	map = domap(fd, PROT_READ, MAP_PRIVATE);
+	checkmap("private", map, 0);
+	if (munmap(map, FileSize)) {
+		err(1, "munmap");
+	}
+
+	printf("mmaptest: private writable mapping\n");
+	map = domap(fd, PROT_READ | PROT_WRITE, MAP_PRIVATE);
+	scribble(map, 1, 1);
+	checkmap("private", map, 1);
+	if (munmap(map, FileSize)) {
+		err(1, "munmap");
+	}
+	checkfile(fd, 0, 0, 0);
+
+	printf("mmaptest: shared mapping, msync\n");
+	map = domap(fd, PROT_READ | PROT_WRITE, MAP_SHARED);
+	scribble(map, 2, 1);
+	if (msync(map, FileSize, MS_SYNC)) {
+		err(1, "msync");
+	}
+	checkfile(fd, 2, 2, 0);
+
+	printf("mmaptest: shared mapping, written by a child\n");
+	pid = fork();
+	if (pid < 0) {
+		err(1, "fork");
+	}
+	if (pid == 0) {
+		scribble(map, 3, 512);
+		_exit(0);
+	}
+	if (waitpid(pid, &status, 0) < 0) {
+		err(1, "waitpid");
+	}
+	for (i = 0; i < FileSize; i += 512) {
+		if (map[i] != pattern(i, 3)) {
+			errx(1, "child's write at %u not seen", i);
+		}
+	}
+	if (munmap(map, FileSize)) {
+		err(1, "munmap");
+	}
+	checkfile(fd, 2, 3, 512);
+
+	close(fd);
+	remove(TestFile);
+	printf("mmaptest: passed\n");
+	return 0;
+}
@@ -0,0 +1,144 @@
+/*
+ * shmtest.c
+ *
+ *	Exercises shared memory segments. A segment attached twice in one
+ *	process must show writes through one address at the other. A
+ *	child inherits the attachment across fork and writes to it, and a
+ *	second child finds the segment again by key and attaches it for
+ *	itself; the parent must see what both wrote. Finally the segment
+ *	is removed and detached.
+ *
+ *	Usage: shmtest
+ */
+
+#include <sys/types.h>
+#include <sys/shm.h>
+#include <sys/wait.h>
+#include <stdio.h>
+#include <unistd.h>
+#include <err.h>
+
+#define PageSize	4096
+#define SegPages	16
+#define SegSize		(SegPages * PageSize)
+#define SegKey		161
+
+static
+void
+check(const char *what, volatile char *seg, unsigned step, int gen)
+{
+	unsigned i;
+
+	for (i = 0; i < SegSize; i += step) {
+		if (seg[i] != (char)(i / step + gen)) {
+			errx(1, "%s: offset %u is %d, expected %d", what, i,
+			     seg[i], (char)(i / step + gen));
+		}
+	}
+}
+
+static
+void
+fill(volatile char *seg, unsigned step, int gen)
+{
+	unsigned i;
+
+	for (i = 0; i < SegSize; i += step) {
+		seg[i] = (char)(i / step + gen);
+	}
+}
+
+static
+void
+waitchild(pid_t pid)
+{
+	int status;
+
+	if (waitpid(pid, &status, 0) < 0) {
+		err(1, "waitpid");
+	}
+	if (!WIFEXITED(status) || WEXITSTATUS(status) != 0) {
+		errx(1, "child failed");
+	}
+}
+
+int
+main(void)
+{
+	char *seg, *alias, *other;
+	unsigned i;
+	int id;
+	pid_t pid;
+
+	id = shmget(SegKey, SegSize, IPC_CREAT | IPC_EXCL | 0600);
+	if (id < 0) {
+		err(1, "shmget");
+	}
+	seg = shmat(id, NULL, 0);
+	if (seg == (void *)-1) {
+		err(1, "shmat");
+	}
+	alias = shmat(id, NULL, SHM_RDONLY);
+	if (alias == (void *)-1) {
+		err(1, "shmat");
+	}
+
+	printf("shmtest: two attachments in one process\n");
+	for (i = 0; i < SegSize; i += 256) {
+		if (seg[i] != 0) {
+			errx(1, "fresh segment: offset %u is %d", i, seg[i]);
+		}
+	}
+	fill(seg, 256, 1);
+	check("alias", alias, 256, 1);
+
+	printf("shmtest: child writing through an inherited attachment\n");
+	pid = fork();
+	if (pid < 0) {
+		err(1, "fork");
+	}
+	if (pid == 0) {
+		check("child", seg, 256, 1);
+		fill(seg, 256, 2);
+		_exit(0);
+	}
+	waitchild(pid);
+	check("after child", seg, 256, 2);
+
+	printf("shmtest: child attaching the segment by key\n");
+	pid = fork();
+	if (pid < 0) {
+		err(1, "fork");
+	}
+	if (pid == 0) {
+		if (shmdt(seg) || shmdt(alias)) {
+			err(1, "shmdt in child");
+		}
+		id = shmget(SegKey, SegSize, 0);
+		if (id < 0) {
+			err(1, "shmget in child");
+		}
+		other = shmat(id, NULL, 0);
+		if (other == (void *)-1) {
+			err(1, "shmat in child");
+		}
+		fill(other, 256, 3);
+		_exit(0);
+	}
+	waitchild(pid);
+	check("after second child", alias, 256, 3);
+
+	if (shmctl(id, IPC_RMID, NULL)) {
+		err(1, "shmctl");
+	}
+	if (shmget(SegKey, SegSize, 0) >= 0) {
+		errx(1, "removed segment still found by key");
+	}
+	check("after removal", seg, 256, 3);
+	if (shmdt(seg) || shmdt(alias)) {
+		err(1, "shmdt");
+	}
+
+	printf("shmtest: passed\n");
+	return 0;
+}
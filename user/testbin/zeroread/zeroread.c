@@ -0,0 +1,85 @@
+/*
+ * zeroread.c
+ *
+ *	Reads through a large BSS array and a large sbrk'd area before
+ *	writing any of it, the way a program setting up a sparse table
+ *	would. Every page must read as zero; the kernel should be able to
+ *	back all of them with its one shared zero page (see "vs"). Then
+ *	every other page is written and everything is checked again, to
+ *	make sure the writes got private pages and left the rest alone.
+ *
+ *	Usage: zeroread [heap pages]	(default 256)
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <err.h>
+
+#define PageSize	4096
+#define BssPages	256
+#define DefaultHeapPages 256
+
+static char bss[BssPages * PageSize];
+
+static
+void
+check(const char *what, char *base, unsigned npages, int written)
+{
+	unsigned page, i;
+	char want;
+
+	for (page = 0; page < npages; page++) {
+		want = (written && page % 2 == 0) ? (char)page | 1 : 0;
+		for (i = 0; i < PageSize; i += 512) {
+			if (base[page * PageSize + i] != want) {
+				errx(1, "%s page %u offset %u: %d, expected %d",
+				     what, page, i,
+				     base[page * PageSize + i], want);
+			}
+		}
+	}
+}
+
+static
+void
+scribble(char *base, unsigned npages)
+{
+	unsigned page, i;
+
+	for (page = 0; page < npages; page += 2) {
+		for (i = 0; i < PageSize; i += 512) {
+			base[page * PageSize + i] = (char)page | 1;
+		}
+	}
+}
+
+int
+main(int argc, char *argv[])
+{
+	unsigned heappages = DefaultHeapPages;
+	char *heap;
+
+	if (argc > 1) {
+		heappages = atoi(argv[1]);
+	}
+
+	heap = sbrk(heappages * PageSize);
+	if (heap == (void *)-1) {
+		err(1, "sbrk");
+	}
+
+	printf("zeroread: reading %u BSS and %u heap pages\n",
+	       BssPages, heappages);
+	check("bss", bss, BssPages, 0);
+	check("heap", heap, heappages, 0);
+
+	printf("zeroread: writing every other page\n");
+	scribble(bss, BssPages);
+	scribble(heap, heappages);
+	check("bss", bss, BssPages, 1);
+	check("heap", heap, heappages, 1);
+
+	printf("zeroread: passed\n");
+	return 0;
+}